@@ -0,0 +1,33 @@
+#!/bin/bash
+# Compare the overhead of the MSR and perf backends on the same workload.
+# Usage: sudo bash Test/backend.sh [period in ms] [runs]
+cd "$(dirname "$0")/.."
+gcc -O1 Test/test.c -o Test/test 2>/dev/null
+period=${1:-1}
+runs=${2:-5}
+
+# Wall time of the workload alone, then under each backend
+elapsed() {
+	local start end
+	start=$(date +%s%N)
+	"$@" > /tmp/kleb_backend.out
+	end=$(date +%s%N)
+	echo $(( (end - start) / 1000 ))
+}
+
+for backend in none msr perf; do
+	total=0
+	for run in $(seq "$runs"); do
+		case $backend in
+		none) us=$(elapsed ./Test/test) ;;
+		msr) us=$(elapsed ./ioctl_start -t "$period" -o /tmp/kleb_backend.csv ./Test/test) ;;
+		perf) us=$(elapsed ./ioctl_start --perf -t "$period" -o /tmp/kleb_backend.csv ./Test/test) ;;
+		esac
+		total=$((total + us))
+	done
+	echo "== $backend: average wall time $((total / runs)) us over $runs runs"
+	if [ "$backend" != none ]; then
+		grep "^Timer callback\|^Switch counters\|# of Sample" /tmp/kleb_backend.out
+	fi
+done
+rm -f /tmp/kleb_backend.out /tmp/kleb_backend.csv /tmp/kleb_backend_task.csv
@@ -0,0 +1,72 @@
+/*** Calibrated Program for K-LEB ***/
+/* Retires a known number of user instructions: every thread runs a loop of
+   exactly two instructions per iteration. Threads can yield and hop between
+   CPUs to exercise the switch hook and migrations.
+   Usage: calib <iterations per thread> [threads] [migrate] */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define CHUNK 100000	// Iterations between two yields with migrate
+
+static unsigned long iterations;
+static int migrate;
+
+/* dec and jnz, 2 instructions per iteration */
+static void loop(unsigned long n)
+{
+	if (n == 0)
+		return;
+	__asm__ volatile("1:\n\tdec %0\n\tjnz 1b" : "+r"(n) : : "cc");
+}
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long done = 0;
+	cpu_set_t set;
+
+	if (!migrate)
+	{
+		loop(iterations);
+		return NULL;
+	}
+	while (done < iterations)
+	{
+		unsigned long n = iterations - done < CHUNK ? iterations - done : CHUNK;
+
+		/* Next CPU every chunk */
+		CPU_ZERO(&set);
+		CPU_SET((id + done / CHUNK) % ncpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+		loop(n);
+		done += n;
+		sched_yield();
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads = argc > 2 ? atoi(argv[2]) : 1;
+	pthread_t tid[256];
+
+	iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000000;
+	migrate = argc > 3 && strcmp(argv[3], "migrate") == 0;
+	if (threads < 1 || threads > 256)
+		threads = 1;
+
+	for (long i = 1; i < threads; ++i)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+	worker(0);
+	for (int i = 1; i < threads; ++i)
+		pthread_join(tid[i], NULL);
+
+	printf("Expected loop instructions: %lu\n", 2 * iterations * threads);
+	return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Reload kleb.ko under a running kleb-daemon and check that it logs again.
+# Usage: sudo bash Test/daemon_reload.sh
+cd "$(dirname "$0")/.."
+dir=$(mktemp -d)
+fail() {
+	echo "FAIL: $*"
+	kill -INT "$pid" 2>/dev/null
+	wait "$pid" 2>/dev/null
+	rm -rf "$dir"
+	exit 1
+}
+
+lsmod | grep -q '^kleb ' || insmod kleb.ko || exit 1
+./kleb-daemon -d "$dir" -t 10 &
+pid=$!
+sleep 3
+before=$(ls "$dir" | wc -l)
+[ "$before" -gt 0 ] || fail "no log before the reload"
+
+# The open device holds the module
+rmmod kleb 2>/dev/null && fail "rmmod succeeded while the daemon held the device"
+
+kill -USR1 "$pid"
+sleep 2
+rmmod kleb || fail "rmmod after SIGUSR1"
+insmod kleb.ko || fail "insmod"
+sleep 4
+
+after=$(ls "$dir" | wc -l)
+newest=$(ls -t "$dir"/kleb-* | head -1)
+[ "$after" -gt "$before" ] || fail "no new log after the reload"
+[ "$(wc -l < "$newest")" -gt 1 ] || fail "no samples in $newest"
+echo "PASS: $((after - before)) new log(s), $(($(wc -l < "$newest") - 1)) samples in $(basename "$newest")"
+kill -INT "$pid"
+wait "$pid"
+rm -rf "$dir"
@@ -0,0 +1,14 @@
+#!/bin/bash
+# Measure timer jitter and the shortest sustainable period.
+# Usage: sudo bash Test/hifreq.sh [periods in ms]
+cd "$(dirname "$0")/.."
+gcc -O1 Test/test.c -o Test/test 2>/dev/null
+periods=${@:-"0.001 0.002 0.005 0.01 0.1 1"}
+
+for period in $periods; do
+	for mode in "" "-H"; do
+		echo "== period ${period} ms ${mode:-default}"
+		./ioctl_start $mode -t "$period" -o /tmp/kleb_hifreq.csv ./Test/test | grep "^Timer\|^Estimated\|# of Sample"
+	done
+done
+rm -f /tmp/kleb_hifreq.csv /tmp/kleb_hifreq_task.csv
@@ -0,0 +1,108 @@
+/*** perf_event_open Reference for K-LEB ***/
+/* Runs a program under perf counters, inherited by its threads and children,
+   and prints the totals in K-LEB's column names.
+   Usage: perfref [-m 1|2|3] <program> [args], -m as ioctl_start: user, os or both */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#define NUM_REF 3
+
+static const char *names[NUM_REF] = { "INST_RETIRED", "CPU_CLK_CYCLE", "CPU_REF_CYCLE" };
+static const unsigned long long configs[NUM_REF] = { PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_REF_CPU_CYCLES };
+
+static int open_counter(int pid, unsigned long long config, int mode)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.enable_on_exec = 1;
+	attr.inherit = 1;
+	attr.exclude_user = !(mode & 1);
+	attr.exclude_kernel = !(mode & 2);
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int mode = 1, first = 1;
+	int go[2], fd[NUM_REF];
+	struct timespec t0, t1;
+	int pid, status;
+
+	if (argc > 2 && strcmp(argv[1], "-m") == 0)
+	{
+		mode = atoi(argv[2]) & 3;
+		first = 3;
+	}
+	if (first >= argc || mode == 0)
+	{
+		printf("Usage: perfref [-m 1|2|3] <program> [args]\n");
+		return 1;
+	}
+
+	/* The child waits until the counters are attached, they start at exec */
+	if (pipe(go) < 0)
+	{
+		perror("Error: ");
+		return 1;
+	}
+	pid = fork();
+	if (pid == 0)
+	{
+		char c;
+
+		close(go[1]);
+		if (read(go[0], &c, 1) != 1)
+			_exit(1);
+		execvp(argv[first], &argv[first]);
+		perror("Error: ");
+		_exit(1);
+	}
+	close(go[0]);
+	for (int i = 0; i < NUM_REF; ++i)
+	{
+		fd[i] = open_counter(pid, configs[i], mode);
+		if (fd[i] < 0)
+		{
+			perror("perf_event_open");
+			kill(pid, SIGKILL);
+			return 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (write(go[1], "G", 1) != 1)
+		perror("Error: ");
+	close(go[1]);
+	waitpid(pid, &status, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (int i = 0; i < NUM_REF; ++i)
+	{
+		unsigned long long val[3] = { 0 };
+
+		if (read(fd[i], val, sizeof(val)) != sizeof(val))
+			perror("Error: ");
+		/* Multiplexed counters are scaled like perf stat does */
+		if (val[2] && val[2] < val[1])
+			val[0] = (double)val[0] * val[1] / val[2];
+		printf("%s %llu%s\n", names[i], val[0], (val[2] < val[1]) ? " (scaled)" : "");
+		close(fd[i]);
+	}
+	printf("WALL_US %llu\n", (unsigned long long)((t1.tv_sec - t0.tv_sec) * 1000000ULL + (t1.tv_nsec - t0.tv_nsec) / 1000));
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,43 @@
+/*** rdpmc Test Program for K-LEB ***/
+/* sudo ./ioctl_start --rdpmc -e LOAD,STORE ./Test/rdpmc 2 */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "../kleb_rdpmc.h"
+
+static const char *names[KLEB_RDPMC_MAX] = { "E1", "E2", "E3", "E4" };
+
+int main(int argc, char *argv[])
+{
+	unsigned int num_events = argc > 1 ? atoi(argv[1]) : 0;
+	unsigned long long counts[KLEB_RDPMC_MAX], empty[KLEB_RDPMC_MAX];
+	kleb_rdpmc_t r;
+	cpu_set_t cpus;
+	volatile long sum = 0;
+
+	/* A region is only meaningful on one CPU */
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	kleb_rdpmc_init(&r, num_events);
+
+	/* Cost of the reads themselves */
+	kleb_rdpmc_begin(&r);
+	kleb_rdpmc_end(&r, empty);
+
+	kleb_rdpmc_begin(&r);
+	for (long i = 0; i < 1000; i++)
+		sum += i;
+	kleb_rdpmc_end(&r, counts);
+
+	/* The header clamps the event count, the last 3 counters are fixed */
+	num_events = r.num - 3;
+	for (unsigned int i = 0; i < r.num; i++)
+	{
+		const char *name = i < num_events ? names[i] : (const char *[]){ "INST", "CYCLES", "REF" }[i - num_events];
+		printf("%s: %llu (empty region %llu)\n", name, counts[i], empty[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*** Stress Program for K-LEB ***/
+/* Threads migrate between CPUs, yield and fork children so that the
+   context switch hook, the per-CPU timers and the ring all race. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NUM_THREADS 8
+#define ITERATIONS 2000
+
+volatile unsigned long sink;
+
+void spin(int n)
+{
+	int i;
+	for(i = 0; i < n; ++i)
+		sink += i * 7;
+}
+
+void *worker(void *arg)
+{
+	long id = (long)arg;
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	int i;
+
+	for(i = 0; i < ITERATIONS; ++i){
+		/* Hop to another CPU every few iterations */
+		if(i % 16 == 0){
+			CPU_ZERO(&set);
+			CPU_SET((id + i / 16) % ncpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+		spin(20000);
+		if(i % 4 == 0)
+			sched_yield();
+		/* Short lived children */
+		if(id == 0 && i % 200 == 0){
+			pid_t child = fork();
+			if(child == 0){
+				spin(100000);
+				_exit(0);
+			}
+			waitpid(child, NULL, 0);
+		}
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t threads[NUM_THREADS];
+	long i;
+
+	printf("K-LEB stress program start with PID: %d\n", getpid());
+	for(i = 0; i < NUM_THREADS; ++i)
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	for(i = 0; i < NUM_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	printf("K-LEB stress program exit\n");
+	return 0;
+}
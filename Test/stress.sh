@@ -0,0 +1,25 @@
+#!/bin/bash
+# Run the stress workload under K-LEB and sanity check the log.
+# Usage: sudo bash Test/stress.sh [extra ioctl_start options]
+set -e
+cd "$(dirname "$0")/.."
+gcc -O1 -pthread Test/stress.c -o Test/stress
+./ioctl_start -e LOAD,STORE -t 1 -o stress.csv "$@" ./Test/stress
+
+log=stress.csv
+awk -F, '
+NR == 1 { for (i = 1; i <= NF; ++i) col[$i] = i; next }
+$col["TIME_NS"] == "" { next }
+{
+	# Counters are 48 bit wide, a torn or negative delta shows up huge
+	for (i = 1; i < col["PERIOD_NS"]; ++i)
+		if ($i > 2^48) { printf("line %d: bad counter %s\n", NR, $i); bad = 1 }
+	cpu = $col["CPU"]
+	if ($col["TIME_NS"] < last[cpu]) { printf("line %d: time went backwards\n", NR); bad = 1 }
+	last[cpu] = $col["TIME_NS"]
+	rows++
+}
+END {
+	printf("%d samples checked\n", rows)
+	exit bad || rows == 0
+}' "$log"
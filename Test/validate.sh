@@ -0,0 +1,76 @@
+#!/bin/bash
+# Check K-LEB's instruction counts against a calibrated workload and perf_event_open, and measure the overhead.
+# Usage: sudo bash Test/validate.sh [iterations] [period in ms] [mode 1|2|3] [extra ioctl_start options]
+cd "$(dirname "$0")/.."
+gcc -O1 -pthread Test/calib.c -o Test/calib || exit 1
+gcc -O1 Test/perfref.c -o Test/perfref || exit 1
+iterations=${1:-200000000}
+period=${2:-1}
+mode=${3:-1}
+shift $(( $# < 3 ? $# : 3 ))
+threads=8
+cpu=$(( $(nproc) - 1 ))
+log=/tmp/kleb_validate.csv
+
+# Sum of a column of a K-LEB log
+column_sum() {
+	awk -F, -v name="$2" '
+	NR == 1 { for (i = 1; i <= NF; ++i) if ($i == name) c = i; next }
+	c && $c != "" { sum += $c }
+	END { printf("%.0f\n", sum) }' "$1"
+}
+
+now_us() {
+	echo $(( $(date +%s%N) / 1000 ))
+}
+
+# Wall time of a command in us, its output in /tmp/kleb_validate.out
+timed() {
+	local start end
+	start=$(now_us)
+	"$@" > /tmp/kleb_validate.out 2>&1
+	end=$(now_us)
+	echo $((end - start))
+}
+
+report() {
+	local name=$1 expected=$2 perf=$3 kleb=$4 base_us=$5 kleb_us=$6
+	awk -v n="$name" -v e="$expected" -v p="$perf" -v k="$kleb" -v b="$base_us" -v t="$kleb_us" 'BEGIN {
+		printf("%-8s %14.0f %14.0f %14.0f %9.3f %9.3f %9.2f\n", n, e, p, k,
+			e ? (k - e) / e * 100 : 0, p ? (k - p) / p * 100 : 0, b ? (t - b) / b * 100 : 0)
+	}'
+}
+
+printf "%-8s %14s %14s %14s %9s %9s %9s\n" MODE EXPECTED PERF KLEB ERR_EXP% ERR_PERF% OVERHEAD%
+
+# One process, then threads that yield and migrate every chunk
+for workload in pid threads; do
+	if [ $workload = pid ]; then
+		cmd=(./Test/calib "$iterations" 1)
+		expected=$((2 * iterations))
+	else
+		cmd=(./Test/calib $((iterations / threads)) $threads migrate)
+		expected=$((2 * (iterations / threads) * threads))
+	fi
+	base_us=$(timed "${cmd[@]}")
+	./Test/perfref -m "$mode" "${cmd[@]}" > /tmp/kleb_validate.ref
+	perf=$(awk '$1 == "INST_RETIRED" { print $2 }' /tmp/kleb_validate.ref)
+	kleb_us=$(timed ./ioctl_start -m "$mode" -t "$period" -o $log "$@" "${cmd[@]}")
+	kleb=$(column_sum $log INST_RETIRED)
+	report $workload "$expected" "${perf:-0}" "$kleb" "$base_us" "$kleb_us"
+done
+
+# System-wide on one CPU, the workload is pinned there and the rest of the CPU's load adds up
+./Test/perfref -m "$mode" taskset -c $cpu ./Test/calib "$iterations" 1 > /tmp/kleb_validate.ref
+perf=$(awk '$1 == "INST_RETIRED" { print $2 }' /tmp/kleb_validate.ref)
+base_us=$(timed taskset -c $cpu ./Test/calib "$iterations" 1)
+./ioctl_start -a -C $cpu -m "$mode" -t "$period" -o $log "$@" > /tmp/kleb_validate.sys 2>&1 &
+kleb_pid=$!
+sleep 1
+kleb_us=$(timed taskset -c $cpu ./Test/calib "$iterations" 1)
+kill -INT $kleb_pid
+wait $kleb_pid
+kleb=$(column_sum $log INST_RETIRED)
+report system "$((2 * iterations))" "${perf:-0}" "$kleb" "$base_us" "$kleb_us"
+
+rm -f /tmp/kleb_validate.* /tmp/kleb_validate_task.csv
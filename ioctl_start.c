@@ -14,23 +14,70 @@ GNU General Public License for more details.
 
 You should have received a copy of the GNU General Public License
 along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+#define _GNU_SOURCE	// pipe2
 #include <stdio.h>
-#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
 #include <time.h>
-#include "kleb.h"
+#include "libkleb.h"
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <ctype.h>
+#include <sys/ptrace.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <ctype.h>
 
 /* Check interrupt */
 static int checkint;
 static char logpath[200];
+static unsigned long long lost_samples;
+static int num_counters;
+static int topdown_base = -1;	// Counter index of the slots in topdown mode
+static int energy_base = -1;	// Counter index of the package energy with -E
+static double energy_unit;	// Joules per energy unit
+static double energy_total[NUM_ENERGY_COUNTERS];
+static unsigned long long inst_total;
+static int inst_index;	// Counter index of the instructions retired
+
+/* Sample logs, one per target process or event group when several are monitored */
+static FILE *logfps[MAX_TARGETS > MAX_EVENT_GROUPS ? MAX_TARGETS : MAX_EVENT_GROUPS];
+static int num_logs;
+static int binary_log;	// Records as found in the ring instead of CSV
+static int numa_drain;	// Drain from the node of the ring
+static FILE *lbrfp;	// Decoded branch snapshots
+static unsigned int lbr_format;
+static FILE *memfp;	// Memory samples
+
+/* Memory samples bucketed by page, mapped to the last maps seen of each target */
+typedef struct {
+	unsigned long long key;	// Page number, target in the top byte
+	unsigned long long samples;
+	unsigned long long lat_sum;
+	unsigned long long lat_max;
+} mem_page_t;
+
+typedef struct {
+	unsigned long long start, end;
+	char name[64];
+} mem_map_t;
+
+static mem_page_t *mem_pages;
+static size_t mem_pages_size, mem_pages_used;
+static unsigned long long mem_samples, mem_no_addr;
+static mem_map_t *mem_maps[MAX_TARGETS];
+static size_t mem_num_maps[MAX_TARGETS];
+static time_t mem_maps_time;
+#define MEM_PAGE_SHIFT 12
+
+/* Session with the module */
+static kleb_session_t *session;
+
+/* Launched program, held before its first instruction until counters are armed */
+static int launched;
+static int launch_traced;	// Stopped at exec by ptrace, else waiting on launch_go
+static int launch_go = -1;
 
 /* Handle interrupt */
 void sigintHandler(int sig_num){
@@ -38,88 +85,601 @@ void sigintHandler(int sig_num){
 	printf("Stop monitoring....\n");
 	checkint=1;
 }
-/* Convert event name to event code */
-unsigned int NameToRawConfigMask(char* event_name)
+/* Parse <binary>:<symbol> for function attribution */
+void add_uprobe(char* arg)
 {
-	/* Branch Events **/
-	if      (strcmp(event_name,"BR_RET") == 0) return BR_RET;
-	else if (strcmp(event_name,"BR_MISP_RET") == 0) return BR_MISP_RET;
-	else if (strcmp(event_name,"BR_EXEC") == 0) return BR_EXEC;
-	else if (strcmp(event_name,"MISP_BR_ANY") == 0) return MISP_BR_ANY;
-	else if (strcmp(event_name,"MISP_BR_UN") == 0) return MISP_BR_UN;
-	else if (strcmp(event_name,"MISP_BR_C") == 0) return MISP_BR_C;
-	/** Cache Events **/
-	else if (strcmp(event_name,"LOAD") == 0) return LOAD;
-	else if (strcmp(event_name,"STORE") == 0) return STORE;
-	else if (strcmp(event_name,"L1_ICACHE_STALL") == 0) return L1_ICACHE_STALL;
-	else if (strcmp(event_name,"L1_ICACHE_REF") == 0) return L1_ICACHE_REF;
-	else if (strcmp(event_name,"L1_ICACHE_MISS") == 0) return L1_ICACHE_MISS;
-	else if (strcmp(event_name,"L1_ICACHE_HIT") == 0) return L1_ICACHE_HIT;
-	else if (strcmp(event_name,"L1_DCACHE_REF") == 0) return L1_DCACHE_REF;
-	else if (strcmp(event_name,"L1_DCACHE_MISS") == 0) return L1_DCACHE_MISS;
-	else if (strcmp(event_name,"L1_DCACHE_HIT") == 0) return L1_DCACHE_HIT;
-	else if (strcmp(event_name,"L2_DATA_REF") == 0) return L2_DATA_REF;
-	else if (strcmp(event_name,"L2_DATA_HIT") == 0) return L2_DATA_HIT;
-	else if (strcmp(event_name,"LLC") == 0) return LLC;
-	else if (strcmp(event_name,"MISS_LLC") == 0) return MISS_LLC;
-	else if (strcmp(event_name,"MEM_LOAD_RETIRED_LLC_MISS") == 0) return MEM_LOAD_RETIRED_LLC_MISS;
-	/** Instruction Events **/
-	else if (strcmp(event_name,"INST_FP") == 0) return INST_FP;
-	else if (strcmp(event_name,"ARITH_MULT") == 0) return ARITH_MULT;
-	else if (strcmp(event_name,"ARITH_DIV") == 0) return ARITH_DIV;
-	/** Proc calls Events **/
-	else if (strcmp(event_name,"CALL") == 0) return CALL;
-	else if (strcmp(event_name,"CALL_D_EXEC") == 0) return CALL_D_EXEC;
-	else if (strcmp(event_name,"CALL_ID_EXEC") == 0) return CALL_ID_EXEC;
-	else if (strcmp(event_name,"MISP_CALL") == 0) return MISP_CALL;
-	/** TLB Events **/
-	else if (strcmp(event_name,"MISS_ITLB") == 0) return MISS_ITLB;
-	else if (strcmp(event_name,"MISS_DTLB") == 0) return MISS_DTLB;
-	else if (strcmp(event_name,"STLB_HIT") == 0) return STLB_HIT;
-	/* UNKNOWN Event */
-	else return UNKNOWN_EVENT;
+	int id = kleb_add_function(session, arg);
+	if(id == -ENOSPC || id == -EINVAL){
+		printf("Function must be given as <binary>:<symbol>, up to %d functions\n", MAX_UPROBES);
+		exit(0);
+	}
+	if(id < 0){
+		printf("Cannot find function %s\n", arg);
+		exit(0);
+	}
+	printf("Function %s at %s\n", kleb_function_name(session, id), arg);
+}
+
+/* Output.csv -> Output<suffix> */
+void side_log_path(char* path, const char* suffix)
+{
+	strcpy(path, logpath);
+	char *ext = strrchr(path, '.');
+	if(ext != NULL && (strcmp(ext, ".csv") == 0 || strcmp(ext, ".kleb") == 0)){
+		*ext = '\0';
+	}
+	strcat(path, suffix);
 }
 
-int val_extract(unsigned int** hardware_events_buffer, int recording, int event,  FILE* log_path)
+/* Column names of the counters of a sample, energy is only sampled per tick */
+void log_counter_names(FILE* fp, kleb_ioctl_args_t kleb_ioctl_args, int with_energy)
 {
-	int sample_count=0;
-	int checkempty = 0;
-	int i,j;
-	for ( j=0; j < recording && !checkempty; ++j ) {
-		for ( i=0; i < (event + 3) && !checkempty; ++i ) { 
-			if(hardware_events_buffer[i][j]==-10)
-			{
-				/* End of data buffer */
-				checkempty = 1;
-				break;
+	for(unsigned int j = 0; j < kleb_ioctl_args.num_events; ++j){
+		fprintf(fp, "%x,", kleb_ioctl_args.counter[j]);
+	}
+	fprintf(fp, "INST_RETIRED,CPU_CLK_CYCLE,CPU_REF_CYCLE,");
+	if(kleb_ioctl_args.topdown){
+		fprintf(fp, "SLOTS,RETIRING,BAD_SPEC,FRONTEND_BOUND,BACKEND_BOUND,");
+	}
+	if(kleb_ioctl_args.rapl && with_energy){
+		fprintf(fp, "PKG_J,CORE_J,DRAM_J,");
+	}
+}
+
+/* Counter values, top-down categories as fractions of the slots and energy in joules */
+void log_counters(FILE* fp, const unsigned long long *counters, int with_energy)
+{
+	int n = (energy_base >= 0 && !with_energy) ? energy_base : num_counters;
+
+	for(int j = 0; j < n; ++j){
+		if(energy_base >= 0 && j >= energy_base){
+			fprintf(fp, "%.6f,", counters[j]*energy_unit);
+		}
+		else if(topdown_base >= 0 && j > topdown_base){
+			unsigned long long slots = counters[topdown_base];
+			fprintf(fp, "%.4f,", slots ? (double)counters[j]/((double)slots*TOPDOWN_SCALE) : 0.0);
+		}
+		else{
+			fprintf(fp, "%llu,", counters[j]);
+		}
+	}
+}
+
+/* Write per-thread and per-function totals next to the sample log */
+void func_extract(kleb_ioctl_args_t kleb_ioctl_args)
+{
+	char funcpath[220];
+	kleb_func_stats_t entries[MAX_UPROBE_THREADS];
+	kleb_func_stats_t totals[MAX_UPROBES];
+	int num_entries, i, j;
+
+	num_entries = kleb_func_stats(session, entries, MAX_UPROBE_THREADS);
+	if(num_entries < 0){
+		printf("ioctl failed and returned errno %s \n",strerror(-num_entries));
+		return;
+	}
+
+	side_log_path(funcpath, "_func.csv");
+	FILE *funcfp = fopen(funcpath, "w");
+	if(funcfp == NULL){
+		fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+		return;
+	}
+
+	fprintf(funcfp, "FUNCTION,TID,CALLS,INEXACT,");
+	log_counter_names(funcfp, kleb_ioctl_args, 0);
+	fprintf(funcfp, "\n");
+
+	memset(totals, 0, sizeof(totals));
+	for(i = 0; i < num_entries; ++i){
+		kleb_func_stats_t *e = &entries[i];
+		fprintf(funcfp, "%s,%d,%llu,%llu,", kleb_function_name(session, e->id), e->pid, e->calls, e->inexact);
+		totals[e->id].calls += e->calls;
+		totals[e->id].inexact += e->inexact;
+		log_counters(funcfp, e->counter, 0);
+		for(j = 0; j < num_counters; ++j){
+			totals[e->id].counter[j] += e->counter[j];
+		}
+		fprintf(funcfp, "\n");
+	}
+
+	for(i = 0; kleb_function_name(session, i) != NULL; ++i){
+		const char *name = kleb_function_name(session, i);
+		fprintf(funcfp, "%s,all,%llu,%llu,", name, totals[i].calls, totals[i].inexact);
+		log_counters(funcfp, totals[i].counter, 0);
+		fprintf(funcfp, "\n");
+
+		unsigned long long inst = totals[i].counter[kleb_ioctl_args.num_events];
+		unsigned long long cycles = totals[i].counter[kleb_ioctl_args.num_events+1];
+		printf("Function %s: %llu calls, %llu instructions, IPC %.3f\n", name, totals[i].calls, inst, cycles ? (double)inst/cycles : 0.0);
+	}
+	fclose(funcfp);
+	printf("Function Log Path: %s\n", funcpath);
+}
+
+/* Write exact per-thread totals next to the sample log */
+void task_extract(kleb_ioctl_args_t kleb_ioctl_args)
+{
+	char taskpath[220];
+	static kleb_task_stats_t entries[MAX_TASKS];
+	int num_entries, i;
+
+	num_entries = kleb_task_stats(session, entries, MAX_TASKS);
+	if(num_entries < 0){
+		printf("ioctl failed and returned errno %s \n",strerror(-num_entries));
+		return;
+	}
+
+	side_log_path(taskpath, "_task.csv");
+	FILE *taskfp = fopen(taskpath, "w");
+	if(taskfp == NULL){
+		fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+		return;
+	}
+
+	fprintf(taskfp, "TID,PID,SWITCHES,");
+	log_counter_names(taskfp, kleb_ioctl_args, 0);
+	fprintf(taskfp, "\n");
+
+	for(i = 0; i < num_entries; ++i){
+		kleb_task_stats_t *e = &entries[i];
+		fprintf(taskfp, "%d,%d,%llu,", e->pid, e->tgid, e->switches);
+		log_counters(taskfp, e->counter, 0);
+		fprintf(taskfp, "\n");
+	}
+	fclose(taskfp);
+	printf("Thread Log Path: %s (%d threads)\n", taskpath, num_entries);
+}
+
+/* Report how closely the timers kept the requested period */
+void timer_report(kleb_ioctl_args_t kleb_ioctl_args)
+{
+	kleb_timer_stats_t stats;
+
+	if(kleb_timer_stats(session, &stats) < 0 || stats.ticks == 0){
+		return;
+	}
+	unsigned long long lat_avg = stats.lat_sum_ns/stats.ticks;
+	unsigned long long cost_avg = stats.cost_sum_ns/stats.ticks;
+	printf("Timer: %llu ticks, %llu missed periods\n", stats.ticks, stats.missed);
+	printf("Timer latency (ns): min %llu avg %llu max %llu\n", stats.lat_min_ns, lat_avg, stats.lat_max_ns);
+	printf("Timer callback (ns): avg %llu max %llu\n", cost_avg, stats.cost_max_ns);
+	if(stats.switches > 0){
+		printf("Switch counters (cycles): avg %llu over %llu switches\n", stats.switch_cycles/stats.switches, stats.switches);
+	}
+	/* A tick is sustainable when it is served and done before the next one */
+	printf("Estimated minimum period: %llu ns (requested %u ns)\n", lat_avg + stats.cost_max_ns, kleb_ioctl_args.delay_in_ns);
+}
+
+/* One row per branch, most recent first */
+void log_branches(const kleb_record_t *rec, const unsigned long long *branches)
+{
+	unsigned int num = (rec->size - RECORD_HDR_WORDS)/2;
+
+	for(unsigned int i = 0; i < num; ++i){
+		unsigned long long from = branches[2*i], to = branches[2*i+1];
+		int mispred = 0;
+		/* From format 3 the top bits of from are flags, addresses are 48-bit sign extended */
+		if(lbr_format >= 3){
+			mispred = from >> 63;
+			from = (unsigned long long)((long long)(from << 16) >> 16);
+			to = (unsigned long long)((long long)(to << 16) >> 16);
+		}
+		fprintf(lbrfp, "%llu,%d,%d,%u,0x%llx,0x%llx,%d,\n", rec->time_ns, rec->cpu, rec->group, i, from, to, mispred);
+	}
+}
+
+/* Count a sample on its page */
+void mem_add(int group, unsigned long long addr, unsigned long long latency)
+{
+	if(mem_pages_used*2 >= mem_pages_size){
+		/* Grow and rehash at half load */
+		size_t old_size = mem_pages_size;
+		mem_page_t *old = mem_pages;
+		mem_pages_size = old_size ? old_size*2 : 4096;
+		mem_pages = calloc(mem_pages_size, sizeof(mem_page_t));
+		if(mem_pages == NULL){
+			fprintf(stderr,"Error allocating memory buckets\n");
+			exit(0);
+		}
+		mem_pages_used = 0;
+		for(size_t i = 0; i < old_size; ++i){
+			if(old[i].samples){
+				size_t h = (old[i].key*0x9e3779b97f4a7c15ULL) & (mem_pages_size-1);
+				while(mem_pages[h].samples){
+					h = (h+1) & (mem_pages_size-1);
+				}
+				mem_pages[h] = old[i];
+				++mem_pages_used;
 			}
-			else{
-				fprintf(log_path, "%d,", hardware_events_buffer[i][j]);
+		}
+		free(old);
+	}
+
+	unsigned long long key = ((unsigned long long)group << 56) | ((addr >> MEM_PAGE_SHIFT) & ((1ULL << 56)-1));
+	size_t h = (key*0x9e3779b97f4a7c15ULL) & (mem_pages_size-1);
+	while(mem_pages[h].samples && mem_pages[h].key != key){
+		h = (h+1) & (mem_pages_size-1);
+	}
+	if(mem_pages[h].samples == 0){
+		mem_pages[h].key = key;
+		++mem_pages_used;
+	}
+	mem_pages[h].samples++;
+	mem_pages[h].lat_sum += latency;
+	if(latency > mem_pages[h].lat_max){
+		mem_pages[h].lat_max = latency;
+	}
+}
+
+/* Keep the mappings of each live target, at most once a second */
+void mem_maps_snapshot(kleb_ioctl_args_t kleb_ioctl_args)
+{
+	int num = kleb_ioctl_args.num_targets ? (int)kleb_ioctl_args.num_targets : 1;
+	time_t now = time(NULL);
+
+	if(kleb_ioctl_args.pid == 1 || now == mem_maps_time){
+		return;
+	}
+	mem_maps_time = now;
+	for(int i = 0; i < num; ++i){
+		char path[64], line[512];
+		int pid = kleb_ioctl_args.num_targets ? kleb_ioctl_args.targets[i] : kleb_ioctl_args.pid;
+		snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+		FILE *fp = fopen(path, "r");
+		if(fp == NULL){
+			/* Exited, the last maps stay */
+			continue;
+		}
+		mem_num_maps[i] = 0;
+		size_t cap = 0;
+		while(fgets(line, sizeof(line), fp) != NULL){
+			unsigned long long start, end;
+			int name_at = 0;
+			if(sscanf(line, "%llx-%llx %*s %*s %*s %*s %n", &start, &end, &name_at) < 2){
+				continue;
+			}
+			if(mem_num_maps[i] == cap){
+				cap = cap ? cap*2 : 256;
+				mem_maps[i] = realloc(mem_maps[i], cap*sizeof(mem_map_t));
+				if(mem_maps[i] == NULL){
+					fprintf(stderr,"Error allocating mappings\n");
+					exit(0);
+				}
+			}
+			mem_map_t *m = &mem_maps[i][mem_num_maps[i]++];
+			m->start = start;
+			m->end = end;
+			char *name = line + name_at;
+			name[strcspn(name, "\n")] = '\0';
+			/* Keep the file name of long paths */
+			if(strlen(name) >= sizeof(m->name)){
+				char *base = strrchr(name, '/');
+				name = base ? base+1 : name;
 			}
+			snprintf(m->name, sizeof(m->name), "%s", name[0] ? name : "[anon]");
+		}
+		fclose(fp);
+	}
+}
+
+/* Mapping of an address in a target, maps are sorted by address */
+const char *mem_map_name(int group, unsigned long long addr)
+{
+	if(addr >= 0xffff800000000000ULL){
+		return "[kernel]";
+	}
+	if(group >= MAX_TARGETS || mem_num_maps[group] == 0){
+		return "[unknown]";
+	}
+	size_t lo = 0, hi = mem_num_maps[group];
+	while(lo < hi){
+		size_t mid = (lo+hi)/2;
+		if(addr < mem_maps[group][mid].start){
+			hi = mid;
+		}
+		else if(addr >= mem_maps[group][mid].end){
+			lo = mid+1;
+		}
+		else{
+			return mem_maps[group][mid].name;
+		}
+	}
+	return "[unmapped]";
+}
+
+int mem_page_cmp(const void *a, const void *b)
+{
+	const mem_page_t *pa = a, *pb = b;
+	return (pa->samples < pb->samples) - (pa->samples > pb->samples);
+}
+
+/* Hot pages and mappings next to the sample log */
+void mem_report(kleb_ioctl_args_t kleb_ioctl_args)
+{
+	char path[220];
+	typedef struct {
+		int group;
+		const char *name;
+		unsigned long long samples, lat_sum, pages;
+	} mem_total_t;
+	mem_total_t *totals = calloc(mem_pages_used+1, sizeof(mem_total_t));
+	size_t num_totals = 0;
+
+	if(totals == NULL){
+		return;
+	}
+	/* Compact then sort the buckets, hottest first */
+	size_t n = 0;
+	for(size_t i = 0; i < mem_pages_size; ++i){
+		if(mem_pages[i].samples){
+			mem_pages[n++] = mem_pages[i];
+		}
+	}
+	qsort(mem_pages, n, sizeof(mem_page_t), mem_page_cmp);
+
+	side_log_path(path, "_mem_pages.csv");
+	FILE *fp = fopen(path, "w");
+	if(fp == NULL){
+		fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+		free(totals);
+		return;
+	}
+	fprintf(fp, "TARGET,PAGE,SAMPLES,AVG_LATENCY,MAX_LATENCY,MAPPING,\n");
+	for(size_t i = 0; i < n; ++i){
+		mem_page_t *p = &mem_pages[i];
+		int group = p->key >> 56;
+		unsigned long long page = (p->key & ((1ULL << 56)-1)) << MEM_PAGE_SHIFT;
+		/* Kernel pages lost their sign bits in the key */
+		if(page & (1ULL << 47)){
+			page |= 0xffff000000000000ULL;
+		}
+		const char *name = mem_map_name(group, page);
+		fprintf(fp, "%d,0x%llx,%llu,%.1f,%llu,%s,\n", group, page, p->samples, (double)p->lat_sum/p->samples, p->lat_max, name);
+
+		size_t t;
+		for(t = 0; t < num_totals && (totals[t].group != group || strcmp(totals[t].name, name) != 0); ++t){
+		}
+		if(t == num_totals){
+			totals[num_totals].group = group;
+			totals[num_totals].name = name;
+			++num_totals;
+		}
+		totals[t].samples += p->samples;
+		totals[t].lat_sum += p->lat_sum;
+		totals[t].pages++;
+	}
+	fclose(fp);
+	printf("Memory Page Log Path: %s (%zu pages)\n", path, n);
+
+	/* Hottest mappings first */
+	for(size_t i = 1; i < num_totals; ++i){
+		mem_total_t t = totals[i];
+		size_t j = i;
+		while(j > 0 && totals[j-1].samples < t.samples){
+			totals[j] = totals[j-1];
+			--j;
+		}
+		totals[j] = t;
+	}
+	side_log_path(path, "_mem_maps.csv");
+	fp = fopen(path, "w");
+	if(fp == NULL){
+		fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+		free(totals);
+		return;
+	}
+	fprintf(fp, "TARGET,MAPPING,SAMPLES,SHARE,AVG_LATENCY,PAGES,\n");
+	printf("Memory samples: %llu, %llu without a data address\n", mem_samples, mem_no_addr);
+	for(size_t i = 0; i < num_totals; ++i){
+		mem_total_t *t = &totals[i];
+		double share = mem_samples ? (double)t->samples/mem_samples : 0.0;
+		fprintf(fp, "%d,%s,%llu,%.4f,%.1f,%llu,\n", t->group, t->name, t->samples, share, (double)t->lat_sum/t->samples, t->pages);
+		if(i < 5){
+			int pid = kleb_ioctl_args.num_targets ? kleb_ioctl_args.targets[t->group] : kleb_ioctl_args.pid;
+			printf("  %5.1f%% %s (pid %d, %llu pages, avg latency %.1f)\n", share*100, t->name, pid, t->pages, (double)t->lat_sum/t->samples);
+		}
+	}
+	fclose(fp);
+	printf("Memory Mapping Log Path: %s\n", path);
+	free(totals);
+}
+
+/* One row per memory sample, bucketed for the report at exit */
+void log_mem(const kleb_record_t *rec, const unsigned long long *samples)
+{
+	unsigned int num = (rec->size - RECORD_HDR_WORDS)/3;
+
+	for(unsigned int i = 0; i < num; ++i){
+		unsigned long long ip = samples[3*i], addr = samples[3*i+1], latency = samples[3*i+2];
+		++mem_samples;
+		if(memfp != NULL){
+			fprintf(memfp, "%llu,%d,%d,0x%llx,0x%llx,%llu,\n", rec->time_ns, rec->cpu, rec->group, ip, addr, latency);
+		}
+		if(addr == 0){
+			++mem_no_addr;
+			continue;
+		}
+		mem_add(rec->group, addr, latency);
+	}
+}
+
+/* Write one sample row to the log of its target */
+int log_sample(const kleb_sample_t *sample, void *ctx)
+{
+	const kleb_record_t *rec = sample->rec;
+	FILE *logfp = logfps[(rec->group < num_logs) ? rec->group : 0];
+
+	(void)ctx;
+	if(rec->type == REC_LBR){
+		if(binary_log){
+			fwrite(rec, sizeof(unsigned long long), rec->size, logfp);
+		}
+		else{
+			log_branches(rec, sample->counters);
+		}
+		return 0;
+	}
+	if(rec->type == REC_PEBS){
+		if(binary_log){
+			fwrite(rec, sizeof(unsigned long long), rec->size, logfp);
+		}
+		log_mem(rec, sample->counters);
+		return 0;
+	}
+
+	/* Per-CPU rows carry the energy of their package on its RAPL leader and none
+	   elsewhere, whatever their event group. Summed rows repeat the energy of the
+	   tick, so only the first group's row counts */
+	inst_total += sample->counters[inst_index];
+	for(int j = 0; energy_base >= 0 && (rec->cpu >= 0 || rec->group == 0) && j < NUM_ENERGY_COUNTERS; ++j){
+		energy_total[j] += sample->counters[energy_base+j]*energy_unit;
+	}
+
+	if(binary_log){
+		/* Losses go ahead of the sample as in the ring */
+		if(sample->lost){
+			unsigned long long lost[RECORD_WORDS(1)];
+			kleb_record_t *lost_rec = (kleb_record_t *)lost;
+			*lost_rec = *rec;
+			lost_rec->type = REC_LOST;
+			lost_rec->size = RECORD_WORDS(1);
+			lost[RECORD_HDR_WORDS] = sample->lost;
+			fwrite(lost, sizeof(lost), 1, logfp);
 		}
-		/* End of Events */
-		if(!checkempty){
-			++sample_count;
-			fprintf(log_path, "\n");
+		fwrite(rec, sizeof(unsigned long long), rec->size, logfp);
+		lost_samples += sample->lost;
+		return 0;
+	}
+
+	log_counters(logfp, sample->counters, 1);
+	fprintf(logfp, "%u,%u,%d,%llu,%llu,\n", rec->period_ns, rec->region, rec->cpu, rec->time_ns, sample->lost);
+	lost_samples += sample->lost;
+	return 0;
+}
+
+/* Fork the program and hold it until release_program() */
+int launch_program(char* cmdargv[])
+{
+	int go[2], ack[2];
+	int status;
+	char mode;
+
+	if(pipe2(go, O_CLOEXEC) < 0 || pipe2(ack, O_CLOEXEC) < 0){
+		perror("Error: ");
+		exit(0);
+	}
+	fflush(stdout);
+	int pid = fork();
+	if (pid == 0)
+	{
+		/* Stop right after exec under ptrace, or wait on the pipe when already traced */
+		mode = (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0) ? 'T' : 'P';
+		if(write(ack[1], &mode, 1) != 1 || (mode == 'P' && read(go[0], &mode, 1) != 1)){
+			_exit(0);
 		}
+		execvp(cmdargv[0], cmdargv);
+		perror("Error: ");
+		exit(0);
+	}
+	close(go[0]);
+	close(ack[1]);
+	if(pid < 0 || read(ack[0], &mode, 1) != 1){
+		perror("Error: ");
+		exit(0);
 	}
-	fflush(log_path);
-	return sample_count;
+	close(ack[0]);
+	launch_traced = (mode == 'T');
+	launch_go = go[1];
+	launched = 1;
+
+	/* The exec stop is a SIGTRAP, an exit means exec failed */
+	if(launch_traced && (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))){
+		printf("Cannot execute %s\n", cmdargv[0]);
+		exit(0);
+	}
+	return pid;
 }
 
-kleb_ioctl_args_t parse_cmd(int argc, char *argv[])
+/* Let the program run, its first instruction is counted */
+void release_program(int pid)
+{
+	if(launch_traced){
+		ptrace(PTRACE_DETACH, pid, NULL, NULL);
+	}
+	else if(write(launch_go, "G", 1) != 1){
+		perror("Error: ");
+	}
+	close(launch_go);
+}
+
+/* Event groups <events>/<events>/... or an event list file such as EvtList, 4 events to a group */
+void add_event_groups(char *arg)
+{
+	char events[MAX_EVENT_GROUPS][256];
+	int num_groups = 0, num_events = 0;
+	char line[256];
+	FILE *fp = fopen(arg, "r");
+
+	memset(events, 0, sizeof(events));
+	if(fp != NULL){
+		while(fgets(line, sizeof(line), fp) != NULL){
+			char *name = strtok(line, " \t\r\n");
+			if(name == NULL || strncmp(name, "/*", 2) == 0){
+				continue;
+			}
+			if(num_events == MAX_EVENTS){
+				num_events = 0;
+				++num_groups;
+			}
+			if(num_groups >= MAX_EVENT_GROUPS){
+				printf("This module only support up to %d event groups\n", MAX_EVENT_GROUPS);
+				exit(0);
+			}
+			for(char *c = name; *c; ++c){
+				*c = toupper((unsigned char)*c);
+			}
+			if(num_events){
+				strcat(events[num_groups], ",");
+			}
+			strncat(events[num_groups], name, 64);
+			++num_events;
+		}
+		fclose(fp);
+		num_groups += (num_events != 0);
+	}
+	else{
+		for(char *group = strtok(arg, "/"); group != NULL; group = strtok(NULL, "/")){
+			if(num_groups >= MAX_EVENT_GROUPS){
+				printf("This module only support up to %d event groups\n", MAX_EVENT_GROUPS);
+				exit(0);
+			}
+			snprintf(events[num_groups++], sizeof(events[0]), "%s", group);
+		}
+	}
+	for(int g = 0; g < num_groups; ++g){
+		int ret = kleb_add_event_group(session, events[g]);
+		if(ret == -ENOSPC){
+			printf("This module only support monitoring up to 4 events per group\n");
+			exit(0);
+		}
+		if(ret < 0){
+			printf("Unknown event in group %s\n", events[g]);
+			exit(0);
+		}
+		printf("Event group %d: %s\n", ret, events[g]);
+	}
+}
+
+/* Fill the session from the command line, returns the pid to monitor */
+int parse_cmd(int argc, char *argv[])
 {
 	int index;
-	int num_events = 0;
-	int pid;
+	int pid = 0;
+	int event_list = 0;
 	float hrtimer = 1;
-	char eventname[20];
-
-	kleb_ioctl_args_t kleb_ioctl_args;
 
-	/* Default Timer & Monitoring Mode */
-	kleb_ioctl_args.delay_in_ns = 10000000;
-	kleb_ioctl_args.user_os_rec = 1; //User:1 OS:2 Both:3
+	kleb_ioctl_args_t *kleb_ioctl_args = kleb_session_args(session);
 
 	/* Default logpath */
 	strcpy(logpath,"./Output.csv");
@@ -128,13 +688,142 @@ kleb_ioctl_args_t parse_cmd(int argc, char *argv[])
 		if(argv[index][0] == '-'){
 			if(argv[index][1] == 'a'){
 				//mode = 1;
-				kleb_ioctl_args.pid = 1;
+				pid = 1;
 				printf("Set monitor all\n");
 			}
+			if(argv[index][1] == 'p'){
+				/* Running processes <pid>,<pid>..., each logged on its own */
+				++index;
+				for(char *target = strtok(argv[index], ","); target != NULL; target = strtok(NULL, ",")){
+					int tpid = atoi(target);
+					int ret = kleb_add_target(session, tpid);
+					if(ret == -ENOSPC){
+						printf("This module only support monitoring up to %d processes\n", MAX_TARGETS);
+						exit(0);
+					}
+					if(ret < 0 || kill(tpid, 0) != 0){
+						printf("Cannot monitor PID %s\n", target);
+						exit(0);
+					}
+					printf("Monitor PID %d\n", tpid);
+				}
+				pid = kleb_ioctl_args->targets[0];
+			}
 			if(argv[index][1] == 't'){
 				++index;
 				hrtimer = strtof(argv[index], NULL);
-				kleb_ioctl_args.delay_in_ns = hrtimer*1000000;
+				kleb_set_period_ns(session, hrtimer*1000000);
+			}
+			if(argv[index][1] == 'u'){
+				/* Attribute counters to <binary>:<symbol> */
+				++index;
+				add_uprobe(argv[index]);
+			}
+			if(strcmp(argv[index], "--per-cpu") == 0){
+				kleb_ioctl_args->per_cpu = 1;
+			}
+			if(strcmp(argv[index], "--perf") == 0){
+				/* Counters from perf, safe next to the NMI watchdog and perf users */
+				kleb_ioctl_args->backend = BACKEND_PERF;
+			}
+			if(strcmp(argv[index], "--rdpmc") == 0){
+				/* The program reads its own counters with kleb_rdpmc.h */
+				kleb_ioctl_args->rdpmc = 1;
+			}
+			if(argv[index][1] == 'G'){
+				/* Different event groups on different CPUs in system-wide mode */
+				++index;
+				add_event_groups(argv[index]);
+			}
+			if(argv[index][1] == 'g'){
+				/* CPUs of each event group <cpus>/<cpus>..., round-robin otherwise */
+				++index;
+				if(kleb_set_event_map(session, argv[index]) < 0){
+					printf("Invalid event map, up to %d CPU lists separated by /\n", MAX_EVENT_GROUPS);
+					exit(0);
+				}
+			}
+			if(argv[index][1] == 'C'){
+				/* CPU list for system-wide mode */
+				++index;
+				if(kleb_set_cpu_list(session, argv[index]) < 0){
+					printf("Invalid CPU list, CPUs must be within 0-%d\n", MAX_CPUS-1);
+					exit(0);
+				}
+			}
+			if(argv[index][1] == 'O'){
+				/* Policy on a full buffer */
+				++index;
+				if(strcmp(argv[index], "overwrite") == 0){
+					kleb_ioctl_args->overflow = OVERFLOW_OVERWRITE;
+				}
+				else if(strcmp(argv[index], "pause") == 0){
+					kleb_ioctl_args->overflow = OVERFLOW_PAUSE;
+				}
+				else{
+					kleb_ioctl_args->overflow = OVERFLOW_DROP;
+				}
+			}
+			if(argv[index][1] == 'L'){
+				/* Last branch records attached to every tick */
+				++index;
+				kleb_ioctl_args->lbr = strtol(argv[index], NULL, 10);
+				if(kleb_ioctl_args->lbr == 0 || kleb_ioctl_args->lbr > MAX_LBR){
+					printf("Branch records must be within 1-%d\n", MAX_LBR);
+					exit(0);
+				}
+			}
+			if(argv[index][1] == 'M'){
+				/* PEBS memory sampling ldlat[:<period>[:<cycles>]] or llc[:<period>] */
+				++index;
+				char *opt = strtok(argv[index], ":");
+				char *period = strtok(NULL, ":");
+				char *cycles = strtok(NULL, ":");
+				if(opt != NULL && strcmp(opt, "ldlat") == 0){
+					kleb_ioctl_args->pebs = PEBS_LOAD_LATENCY;
+				}
+				else if(opt != NULL && strcmp(opt, "llc") == 0){
+					kleb_ioctl_args->pebs = PEBS_LLC_MISS;
+				}
+				else{
+					printf("Memory sampling must be ldlat[:<period>[:<cycles>]] or llc[:<period>]\n");
+					exit(0);
+				}
+				kleb_ioctl_args->pebs_period = period ? strtoul(period, NULL, 10) : 1000;
+				kleb_ioctl_args->pebs_latency = cycles ? strtoul(cycles, NULL, 10) : 30;
+			}
+			if(argv[index][1] == 'E'){
+				/* Package, core and DRAM energy on every sample */
+				kleb_ioctl_args->rapl = 1;
+			}
+			if(argv[index][1] == 'T'){
+				/* Top-down level 1 on every sample */
+				kleb_ioctl_args->topdown = 1;
+			}
+			if(argv[index][1] == 'N'){
+				/* Drain on the NUMA node the module put the ring on */
+				numa_drain = 1;
+			}
+			if(argv[index][1] == 'B'){
+				/* Binary log for kleb-analyze */
+				binary_log = 1;
+			}
+			if(argv[index][1] == 'H'){
+				/* High-frequency mode for periods down to a few us */
+				kleb_ioctl_args->hifreq = 1;
+			}
+			if(argv[index][1] == 'r'){
+				/* Only record inside regions marked by the target */
+				kleb_ioctl_args->roi = 1;
+			}
+			if(argv[index][1] == 'A'){
+				/* Adaptive period bounds <min ms>:<max ms> */
+				++index;
+				char *bound;
+				kleb_ioctl_args->min_delay_in_ns = strtof(argv[index], &bound)*1000000;
+				if(*bound == ':'){
+					kleb_ioctl_args->max_delay_in_ns = strtof(bound+1, NULL)*1000000;
+				}
 			}
 			if(argv[index][1] == 'o'){
 				++index;
@@ -142,41 +831,22 @@ kleb_ioctl_args_t parse_cmd(int argc, char *argv[])
 			}
 			if(argv[index][1] == 'm'){
 				++index;
-				kleb_ioctl_args.user_os_rec = strtol(argv[index], NULL, 10);
+				kleb_ioctl_args->user_os_rec = strtol(argv[index], NULL, 10);
 			}
 			if(argv[index][1] == 'e'){
 				++index;
-				memset(eventname, 0, sizeof(eventname));
-				for(int i = 0; i < strlen(argv[index]); ++i){
-					
-					if(argv[index][i] == ','){
-						if(isalpha(eventname[0])){		
-							kleb_ioctl_args.counter[num_events] = NameToRawConfigMask(eventname);
-						}
-						else{
-							kleb_ioctl_args.counter[num_events] = strtol(eventname, NULL, 16);
-						}
-						//printf("EVT: %u %s %d\n", *kleb_ioctl_args.counter[num_events], eventname, num_events);
-						++num_events;
-						memset(eventname, 0, sizeof(eventname));
+				event_list = 1;
+				for(char *event = strtok(argv[index], ","); event != NULL; event = strtok(NULL, ",")){
+					int ret = kleb_add_event(session, event);
+					if(ret == -ENOSPC){
+						printf("This module only support monitoring up to 4 events\n");
+						exit(0);
 					}
-					else{
-						strncat(eventname, &argv[index][i], 1);
-						if(i == (strlen(argv[index])-1)){					
-							if(isalpha(eventname[0])){		
-								kleb_ioctl_args.counter[num_events] = NameToRawConfigMask(eventname);
-							}
-							else{
-								kleb_ioctl_args.counter[num_events] = strtol(eventname, NULL, 16);
-							}
-							//printf("EVT: %u %s %d\n", *kleb_ioctl_args.counter[num_events], eventname, num_events);
-							memset(eventname, 0, sizeof(eventname));
-							++num_events;
-							kleb_ioctl_args.num_events = num_events;
-						}
+					if(ret < 0){
+						printf("Unknown event %s\n", event);
+						exit(0);
 					}
 				}
-				
 			}
 		}
 		else{
@@ -184,132 +854,251 @@ kleb_ioctl_args_t parse_cmd(int argc, char *argv[])
 		}
 	}
 	    /* Parameters Parser */
-	if(kleb_ioctl_args.num_events > 4){
-		printf("This module only support monitoring up to 4 events\n");
+	if(kleb_ioctl_args->min_delay_in_ns != 0 && (kleb_ioctl_args->max_delay_in_ns < kleb_ioctl_args->min_delay_in_ns || kleb_ioctl_args->max_delay_in_ns > 4000000000U)){
+		printf("Adaptive period requires -A <min ms>:<max ms> with min <= max <= 4000\n");
+		exit(0);
+	}
+	if(binary_log && strcmp(logpath, "./Output.csv") == 0){
+		strcpy(logpath, "./Output.kleb");
+	}
+	if(kleb_ioctl_args->num_targets && pid == 1){
+		printf("Processes -p and system-wide mode -a are exclusive\n");
+		exit(0);
+	}
+	if(kleb_ioctl_args->per_cpu && pid != 1){
+		printf("Per-CPU rows require system-wide mode -a\n");
+		exit(0);
+	}
+	if(kleb_ioctl_args->num_event_groups && pid != 1){
+		printf("Event groups require system-wide mode -a\n");
+		exit(0);
+	}
+	if(kleb_ioctl_args->event_map && kleb_ioctl_args->num_event_groups == 0){
+		printf("Event map -g requires event groups -G\n");
+		exit(0);
+	}
+	if(kleb_ioctl_args->num_event_groups && event_list){
+		printf("Event groups -G and events -e are exclusive\n");
+		exit(0);
+	}
+	if(kleb_ioctl_args->num_event_groups && (kleb_ioctl_args->pebs || kleb_ioctl_args->backend == BACKEND_PERF)){
+		printf("Event groups are not supported with memory sampling -M or --perf\n");
+		exit(0);
+	}
+	if(kleb_ioctl_args->pebs && kleb_ioctl_args->num_events >= MAX_EVENTS){
+		printf("Memory sampling takes the last counter, up to %d events\n", MAX_EVENTS-1);
 		exit(0);
 	}
-	if(kleb_ioctl_args.num_events == 0){
+	if(kleb_ioctl_args->num_events == 0){
 		/* Default Events */
-		kleb_ioctl_args.counter[0] = strtol("00c4", NULL, 16);
-		kleb_ioctl_args.counter[1] = strtol("00c5", NULL, 16);
-		kleb_ioctl_args.num_events = 2;
+		kleb_add_event(session, "00c4");
+		kleb_add_event(session, "00c5");
 	}
 
 
-	if(kleb_ioctl_args.pid != 1)
+	if(pid != 1 && kleb_ioctl_args->num_targets == 0)
 	{
-		kleb_ioctl_args.pid = atoi(argv[index]);
-		//printf("%d %d\n",kleb_ioctl_args.pid, kill(kleb_ioctl_args.pid, 0));
-		if(!kill(kleb_ioctl_args.pid, 0) && kleb_ioctl_args.pid != 0)
+		if(index >= argc){
+			printf("Error reading configurations\nExiting...\n");
+			exit(0);
+		}
+		pid = atoi(argv[index]);
+		//printf("%d %d\n",pid, kill(pid, 0));
+		if(!kill(pid, 0) && pid != 0)
 		{
-			printf("Monitor PID %d\n", kleb_ioctl_args.pid);
+			printf("Monitor PID %d\n", pid);
 		}
 		else
 		{
 			/* User pass in program path */
 			printf("Monitor Program %s\n", argv[index]);
 			//usrcmd = 1;
-			pid = fork();
-			if (pid == 0)
-			{ 
-				/* Execute child */
-				sleep(1);
-				/* Phrase program arguments */
-				char* cmdargv[argc];
-				for (int i = index; i < argc; ++i){
-					cmdargv[i-index] = argv[i];
-				}
-				cmdargv[argc-index]=NULL;
-				execvp(argv[index], cmdargv);
-				perror("Error: ");
-				exit(0);
-			}
-			else{
-				/* Set pid to monitor */
-				kleb_ioctl_args.pid = pid;
+			/* Phrase program arguments */
+			char* cmdargv[argc];
+			for (int i = index; i < argc; ++i){
+				cmdargv[i-index] = argv[i];
 			}
+			cmdargv[argc-index]=NULL;
+			pid = launch_program(cmdargv);
 		}
 	}
 
-	return kleb_ioctl_args;
+	return pid;
 }
 
-void deinit_ioctl(int fd)
+void init_log(FILE* logfp, kleb_ioctl_args_t kleb_ioctl_args, const char* path)
 {
-	if(ioctl(fd, IOCTL_STOP, "Stopping") < 0)
-	{
-		printf("ioctl failed and returned errno %s \n",strerror(errno));
+	printf("Logging data...\n");
+	if(binary_log){
+		kleb_log_header_t hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = KLEB_LOG_MAGIC;
+		hdr.version = 1;
+		hdr.num_events = kleb_ioctl_args.num_events;
+		hdr.flags = (kleb_ioctl_args.topdown ? KLEB_LOG_TOPDOWN : 0) | (kleb_ioctl_args.rapl ? KLEB_LOG_ENERGY : 0);
+		hdr.rapl_unit = kleb_ioctl_args.rapl_unit;
+		memcpy(hdr.counter, kleb_ioctl_args.counter, sizeof(hdr.counter));
+		fwrite(&hdr, sizeof(hdr), 1, logfp);
+		printf("Log Path: %s\n ", path);
+		return;
 	}
-	printf("Deinitializing K-LEB...\n");
+	log_counter_names(logfp, kleb_ioctl_args, 1);
+	fprintf(logfp, "PERIOD_NS,REGION,CPU,TIME_NS,LOST,");
+	fprintf(logfp, "\n");
+	
+	printf("Log Path: %s\n ", path);
 }
 
-void init_log(FILE* logfp, kleb_ioctl_args_t kleb_ioctl_args)
+/* Output.csv, or Output_<pid>.csv for each of several processes and Output_g<group>.csv for each event group */
+void open_logs(kleb_ioctl_args_t kleb_ioctl_args)
 {
-	int j;
-	printf("Logging data...\n");
-	for(j = 0; j < (kleb_ioctl_args.num_events + 3); ++j){
-		
-		if(j == kleb_ioctl_args.num_events){
-			fprintf(logfp, "INST_RETIRED,");
-		}
-		else if(j == kleb_ioctl_args.num_events+1){
-			fprintf(logfp, "CPU_CLK_CYCLE,");
+	char path[220];
+
+	num_logs = kleb_ioctl_args.num_targets ? kleb_ioctl_args.num_targets : 1;
+	if(kleb_ioctl_args.num_event_groups){
+		num_logs = kleb_ioctl_args.num_event_groups;
+	}
+	for(int i = 0; i < num_logs; ++i){
+		if(kleb_ioctl_args.num_targets){
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "_%d%s", kleb_ioctl_args.targets[i], binary_log ? ".kleb" : ".csv");
+			side_log_path(path, suffix);
 		}
-		else if(j == kleb_ioctl_args.num_events+2){
-			fprintf(logfp, "CPU_REF_CYCLE,");
+		else if(kleb_ioctl_args.num_event_groups){
+			/* The columns of each log are the events of its group */
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "_g%d%s", i, binary_log ? ".kleb" : ".csv");
+			side_log_path(path, suffix);
+			memcpy(kleb_ioctl_args.counter, kleb_ioctl_args.event_groups[i], sizeof(kleb_ioctl_args.counter));
 		}
 		else{
-			fprintf(logfp, "%x,", kleb_ioctl_args.counter[j]);
+			strcpy(path, logpath);
+		}
+		logfps[i] = fopen(path, "w");
+		if(logfps[i] == NULL){
+			fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+			exit(0);
 		}
+		init_log(logfps[i], kleb_ioctl_args, path);
 	}
-	fprintf(logfp, "\n");
-	
-	printf("Log Path: %s\n ", logpath);
+
+	/* Branch snapshots of all targets share one log */
+	if(kleb_ioctl_args.lbr && !binary_log){
+		side_log_path(path, "_lbr.csv");
+		lbrfp = fopen(path, "w");
+		if(lbrfp == NULL){
+			fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+			exit(0);
+		}
+		fprintf(lbrfp, "TIME_NS,CPU,TARGET,BRANCH,FROM,TO,MISPRED,\n");
+		printf("Branch Log Path: %s (%u branches per tick)\n", path, kleb_ioctl_args.lbr);
+		lbr_format = kleb_ioctl_args.lbr_format;
+	}
+
+	/* Memory samples of all targets share one log */
+	if(kleb_ioctl_args.pebs && !binary_log){
+		side_log_path(path, "_mem.csv");
+		memfp = fopen(path, "w");
+		if(memfp == NULL){
+			fprintf(stderr,"Error opening file: %s\n", strerror(errno));
+			exit(0);
+		}
+		fprintf(memfp, "TIME_NS,CPU,TARGET,IP,ADDR,LATENCY,\n");
+		printf("Memory Log Path: %s (one sample every %u events)\n", path, kleb_ioctl_args.pebs_period);
+	}
+}
+
+/* Any of the monitored processes still running */
+int targets_alive(kleb_ioctl_args_t kleb_ioctl_args)
+{
+	for(unsigned int i = 0; i < kleb_ioctl_args.num_targets; ++i){
+		if(!kill(kleb_ioctl_args.targets[i], 0)){
+			return 1;
+		}
+	}
+	return 0;
 }
 
-int read_kernel_buffer(int fd, unsigned int **hardware_events, int size_of_message, int num_sample, int num_recordings, kleb_ioctl_args_t kleb_ioctl_args, FILE* logfp)
+int read_kernel_buffer(int num_sample, kleb_ioctl_args_t kleb_ioctl_args)
 {
+	/* Mappings are looked up at exit, when targets may be gone */
+	if(kleb_ioctl_args.pebs){
+		mem_maps_snapshot(kleb_ioctl_args);
+	}
+
 	/* Extract data from kernel */
-	int ret = read(fd, hardware_events[0], size_of_message);
+	int ret = kleb_drain(session, log_sample, NULL);
 	if (ret < 0)
 	{
-		perror("Failed to read the message from the device.\n");
-		deinit_ioctl(fd);
+		printf("Failed to read the message from the device: %s\n", strerror(-ret));
+		kleb_session_close(session);
 		exit(0);
-		return errno;
 	}
-	else if (ret == 0){
-		/* Empty data */
-		printf("No Data to Extract %d\n", ret);
+	for(int i = 0; i < num_logs; ++i){
+		fflush(logfps[i]);
 	}
-	else{
-		num_sample += val_extract(hardware_events, num_recordings, kleb_ioctl_args.num_events, logfp);
+	if(lbrfp != NULL){
+		fflush(lbrfp);
+	}
+	if(memfp != NULL){
+		fflush(memfp);
 	}
-	return num_sample;
+	return num_sample + ret;
 }
-void exit_monitoring(int fd, unsigned int **hardware_events, int size_of_message, int num_sample, int num_recordings, kleb_ioctl_args_t kleb_ioctl_args, FILE* logfp){
-	deinit_ioctl(fd);
+
+void exit_monitoring(int num_sample, kleb_ioctl_args_t kleb_ioctl_args){
+	if(kleb_stop(session) < 0)
+	{
+		printf("ioctl failed and returned errno %s \n",strerror(errno));
+	}
+	printf("Deinitializing K-LEB...\n");
+	if(kleb_function_name(session, 0) != NULL){
+		func_extract(kleb_ioctl_args);
+	}
+	if(kleb_ioctl_args.pid != 0 && kleb_ioctl_args.pid != 1){
+		task_extract(kleb_ioctl_args);
+	}
+	timer_report(kleb_ioctl_args);
 	printf("Sample Exit: %d\n", num_sample);
-	num_sample = read_kernel_buffer(fd, hardware_events, size_of_message, num_sample, num_recordings, kleb_ioctl_args, logfp);
+	/* Records of the last tick are published by the time stop returns */
+	num_sample = read_kernel_buffer(num_sample, kleb_ioctl_args);
 	printf("Sample Last Extract: %d\n", num_sample);
 	printf("Finish Extract last data... \n");
 	printf("Stopping K-LEB...\n# of Sample: %d\n", num_sample);
+	if(lost_samples){
+		printf("# of Lost Sample: %llu\n", lost_samples);
+	}
+	if(energy_base >= 0){
+		printf("Energy (J): package %.3f, core %.3f, DRAM %.3f\n", energy_total[0], energy_total[1], energy_total[2]);
+		printf("Package energy per instruction: %.3f nJ\n", inst_total ? energy_total[0]*1e9/inst_total : 0.0);
+	}
+	if(kleb_ioctl_args.pebs){
+		mem_report(kleb_ioctl_args);
+	}
 
 }
-void start_monitoring(int fd, kleb_ioctl_args_t kleb_ioctl_args)
+
+void start_monitoring(kleb_ioctl_args_t kleb_ioctl_args)
 {
 	checkint=0;
 	signal(SIGINT, sigintHandler);
 
 	int status = 0;
-	int i;
 	int num_sample = 0;
-	int num_recordings = 500;
-	struct timespec t1, t2;
+	struct timespec t1;
 	unsigned long long int tap_time;
 
-	/* Set user tapping time */
-	tap_time = kleb_ioctl_args.delay_in_ns*60;
+	/* Set user tapping time, adaptive mode drains at the shortest period */
+	if(kleb_ioctl_args.hifreq){
+		/* The ring holds HIFREQ_BUFFER_NS, drain ten times as often */
+		tap_time = HIFREQ_BUFFER_NS/10;
+	}
+	else if(kleb_ioctl_args.min_delay_in_ns != 0){
+		tap_time = (unsigned long long int)kleb_ioctl_args.min_delay_in_ns*60;
+	}
+	else{
+		tap_time = (unsigned long long int)kleb_ioctl_args.delay_in_ns*60;
+	}
 	if(tap_time >= 1000000000 ){
 		t1.tv_sec = tap_time/1000000000;
 		t1.tv_nsec = tap_time-(t1.tv_sec*1000000000);
@@ -319,33 +1108,23 @@ void start_monitoring(int fd, kleb_ioctl_args_t kleb_ioctl_args)
 		t1.tv_nsec = tap_time;
 	}
 
-	/* Buffer for tapping */
-	unsigned int **hardware_events = malloc( (kleb_ioctl_args.num_events+3)*sizeof(unsigned int *) );
-	hardware_events[0] = malloc( (kleb_ioctl_args.num_events+3)*num_recordings*sizeof(unsigned int) );
-	for ( i=0; i < (kleb_ioctl_args.num_events + 3); ++i ) {
-		hardware_events[i] = *hardware_events + num_recordings * i;
-	}
-
-	/* Buffer for storing data */
-	long int hardware_events_buffer[kleb_ioctl_args.num_events+3][100000];
-	/* Overflow value */
-	int size_of_message = num_recordings * (kleb_ioctl_args.num_events+3) * sizeof(long int);
 	/*  Log to file	*/
-	FILE *logfp = fopen(logpath, "w");
-	if( logfp == NULL ){
-		fprintf(stderr,"Error opening file: %s\n", strerror(errno));
-		exit(0);
-	}
-	else{
-		init_log(logfp, kleb_ioctl_args);
-	}
+	open_logs(kleb_ioctl_args);
 	
-	if(kleb_ioctl_args.pid == 1){		
+	if(kleb_ioctl_args.num_targets){
+		/* Monitor processes until the last one exits */
+		printf("Monitoring HPC... \nWait for %u processes \nPress Ctrl+C to exit\n", kleb_ioctl_args.num_targets);
+		while (targets_alive(kleb_ioctl_args) && !checkint) {
+			kleb_wait(session, &t1);
+			num_sample = read_kernel_buffer(num_sample, kleb_ioctl_args);
+		}
+	}
+	else if(kleb_ioctl_args.pid == 1){		
 		/* Monitor system */
 		printf("Monitoring HPC... \nPress Ctrl+C to exit\n");
 		while (!checkint) {	
-			nanosleep(&t1, &t2);
-			num_sample = read_kernel_buffer(fd, hardware_events, size_of_message, num_sample, num_recordings, kleb_ioctl_args, logfp);
+			kleb_wait(session, &t1);
+			num_sample = read_kernel_buffer(num_sample, kleb_ioctl_args);
 			//printf("Sample: %d\n", num_sample);
 		}
 	}
@@ -357,9 +1136,9 @@ void start_monitoring(int fd, kleb_ioctl_args_t kleb_ioctl_args)
 			printf("Monitoring HPC... \nWait for pid %d \nPress Ctrl+C to exit\n", kleb_ioctl_args.pid);	
 			while (!kill(kleb_ioctl_args.pid, 0) &&  !checkint) {
 
-				nanosleep(&t1, &t2);
+				kleb_wait(session, &t1);
 				/* Extract data from kernel */
-				num_sample = read_kernel_buffer(fd, hardware_events, size_of_message, num_sample, num_recordings, kleb_ioctl_args, logfp);
+				num_sample = read_kernel_buffer(num_sample, kleb_ioctl_args);
 				//printf("Sample: %d\n", num_sample);
 			}
 		}
@@ -367,26 +1146,23 @@ void start_monitoring(int fd, kleb_ioctl_args_t kleb_ioctl_args)
 		{
 			printf("Monitoring HPC... \nWait for Program %d \nPress Ctrl+C to exit\n", kleb_ioctl_args.pid);	
 			while (!waitpid(kleb_ioctl_args.pid, &status, WNOHANG) && !checkint) {
-				nanosleep(&t1, &t2);
+				kleb_wait(session, &t1);
 				/* Extract data from kernel */
-				num_sample = read_kernel_buffer(fd, hardware_events, size_of_message, num_sample, num_recordings, kleb_ioctl_args, logfp);
+				num_sample = read_kernel_buffer(num_sample, kleb_ioctl_args);
 				//printf("Sample: %d\n", num_sample);
 			}
 		}
 	}
-	exit_monitoring(fd, hardware_events, size_of_message, num_sample, num_recordings, kleb_ioctl_args, logfp);
-	fclose(logfp);
-}
-
-void init_ioctl(int fd, kleb_ioctl_args_t kleb_ioctl_args)
-{
-	if(ioctl(fd, IOCTL_START, &kleb_ioctl_args) < 0)
-	{
-		printf("ioctl failed and returned errno %s \n",strerror(errno));
-		exit(-1);
+	exit_monitoring(num_sample, kleb_ioctl_args);
+	for(int i = 0; i < num_logs; ++i){
+		fclose(logfps[i]);
+	}
+	if(lbrfp != NULL){
+		fclose(lbrfp);
+	}
+	if(memfp != NULL){
+		fclose(memfp);
 	}
-	printf("Initializing K-LEB...\n");
-	start_monitoring(fd, kleb_ioctl_args);
 }
 
 int main(int argc, char **argv)
@@ -397,21 +1173,51 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
-	kleb_ioctl_args_t kleb_ioctl_args;
-
-	kleb_ioctl_args = parse_cmd(argc,argv);
-	printf("PID: %d Events: %u %u %u %u\n Timer: %u\n Log: %s\n",kleb_ioctl_args.pid ,kleb_ioctl_args.counter[0], kleb_ioctl_args.counter[1], kleb_ioctl_args.counter[2], kleb_ioctl_args.counter[3], kleb_ioctl_args.delay_in_ns/1000000, logpath);
-
-	int fd = open(DEVICE_PATH, O_RDWR);
-	if (fd == -1)
+	session = kleb_session_open();
+	if (session == NULL)
 	{
 		printf("Error in opening file \n");
 		perror("Emesg");
 		exit(-1);
 	}
 
-	init_ioctl(fd, kleb_ioctl_args);
+	int pid = parse_cmd(argc,argv);
+	kleb_ioctl_args_t *kleb_ioctl_args = kleb_session_args(session);
+	num_counters = kleb_num_counters(session);
+	inst_index = kleb_ioctl_args->num_events;
+	if(kleb_ioctl_args->topdown){
+		topdown_base = kleb_ioctl_args->num_events + NUM_FIXED_COUNTERS;
+	}
+	if(kleb_ioctl_args->rapl){
+		energy_base = num_counters - NUM_ENERGY_COUNTERS;
+	}
+	printf("PID: %d Events: %u %u %u %u\n Timer: %u\n Log: %s\n",pid ,kleb_ioctl_args->counter[0], kleb_ioctl_args->counter[1], kleb_ioctl_args->counter[2], kleb_ioctl_args->counter[3], kleb_ioctl_args->delay_in_ns/1000000, logpath);
+
+	int ret = kleb_start(session, pid);
+	if(ret < 0)
+	{
+		printf("ioctl failed and returned errno %s \n",strerror(-ret));
+		if(launched){
+			kill(pid, SIGKILL);
+		}
+		exit(-1);
+	}
+	printf("Initializing K-LEB...\n");
+	energy_unit = kleb_energy_unit(session);
+	if(numa_drain){
+		ret = kleb_bind_ring_node(session);
+		if(ret < 0){
+			printf("Cannot drain on node %d: %s\n", kleb_ring_node(session), strerror(-ret));
+		}
+		else{
+			printf("Draining on node %d\n", kleb_ring_node(session));
+		}
+	}
+	if(launched){
+		release_program(pid);
+	}
+	start_monitoring(*kleb_ioctl_args);
 
-	close(fd);
+	kleb_session_close(session);
 
 }
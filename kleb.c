@@ -29,12 +29,32 @@ along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
 #include <asm/nmi.h>		// reserve_perfctr_nmi ...
 #include <asm/perf_event.h>	// union cpuid10...
 #include <asm/special_insns.h> // read and write cr4
+#include <asm/tlbflush.h>	// cr4_set_bits_irqsoff keeps the CR4 shadow in sync
+#include <asm/processor.h>	// cpuid
+#include <asm/cpufeature.h>	// boot_cpu_has
 #include "kleb.h"
 
 #include <linux/kprobes.h> 	// kprobe and jprobe
 #include <linux/sched.h> 	//finish_task_switch
 
 #include <linux/time.h>
+#include <linux/uprobes.h>	// uprobe and uretprobe
+#include <linux/namei.h>	// kern_path
+#include <linux/vmalloc.h>
+#include <linux/mm.h>		// alloc_pages_node, kvcalloc
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>	// topology_core_cpumask
+#include <linux/jump_label.h>	// static keys
+#include <linux/static_call.h>	// hot paths selected per session
+#include <linux/timex.h>	// get_cycles
+#include <linux/perf_event.h>	// perf_event_create_kernel_counter
+#include <linux/seqlock.h>	// seqcount
+#include <linux/hash.h>		// hash_32
+#include <linux/sched/signal.h>	// for_each_process_thread
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36)
 #define UNLOCKED 1
@@ -46,44 +66,128 @@ MODULE_DESCRIPTION("K-LEB: A hardware event recording system with a high resolut
 MODULE_VERSION("0.8.0");
 
 /* Module parameters */
-static struct hrtimer hr_timer;
 static ktime_t ktime_period_ns;
 static unsigned int delay_in_ns;
-static int num_events, counter, timer_restart;
+static int num_events, num_counters, timer_restart;
 static int target_pid, recording;
-static unsigned int **hardware_events;
+static int tracking;	// Forks of targets are tracked, set before existing tasks are walked
 static int Major;
 static kleb_ioctl_args_t kleb_ioctl_args;
 static int sysmode;
+static int hifreq;
+static int num_groups;	// Sample groups, one per target process
 #define NUM_CORES num_online_cpus()
-#define num_recordings 500
 /* For tapping */
 struct cdev *kernel_cdev;
 
+/* Tracked tasks, open addressing on pid so the switch hook looks up without locks, adds are serialized */
+#define TARGET_SLOTS (2 * MAX_TASKS)
+#define TARGET_FREE 0
+#define TARGET_GONE -1	// Exited, the slot can be reused
+#define TARGET_PROBE 64	// Longest probe, bounds lookups when exits leave many tombstones
 typedef struct target_id{
 	int pid;
-	int status;
-    int on_cpu;
+	int ctx;	// Slot in task_ctx, -1 when the table is full
+	int group;	// Target the task descends from
 }target_id;
-
-typedef struct {
-	target_id *target_pid;
-	size_t size;
-    int index_size;
-    int index;
-	int new_targetid;
-}target_array;
-
-static target_array *target;
+static DEFINE_RAW_SPINLOCK(target_lock);
+
+static target_id *target;
+static atomic_t num_targets;
+
+/* Adaptive sampling period */
+#define ADAPT_IDLE_INST_PER_MS 1000	// Below this instruction rate the target is treated as idle
+static int adaptive;
+static unsigned int min_delay_in_ns, max_delay_in_ns;
+static u64 last_inst;
+static unsigned int last_period;
+static ktime_t last_tick;
+
+/* Region of interest markers */
+static int roi_mode;
+static atomic_t region_depth;
+static unsigned int region_label;
+static int region_pending;
+
+/* Top-down level 1, fixed counter 3 counts the issue slots */
+#define MSR_FIXED_CTR3 0x30c
+#define MSR_TOPDOWN_METRICS 0x329	// PERF_METRICS, one 8-bit fraction of the slots per category
+#define MSR_PERF_CAP 0x345
+#define PERF_CAP_TOPDOWN_METRICS (1ULL << 15)
+#define TOPDOWN_GLOBAL_METRICS (1U << 16)	// Bit 48 of IA32_PERF_GLOBAL_CTRL
+
+/* RAPL energy, read once per package on every tick */
+#define MSR_RAPL_UNIT 0x606
+static const int rapl_msr[NUM_ENERGY_COUNTERS] = { 0x611, 0x639, 0x619 };	// Package, PP0 and DRAM energy status
+static int rapl;
+static unsigned int rapl_mask;	// Energy MSRs this CPU implements
+
+/* Last branch records, the hot paths are patched out while disabled */
+#define MSR_DEBUGCTL 0x1d9
+#define DEBUGCTL_LBR (1ULL << 0)
+#define MSR_LBR_SELECT 0x1c8
+#define MSR_LBR_TOS 0x1c9
+#define MSR_LBR_FROM 0x680
+#define MSR_LBR_TO 0x6c0
+static DEFINE_STATIC_KEY_FALSE(lbr_enabled);
+static unsigned int lbr_depth;	// Entries in the LBR stack
+static unsigned int lbr_nr;	// Entries per snapshot
+
+/* PEBS memory sampling on the last programmable counter, records are drained on every fold */
+#define MSR_DS_AREA 0x600
+#define MSR_PEBS_ENABLE 0x3f1
+#define MSR_PEBS_DATA_CFG 0x3f2
+#define MSR_PEBS_LD_LAT 0x3f6
+#define PEBS_DATA_CFG_MEMINFO (1ULL << 0)
+#define EVTSEL_ADAPTIVE (1ULL << 34)	// Adaptive records carry the groups of PEBS_DATA_CFG
+#define PEBS_COUNTER (MAX_EVENTS - 1)
+#define PEBS_BUFFER_SIZE (16 * PAGE_SIZE)
+#define PEBS_EVENT_LOAD_LATENCY 0x01cd	// MEM_TRANS_RETIRED.LOAD_LATENCY
+#define PEBS_EVENT_LLC_MISS 0x20d1	// MEM_LOAD_RETIRED.L3_MISS
+static DEFINE_STATIC_KEY_FALSE(pebs_enabled);
+static int pebs;
+
+/* Self-monitoring, targets read the counters with rdpmc and K-LEB never resets them */
+static DEFINE_STATIC_KEY_FALSE(rdpmc_enabled);
+static int rdpmc;
+static u64 pmc_mask, fixed_mask;	// Counter widths from CPUID 0xa
+#define RDPMC_FIXED (1U << 30)	// rdpmc index of fixed counter 0
+static unsigned int pebs_format;	// PEBS record format, adaptive from 4
+static unsigned int pebs_record_size;	// Bytes per record
+static unsigned int pebs_latency;
+static u64 pebs_reset;		// Counter value after each record
+static u64 pebs_evtsel;
+static u64 pebs_enable_bits;
+
+/* Debug store, only the PEBS half is used */
+typedef struct kleb_ds {
+	u64 bts_base, bts_index, bts_max, bts_threshold;
+	u64 pebs_base, pebs_index, pebs_max, pebs_threshold;
+	u64 pebs_reset[12];
+}kleb_ds_t;
+
+/* perf_event backend, per-CPU counters owned by perf and read locally on every fold */
+static int perf_backend;
+static const u64 perf_fixed[NUM_FIXED_COUNTERS] = { PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_REF_CPU_CYCLES };
 
 /* Counters parameters */
-static int reg_addr, reg_addr_val, reg_fixed_addr_val, event_num, umask, enable_bits, disable_bits, event_on, event_off;
+#define MSR_EVTSEL0 0x186	// IA32_PERFEVTSEL0, the local paths index MSRs from constants
+#define MSR_PMC0 0xc1
+#define MSR_FIXED_CTR0 0x309
+#define MSR_FIXED_CTRL 0x38d
+#define MSR_GLOBAL_CTRL 0x38f
+static int umask, enable_bits, disable_bits;
+static u32 evtsel_on[MAX_EVENT_GROUPS][MAX_EVENTS], evtsel_off[MAX_EVENT_GROUPS][MAX_EVENTS];	// IA32_PERFEVTSELx values of each event group, 0 leaves a counter off
+static int num_event_groups;	// Event groups spread over the CPUs in system-wide mode, 0 programs counter[] everywhere
 static int test_counters[10];
 static int addr[4];
 static int addr_fixed;
 static int addr_global;
 static int addr_val[4];
 static int addr_fixed_val[3];
+static int topdown;		// Fixed counter 3 and PERF_METRICS follow the fixed counters
+static u32 global_fixed_bits;	// High half of IA32_PERF_GLOBAL_CTRL
+static u32 fixed_ctrl;		// IA32_FIXED_CTR_CTRL while counting
 //static long int eax_low, edx_high;
 //long int count_in;
 unsigned long long counter_umask;
@@ -91,542 +195,2091 @@ unsigned int user_os_rec;
 
 /* Handle context switch & CPU switch */
 
-static unsigned int hardware_events_core[16];
-
-/* Initialize counters */
-static long pmu_start_counters(void)
+/* Per-CPU arrays of a session, too large for the static per-CPU area modules share */
+typedef struct kleb_cpu_buf {
+	u64 total[MAX_TARGETS][MAX_COUNTERS];	// Folded counts per group, never reset while recording
+	u64 last[MAX_TARGETS][MAX_COUNTERS];	// Totals at the last published row, home timer only
+	u64 lbr[MAX_LBR][2];		// Branches at the last snapshot, from then to
+	u64 pebs[MAX_PEBS][3];		// Memory samples waiting for the home timer
+	unsigned char pebs_group[MAX_PEBS];
+}kleb_cpu_buf_t;
+
+/* Per-CPU sampling state, totals are only written on their own CPU with interrupts off */
+typedef struct kleb_cpu {
+	struct hrtimer timer;
+	seqcount_t seq;
+	kleb_cpu_buf_t *buf;		// On the node of the CPU, allocated at IOCTL_START
+	int target_running;
+	int ctx;			// Task context counted on this CPU, -1 if none
+	int group;			// Group counted on this CPU
+	int event_group;		// Events programmed on this CPU, 0 unless event groups are set
+	int rapl_leader;		// First monitored CPU of its package, reads the package energy
+	u64 rapl_raw[NUM_ENERGY_COUNTERS];	// Last 32-bit energy readings
+	u64 energy[NUM_ENERGY_COUNTERS];	// Energy units since start
+	u64 energy_last[NUM_ENERGY_COUNTERS];	// Energy at the last published row, home timer only
+	ktime_t lbr_time;
+	int lbr_group;
+	unsigned long lbr_seq;		// Snapshots taken
+	unsigned long lbr_published;	// Snapshot in the ring, home timer only
+	kleb_ds_t *ds;			// Debug store followed by the PEBS buffer
+	u64 ds_saved;			// DS_AREA of the kernel before start
+	u64 pebs_ctr;			// PEBS counter while the target is switched out
+	unsigned long pebs_head;	// Written by this CPU
+	unsigned long pebs_tail;	// Written by the home timer
+	unsigned long pebs_lost;	// Records dropped on a full staging area
+	struct perf_event *perf[MAX_EVENTS + NUM_FIXED_COUNTERS];	// Events then fixed counters with the perf backend
+	u64 perf_base[MAX_EVENTS + NUM_FIXED_COUNTERS];	// Counts at the last fold
+	u64 pmc_base[MAX_EVENTS + NUM_FIXED_COUNTERS];	// Raw counters at the last fold in rdpmc mode
+	kleb_timer_stats_t timer_stats;
+}kleb_cpu_t;
+static DEFINE_PER_CPU(kleb_cpu_t, kleb_cpu);
+static int per_cpu_mode, rows_per_tick, home_cpu;
+static unsigned long tick_words;	// Ring words one tick may publish
+static struct cpumask kleb_cpus;
+static ktime_t start_time;
+
+/* Sample ring, the home timer is the only producer and read() the only consumer */
+typedef struct kleb_ring {
+	kleb_ring_ctrl_t *ctrl;	// Page mapped by user readers, mirrors the indices
+	u64 *data;
+	unsigned long size;	// Words
+	unsigned long head;	// Published with release by the producer
+	unsigned long tail;	// Published with release by the consumer
+	unsigned long next;	// Head reserved by the producer
+	unsigned long drop;	// Oldest valid position, moved by the producer when overwriting
+	unsigned long overwritten;	// Samples overwritten before they were read
+	unsigned long reported;	// Overwritten samples reported by the reader
+	unsigned long pending;	// Samples dropped since the last loss record
+	unsigned long lost;	// Samples dropped on a full ring
+	unsigned long paused;	// Ticks skipped waiting for the reader
+	unsigned long lbr_lost;	// Branch snapshots dropped on a full ring
+	unsigned long pebs_lost;	// Memory samples dropped on a full ring
+	struct page **pages;	// Backing pages on the producer's node
+	unsigned long num_pages;
+}kleb_ring_t;
+static kleb_ring_t ring;
+static int overflow_policy;
+static DECLARE_WAIT_QUEUE_HEAD(ring_wait);
+#define MAX_RING_WORDS (8UL << 20)	// 64MB cap on time-sized rings
+
+/* Per-task counter contexts, a slot is only written on the CPU its task runs on */
+static kleb_task_stats_t *task_ctx;
+static atomic_t num_task_ctx;
+
+/* Claim a context for a new task */
+static int task_ctx_claim(struct task_struct *task)
 {
-	int i = 0;
-
-	/* Assign IA32_FIXED_CTR_CTRL MSR & MSR_PERF_GLOBAL_CTRL MSR */
-	addr_fixed = 0x38d;
-	addr_global = 0x38f;
-
-	/* Setup configurable counters */
-	/* Assign perfeventsel0-3 */
-	addr[0] = 0x186; // IA32_PERFEVTSELx MSRs
-	addr[1] = 0x187;
-	addr[2] = 0x188;
-	addr[3] = 0x189;
-
-	//Assign perfctr0-3
-	addr_val[0] = 0xc1; // IA32_PMC MSR // 0xc1 is perfctr0
-	addr_val[1] = 0xc2;
-	addr_val[2] = 0xc3;
-	addr_val[3] = 0xc4;
-	
-	/* Assign events */
-	for (i = 0; i < num_events; ++i)
-	{
-		test_counters[i] = kleb_ioctl_args.counter[i];	
-	}
-	
-	//printk_d(KERN_INFO "Events: %d %d %d %d\n", counter1, counter2, counter3, counter4);
+	int slot = atomic_inc_return(&num_task_ctx) - 1;
 
-	/* Define IA32_PERFEVTSELx MSRs parameters */
-	user_os_rec &= 0x01; // Enforces requirement of 0 <= user_os_rec <= 3
-	enable_bits = 0x400000 + (user_os_rec << 16);
-	//enable_bits = 0x600000 + (user_os_rec << 16);
-	disable_bits = 0x100000 + (user_os_rec << 16);
-	counter_umask &= 0xFF; // Enforces requirement of 0 <= counter_umask <= 0xFF
-	umask = counter_umask << 8;
-
-	/* Setup fixed counters */
-	/* Assign fixedperfctr0-2 */
-	addr_fixed_val[0] = 0x309; //IA32_FIXED_CTR; // 0xc1 is fixedperfctr0
-	addr_fixed_val[1] = 0x30a;
-	addr_fixed_val[2] = 0x30b;
+	if (slot >= MAX_TASKS)
+		return -1;
 
-	memset(hardware_events_core, 0, sizeof(hardware_events_core));
-
-	return 0;
+	task_ctx[slot].tgid = task->tgid;
+	task_ctx[slot].pid = task->pid;
+	return slot;
 }
 
-/* Disable counting */
-static long pmu_stop_counters(int current_core)
+/* Tracked task of pid, NULL if not tracked */
+static target_id *target_find(int pid)
 {
-	if(sysmode){
-		/* Disable counters on global counter control */
-		wrmsrl_safe_on_cpu(current_core, addr_global, 0x00);
-		/* Disable fixed counters */
-		wrmsrl_safe_on_cpu(current_core, addr_fixed, 0);
-	}
-	else{
-		/* Disable counters on global counter control */
-		__asm__("wrmsr"
-				:
-				: "c"(addr_global), "a"(0x00), "d"(0x00));
-		/* Disable fixed counters */
-		__asm__("wrmsr"
-				:
-				: "c"(addr_fixed), "a"(0x00), "d"(0x00));
-	}
-
+	unsigned int h = hash_32(pid, ilog2(TARGET_SLOTS));
+	int slot_pid;
 
-	/* Disable configurable counters */
-	for (int i = 0; i < num_events; i++)
+	if (pid <= 0)
+		return NULL;
+	for (int i = 0; i < TARGET_PROBE; ++i)
 	{
-		//reg_addr_val = addr_val[i];
-		reg_addr = addr[i];
-		event_num = test_counters[i];
-		event_off = event_num | umask | disable_bits;
+		target_id *t = &target[(h + i) & (TARGET_SLOTS - 1)];
 
-		/* Set event off */
-		if(sysmode){
-			wrmsrl_on_cpu(current_core, reg_addr, event_off);
-		}
-		else{
-			__asm__("wrmsr"
-			:
-			: "c"(reg_addr), "a"(event_off), "d"(0x00));
-		}
+		slot_pid = READ_ONCE(t->pid);
+		if (slot_pid == pid)
+			return t;
+		if (slot_pid == TARGET_FREE)
+			break;
 	}
-
-	return 0;
+	return NULL;
 }
 
-/* Enable counting */
-static long pmu_restart_counters(int current_core)
+/* Track a task, the fork hook and the walk of existing tasks may both see a new task */
+static void target_add(struct task_struct *task, int group)
 {
-	int i = 0;
-		
-	/* Enable 7 counters on global counter control */
-	if(sysmode){
-		wrmsr_on_cpu(current_core, addr_global, 0x0f, 0x07);
-	}
-	else{
-		__asm__("wrmsr"
-		:
-		: "c"(addr_global), "a"(0x0f), "d"(0x07)); //4 HPCs 3 Fixed HPC
-	}
+	unsigned int h = hash_32(task->pid, ilog2(TARGET_SLOTS));
+	target_id *slot = NULL;
+	unsigned long flags;
 
-	/* Enable configuration counters */
-	for (i = 0; i < num_events; i++)
+	raw_spin_lock_irqsave(&target_lock, flags);
+	if (target_find(task->pid))
 	{
-		reg_addr_val = addr_val[i];
-		reg_addr = addr[i];
-		event_num = test_counters[i];
-		event_on = event_num | umask | enable_bits;
-
-		/* Clear old value & Enable counting */
-		if(sysmode){
-			wrmsrl_on_cpu(current_core, reg_addr_val, 0x0);
-			wrmsrl_on_cpu(current_core, reg_addr, event_on);
-		}
-		else{
-			__asm__("wrmsr"
-			:
-			: "c"(reg_addr_val), "a"(0x00), "d"(0x00));
-			__asm__("wrmsr"
-			:
-			: "c"(reg_addr), "a"(event_on), "d"(0x00));
-		}	
+		raw_spin_unlock_irqrestore(&target_lock, flags);
+		return;
 	}
-
-	for (i = 0; i < 3; i++)
+	for (int i = 0; i < TARGET_PROBE && !slot; ++i)
 	{
-		reg_fixed_addr_val = addr_fixed_val[i];
+		target_id *t = &target[(h + i) & (TARGET_SLOTS - 1)];
+		int slot_pid = READ_ONCE(t->pid);
 
-		/* Reset counter value */
-		if(sysmode){
-			wrmsrl_on_cpu(current_core, reg_fixed_addr_val, 0x0);
-			
-		}
-		else{
-			__asm__("wrmsr"
-			:
-			: "c"(reg_fixed_addr_val), "a"(event_on), "d"(0x00));
-		}
-	}
-	/* Enable fixed counters */
-	if(sysmode){
-			wrmsrl_on_cpu(current_core, addr_fixed, 0x222);
+		if (slot_pid == TARGET_FREE || slot_pid == TARGET_GONE)
+			slot = t;
 	}
-	else{
-		__asm__("wrmsr"
-		:
-		: "c"(addr_fixed), "a"(0x222), "d"(0x00));
+	if (slot)
+	{
+		/* The context is only claimed for a slot, ctx and group are visible before the pid */
+		WRITE_ONCE(slot->ctx, task_ctx_claim(task));
+		WRITE_ONCE(slot->group, group);
+		smp_store_release(&slot->pid, task->pid);
+		atomic_inc(&num_targets);
 	}
-
-	return 1;
+	raw_spin_unlock_irqrestore(&target_lock, flags);
+	if (!slot)
+		printk_d("Too many tracked tasks, %d not tracked\n", task->pid);
 }
 
-/* Read counters value */
-static long pmu_read_counters(void)
+/* No probe passes a free slot, so a slot before a free one can turn free too */
+static void target_remove(target_id *t)
 {
-	/* Read configuration counters */
-	for (int i = 0; i < num_events + 3; i++)
-	{
-		/******* Counting/Subtract ********/
-		hardware_events[i][counter] = hardware_events_core[i];
-		hardware_events_core[i] = 0;
-	}
+	target_id *next = &target[(t - target + 1) & (TARGET_SLOTS - 1)];
+	unsigned long flags;
 
-	return 0;
+	raw_spin_lock_irqsave(&target_lock, flags);
+	WRITE_ONCE(t->pid, (READ_ONCE(next->pid) == TARGET_FREE) ? TARGET_FREE : TARGET_GONE);
+	raw_spin_unlock_irqrestore(&target_lock, flags);
+	atomic_dec(&num_targets);
 }
-static u64 pmu_read_counters_core(int current_core)
+
+/* Group of a target process, -1 if it is not one */
+static int target_group(int tgid)
 {
-	int i = 0;
-	u64 val = 0;
-	
-	/* Read configuration counters */
-	for (i = 0; i < num_events; i++)
+	for (int i = 0; i < num_groups; ++i)
 	{
-		reg_addr_val = addr_val[i];
-
-		/* Read & reset counter value */
-		if(sysmode){
-			rdmsrl_on_cpu(current_core, reg_addr_val, &val);
-			wrmsrl_on_cpu(current_core, reg_addr_val, 0x0);
-		}
-		else{
-
-			__asm__("rdmsr"
-					: "=A"(val)
-					: "c"(reg_addr_val));
-
-			__asm__("wrmsr"
-					:
-					: "c"(reg_addr_val), "a"(0x00), "d"(0x00));
-		}
-
-		hardware_events_core[i] += val;
-		
+		if (kleb_ioctl_args.targets[i] == tgid)
+			return i;
 	}
+	return -1;
+}
 
-	/* Read fixed counters */
-	for (i = 0; i < 3; i++)
-	{
-		reg_fixed_addr_val = addr_fixed_val[i];
+/* Track the targets with the threads and descendants they already have */
+static void target_add_existing(void)
+{
+	struct task_struct *p, *t, *a;
+	int group;
 
-		if(sysmode){
-			rdmsrl_on_cpu(current_core, reg_fixed_addr_val, &val);
-			wrmsrl_on_cpu(current_core, reg_fixed_addr_val, 0x0);
-		}
-		else{
-			__asm__("rdmsr"
-					: "=A"(val)
-					: "c"(reg_fixed_addr_val));
-			__asm__("wrmsr"
-					:
-					: "c"(reg_fixed_addr_val), "a"(0x00), "d"(0x00));
+	rcu_read_lock();
+	for_each_process_thread(p, t)
+	{
+		/* The closest target ancestor owns the task, as it would at creation */
+		for (a = t; a->pid > 1; a = rcu_dereference(a->real_parent))
+		{
+			group = target_group(a->tgid);
+			if (group >= 0)
+			{
+				target_add(t, group);
+				break;
+			}
 		}
-		
-		hardware_events_core[i+num_events] += val;
-		
 	}
+	rcu_read_unlock();
+}
 
+/* LBR stack of this CPU, 32 entries from Skylake and 16 before, 0 without model-specific LBR */
+static unsigned int lbr_probe(void)
+{
+	u64 val;
+
+	/* Architectural LBR moved the stack and its controls */
+	if (boot_cpu_has(X86_FEATURE_ARCH_LBR))
+		return 0;
+	if (!rdmsrl_safe(MSR_LBR_FROM + 31, &val) && !rdmsrl_safe(MSR_LBR_TO + 31, &val))
+		return 32;
+	if (!rdmsrl_safe(MSR_LBR_FROM + 15, &val) && !rdmsrl_safe(MSR_LBR_TO + 15, &val))
+		return 16;
 	return 0;
 }
 
-static u64 pmu_read_counters_core_oncpu(int current_core)
+/* Branch address format, flags such as misprediction share the from address */
+static unsigned int lbr_format(void)
 {
-	int i = 0;
-	u64 val = 0;
-	
-	/* Read configuration counters */
-	for (i = 0; i < num_events; i++)
-	{
-		reg_addr_val = addr_val[i];
+	u64 cap;
 
-		/* Read & reset counter value */
-		rdmsrl_on_cpu(current_core, reg_addr_val, &val);
-		wrmsrl_on_cpu(current_core, reg_addr_val, 0x0);
+	if (!boot_cpu_has(X86_FEATURE_PDCM) || rdmsrl_safe(MSR_PERF_CAP, &cap))
+		return 0;
+	return cap & 0x3f;
+}
 
-		hardware_events_core[i] += val;
-	}
+/* Record branches at the privilege levels counted by the events */
+static void lbr_start(void)
+{
+	u64 debugctl;
 
-	/* Read fixed counters */
-	for (i = 0; i < 3; i++)
-	{
-		reg_fixed_addr_val = addr_fixed_val[i];
+	/* LBR_SELECT bits suppress, bit 0 ring 0 and bit 1 the other rings */
+	wrmsrl(MSR_LBR_SELECT, (user_os_rec == 1) ? 0x1 : (user_os_rec == 2) ? 0x2 : 0x0);
+	rdmsrl(MSR_DEBUGCTL, debugctl);
+	wrmsrl(MSR_DEBUGCTL, debugctl | DEBUGCTL_LBR);
+}
 
-		rdmsrl_on_cpu(current_core, reg_fixed_addr_val, &val);
-		wrmsrl_on_cpu(current_core, reg_fixed_addr_val, 0x0);
-		
-		hardware_events_core[i+num_events] += val;
-		
-	}
+static void lbr_stop(void)
+{
+	u64 debugctl;
 
-	return 0;
+	rdmsrl(MSR_DEBUGCTL, debugctl);
+	wrmsrl(MSR_DEBUGCTL, debugctl & ~DEBUGCTL_LBR);
 }
 
-int kprobes_handle_finish_task_switch_pre(struct kprobe *p, struct pt_regs *regs)
+/* Copy the most recent branches, the stack is frozen while it is read */
+static void lbr_snapshot(kleb_cpu_t *kc, ktime_t now)
 {
-	if(recording && (counter < num_recordings))
+	u64 debugctl, tos;
+
+	rdmsrl(MSR_DEBUGCTL, debugctl);
+	wrmsrl(MSR_DEBUGCTL, debugctl & ~DEBUGCTL_LBR);
+	rdmsrl(MSR_LBR_TOS, tos);
+
+	write_seqcount_begin(&kc->seq);
+	for (unsigned int i = 0; i < lbr_nr; i++)
 	{
-		//printk(KERN_INFO "Monitor start on CPU: %d", current->thread_info.cpu);
+		unsigned int idx = (tos - i) & (lbr_depth - 1);
 
-		if(!sysmode){
-			for(int i=0; i < target->index_size; ++i){
-				if (current->pid == target->target_pid[i].pid && current->pid != 0 && current->pid != 1){
-					target->target_pid[i].on_cpu = current->thread_info.cpu;
-					target->target_pid[i].status = 1;
-					//Call start
-					// if(!timer_restart){
-					// 	ktime_period_ns = ktime_set(0, delay_in_ns);
-					// 	hrtimer_start(&hr_timer, ktime_period_ns, HRTIMER_MODE_REL);
-					// 	timer_restart = 1;
-					// 	printk(KERN_INFO "Timer start on %d\n", current->thread_info.cpu);
-					// }
-					pmu_restart_counters(target->target_pid[i].on_cpu);
-					//printk(KERN_INFO "task_switch IN %d %d %d %d %d %d %d\n",current->pid, target->target_pid[i].pid, current->parent->pid, current->tgid, current->thread_info.cpu, current->thread_info.cpu, target->index_size);
-					break;
-				}
-				else if(current->parent->pid == target->target_pid[i].pid && current->parent->pid != 0){
-					target->new_targetid = 1;
-					/* Check if fork already exist */
-					for(int j=0; j < target->index_size; ++j){
-						if(current->pid == target->target_pid[j].pid){
-							target->new_targetid = 0;
-							break;
-						}
-					}
-					if(target->new_targetid){
-						target->index_size += 1;
-						if(target->index_size >= target->size){
-							target->size = target->size+100;
-							target->target_pid = krealloc(target->target_pid,sizeof(target_id)*target->size, GFP_KERNEL); 
-						}
-						target->target_pid[target->index_size].pid = current->pid;
-						target->target_pid[target->index_size].on_cpu = current->thread_info.cpu;
-						target->target_pid[target->index_size].status = 1;
-					}
-				}
-				else if(current->tgid == target->target_pid[i].pid && current->tgid != 0){
-					target->new_targetid = 1;
-					/* Check if thread already exist */
-					for(int j=0; j < target->index_size; ++j){
-						if(current->pid == target->target_pid[j].pid){
-							target->new_targetid = 0;
-							break;
-						}
-					}
-					if(target->new_targetid){
-						target->index_size += 1;
-						if(target->index_size >= target->size){
-							target->size = target->size+100;
-							target->target_pid = krealloc(target->target_pid,sizeof(target_id)*target->size, GFP_KERNEL); 
-						}
-						target->target_pid[target->index_size].pid = current->pid;
-						target->target_pid[target->index_size].on_cpu = current->thread_info.cpu;
-						target->target_pid[target->index_size].status = 1;
-					}
-				}
-				else{
-					if(current->pid != target->target_pid[i].pid && target->target_pid[i].status == 1 && current->thread_info.cpu == target->target_pid[i].on_cpu){
-						target->target_pid[i].on_cpu = -1;
-						target->target_pid[i].status = 0;
-						//Call stop
-						pmu_read_counters_core(current->thread_info.cpu);
-						pmu_stop_counters(current->thread_info.cpu);
-					}
-				}
-			}
-		}
+		rdmsrl(MSR_LBR_FROM + idx, kc->buf->lbr[i][0]);
+		rdmsrl(MSR_LBR_TO + idx, kc->buf->lbr[i][1]);
 	}
+	kc->lbr_time = now;
+	kc->lbr_group = kc->group;
+	kc->lbr_seq++;
+	write_seqcount_end(&kc->seq);
 
-	return 0;
+	wrmsrl(MSR_DEBUGCTL, debugctl);
 }
-/* void kprobes_handle_finish_task_switch_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
+
+/* PEBS record format with data addresses, 0 when unusable */
+static unsigned int pebs_probe(void)
+{
+	u64 misc, cap;
+
+	if (!boot_cpu_has(X86_FEATURE_DS) || !boot_cpu_has(X86_FEATURE_PDCM))
+		return 0;
+	/* PEBS writes from user mode, the buffer would have to be in the user page tables */
+	if (boot_cpu_has(X86_FEATURE_PTI))
+		return 0;
+	if (rdmsrl_safe(MSR_IA32_MISC_ENABLE, &misc) || (misc & MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL))
+		return 0;
+	if (rdmsrl_safe(MSR_PERF_CAP, &cap))
+		return 0;
+	return (cap >> 8) & 0xf;
+}
+
+/* Counter setup and record layout for the requested event */
+static void pebs_setup(unsigned int period)
 {
-	if(recording && (counter < num_recordings))
+	unsigned int eax, ebx, ecx, edx;
+	static const unsigned int sizes[] = { 0, 0xb0, 0xc0, 0xc8 };
+
+	cpuid(0xa, &eax, &ebx, &ecx, &edx);
+	pebs_evtsel = (pebs == PEBS_LOAD_LATENCY) ? PEBS_EVENT_LOAD_LATENCY : PEBS_EVENT_LLC_MISS;
+	pebs_enable_bits = 1ULL << PEBS_COUNTER;
+	/* Load latency has its own enable before architectural perfmon 5 */
+	if (pebs == PEBS_LOAD_LATENCY && (eax & 0xff) < 5)
+		pebs_enable_bits |= 1ULL << (32 + PEBS_COUNTER);
+	if (pebs_format >= 4)
 	{
-			if (current->pid == target_pid)
-			{
-				printk(KERN_INFO "finish_task_switch_post: %s [%d] [%d] [%d]\n", current->comm, current->pid, current->thread_info.cpu, current->state);
-			}
-		
+		/* Basic group then memory info group */
+		pebs_evtsel |= EVTSEL_ADAPTIVE;
+		pebs_record_size = 8 * sizeof(u64);
 	}
-}*/
-static int kprobes_handle_do_exit_pre(struct kprobe *p, struct pt_regs *regs)
-{
-	if(recording && (counter < num_recordings) && !sysmode)
+	else
 	{
-		for(int i=0; i < target->index_size; ++i){
-			if(current->pid == target->target_pid[i].pid && current->pid != 0 && current->pid != 1){
-				
-				/* Extract last data */ // Might not be necessary
-				if(counter < num_recordings){
-					pmu_read_counters_core_oncpu(target->target_pid[i].on_cpu);
-				}
-				//Call stop
-				pmu_stop_counters(target->target_pid[i].on_cpu);
-				
-				/* Remove and shift array elements */
-				for (int j = i; j < target->index_size-1; j++){
-					target->target_pid[j].pid = target->target_pid[j+1].pid;
-					target->target_pid[j].status = target->target_pid[j+1].status;
-					target->target_pid[j].on_cpu = target->target_pid[j+1].on_cpu;
-				}
-				target->index_size -= 1;
+		pebs_record_size = sizes[pebs_format];
+	}
+	pebs_reset = (-(u64)period) & ((1ULL << 48) - 1);
+}
 
-				/* Remove excess space if necessary */
-				if(target->index_size < target->size-100 && target->size > 100){
-					target->size = target->size-100;
-					target->target_pid = krealloc(target->target_pid,sizeof(target_id)*target->size, GFP_KERNEL); 
-				}
+/* Point the debug store at this CPU's buffer, the interrupt threshold is never reached */
+static void pebs_attach(void *info)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+	kleb_ds_t *ds = kc->ds;
+
+	ds->pebs_base = (u64)(ds + 1);
+	ds->pebs_index = ds->pebs_base;
+	ds->pebs_max = ds->pebs_base + (PEBS_BUFFER_SIZE / pebs_record_size) * pebs_record_size;
+	ds->pebs_threshold = ds->pebs_max + pebs_record_size;
+	ds->pebs_reset[PEBS_COUNTER] = pebs_reset;
+	kc->pebs_ctr = pebs_reset;
+
+	rdmsrl(MSR_DS_AREA, kc->ds_saved);
+	wrmsrl(MSR_DS_AREA, (u64)ds);
+	if (pebs == PEBS_LOAD_LATENCY)
+		wrmsrl(MSR_PEBS_LD_LAT, pebs_latency);
+	if (pebs_format >= 4)
+		wrmsrl(MSR_PEBS_DATA_CFG, PEBS_DATA_CFG_MEMINFO);
+}
 
-				//printk(KERN_INFO "Task (do_exit): %d %d %d %d %d %d\n", current->pid, target->target_pid[i].pid,current->parent->pid,current->tgid, current->thread_info.cpu, target->index_size);
-				break;
-			}
-		}
-	}
-	return 0;
+/* Count on the PEBS counter from where it stopped, INT stays clear so no PMI is raised */
+static void pebs_start(kleb_cpu_t *kc)
+{
+	wrmsrl(addr_val[PEBS_COUNTER], kc->pebs_ctr);
+	wrmsrl(addr[PEBS_COUNTER], pebs_evtsel | enable_bits);
+	wrmsrl(MSR_PEBS_ENABLE, pebs_enable_bits);
 }
-/*void kprobes_handle_do_exit_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
+
+static void pebs_stop(kleb_cpu_t *kc)
+{
+	wrmsrl(MSR_PEBS_ENABLE, 0);
+	wrmsrl(addr[PEBS_COUNTER], 0);
+	rdmsrl(addr_val[PEBS_COUNTER], kc->pebs_ctr);
+}
+
+static void pebs_detach(kleb_cpu_t *kc)
+{
+	pebs_stop(kc);
+	if (pebs_format >= 4)
+		wrmsrl(MSR_PEBS_DATA_CFG, 0);
+	wrmsrl(MSR_DS_AREA, kc->ds_saved);
+}
+
+/* Instruction, data address and latency of a record */
+static void pebs_parse(const u64 *rec, u64 *sample)
 {
-	if(recording && (counter < num_recordings))
+	if (pebs_format >= 4)
 	{
-		for(int i=0; i < target->index_size; ++i){
-			if(current->pid == target->target_pid->pid && current->pid != 0 && current->pid != 1){
-				printk(KERN_INFO "Task (do_exit_post): %d %d ID %d %d %d\n", current->exit_code, current->exit_state, current->pid, current->parent->pid,current->tgid);
-			}
-		}
-		
+		sample[0] = rec[1];
+		sample[1] = rec[4];
+		/* Cache latency moved above the instruction latency in format 5 */
+		sample[2] = (pebs_format >= 5) ? (rec[6] >> 32) & 0xffff : rec[6];
 	}
-}*/
-/*static int kprobes_handle_do_fork_pre(struct kprobe *p, struct pt_regs *regs)
-{
-	if(recording && (counter < num_recordings))
+	else
 	{
-		for(int i=0; i < target->index_size; ++i)
-		{
-			if (current->parent->pid == target->target_pid[i].pid)
-			{
-				printk(KERN_INFO "do_fork_pre: %s [%d] [%d] [%ld]\n", current->comm, current->pid, current->parent->pid, current->tgid);
-			}
-		}
+		/* The eventing IP is exact from format 2 */
+		sample[0] = (pebs_format >= 2) ? rec[22] : rec[1];
+		sample[1] = rec[19];
+		sample[2] = rec[21];
 	}
-	return 0;
 }
-static void kprobes_handle_do_fork_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
+
+/* Stage this CPU's records for the home timer, PEBS is held off while the index is reset */
+static void pebs_drain(kleb_cpu_t *kc, int keep)
 {
-	if(recording && (counter < num_recordings))
+	kleb_ds_t *ds = kc->ds;
+	unsigned long head = kc->pebs_head;
+	unsigned long tail = smp_load_acquire(&kc->pebs_tail);
+	unsigned int size;
+	u64 enable, p;
+
+	rdmsrl(MSR_PEBS_ENABLE, enable);
+	if (enable)
+		wrmsrl(MSR_PEBS_ENABLE, 0);
+	for (p = ds->pebs_base; p < ds->pebs_index; p += size)
 	{
-		for(int i=0; i < target->index_size; ++i)
+		const u64 *rec = (const u64 *)p;
+
+		size = (pebs_format >= 4) ? rec[0] >> 48 : pebs_record_size;
+		if (size == 0)
+			break;
+		if (!keep)
+			continue;
+		if (head - tail >= MAX_PEBS)
 		{
-			if (current->parent->pid == target->target_pid[i].pid)
-			{
-				printk(KERN_INFO "do_fork_post: %s [%d] [%d] [%ld]\n", current->comm, current->pid, current->parent->pid, current->tgid);
-			}
+			kc->pebs_lost++;
+			continue;
 		}
+		pebs_parse(rec, kc->buf->pebs[head % MAX_PEBS]);
+		kc->buf->pebs_group[head % MAX_PEBS] = kc->group;
+		head++;
 	}
-}*/
-static struct kprobe finish_task_switch_kp = {
-	.pre_handler = kprobes_handle_finish_task_switch_pre,
-	//.post_handler = kprobes_handle_finish_task_switch_post,
-	.symbol_name = DO_EXIT_NAME,
-};
- static struct kprobe do_exit_kp = {
-	.pre_handler = kprobes_handle_do_exit_pre,
-	//.post_handler = kprobes_handle_do_exit_post,
-	.symbol_name = "do_exit",
-};
-/*static struct kprobe do_fork_kp = {
-	.pre_handler = kprobes_handle_do_fork_pre,
-	.post_handler = kprobes_handle_do_fork_post,
-	.symbol_name = "_do_fork",
-};*/
+	ds->pebs_index = ds->pebs_base;
+	smp_store_release(&kc->pebs_head, head);
+	if (enable)
+		wrmsrl(MSR_PEBS_ENABLE, enable);
+}
 
-void unregister_all(void)
+/* Counter of one CPU in the mode of -m, pinned so that it never multiplexes */
+static struct perf_event *perf_counter_create(int cpu, u32 type, u64 config)
 {
-	unregister_kprobe(&finish_task_switch_kp);
-	unregister_kprobe(&do_exit_kp);
-	//unregister_kprobe(&do_fork_kp);
+	struct perf_event_attr attr = {
+		.type = type,
+		.size = sizeof(attr),
+		.config = config,
+		.pinned = 1,
+		.exclude_user = !(user_os_rec & 1),
+		.exclude_kernel = !(user_os_rec & 2),
+		.exclude_hv = 1,
+	};
+
+	return perf_event_create_kernel_counter(&attr, cpu, NULL, NULL, NULL);
 }
 
-int register_all(void)
+static void perf_counters_release(void)
 {
-	/* Register probes */
-	
-	int ret = register_kprobe(&finish_task_switch_kp);
-	if (ret < 0)
-	{
-		printk(KERN_INFO "Couldn't register 'finish_task_switch' kprobe %d\n", ret);
-		unregister_all();
-		return (-EFAULT);
-	}
-	ret = register_kprobe(&do_exit_kp);
-	if (ret < 0)
-	{
-		printk(KERN_INFO "Couldn't register 'do_exit' kprobe %d\n", ret);
-		unregister_all();
-		return (-EFAULT);
-	}
-	/*ret = register_kprobe(&do_fork_kp);
-	if (ret < 0)
+	int cpu;
+
+	for_each_possible_cpu(cpu)
 	{
-		printk(KERN_INFO "Couldn't register 'do_fork' kprobe %d\n", ret);
-		unregister_all();
-		return (-EFAULT);
-	}*/
+		kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
 
-	return (0);
+		for (int i = 0; i < MAX_EVENTS + NUM_FIXED_COUNTERS; i++)
+		{
+			if (kc->perf[i])
+				perf_event_release_kernel(kc->perf[i]);
+			kc->perf[i] = NULL;
+		}
+	}
 }
 
-/* Restart timer */
-enum hrtimer_restart hrtimer_callback(struct hrtimer *timer)
+/* Counters on every monitored CPU, they count from creation and are never reset */
+static int perf_counters_create(void)
 {
-	ktime_t kt_now;
+	struct perf_event *event;
+	int cpu;
 
-	/* Restart timer */
-	if (timer_restart && (counter < num_recordings))
+	for_each_cpu(cpu, &kleb_cpus)
 	{
-		/* Read counter */
-		if (sysmode)
+		kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
+
+		for (int i = 0; i < num_events + NUM_FIXED_COUNTERS; i++)
 		{
-			for(int i = 0; i < NUM_CORES; i++)
+			if (i < num_events)
+				event = perf_counter_create(cpu, PERF_TYPE_RAW, kleb_ioctl_args.counter[i]);
+			else
+				event = perf_counter_create(cpu, PERF_TYPE_HARDWARE, perf_fixed[i - num_events]);
+			if (IS_ERR(event))
 			{
-				pmu_read_counters_core_oncpu(i);
+				perf_counters_release();
+				return PTR_ERR(event);
 			}
-		}
-		else
-		{
-			for(int i = 0; i < target->index_size; i++)
-			{	
-				if(target->target_pid[i].status && target->target_pid[i].on_cpu != -1 && target->target_pid[i].pid != 0)
-				{
-					pmu_read_counters_core_oncpu(target->target_pid[i].on_cpu);
-				}
+			kc->perf[i] = event;
+			/* A pinned event that does not fit is left in error rather than multiplexed */
+			if (READ_ONCE(event->state) == PERF_EVENT_STATE_ERROR)
+			{
+				printk(KERN_INFO "perf cannot schedule counter %d on CPU %d\n", i, cpu);
+				perf_counters_release();
+				return (-EBUSY);
 			}
 		}
-		pmu_read_counters();
-		++counter;
-		//printk(KERN_INFO "Extract value on CPU: %d, val: %d", current->thread_info.cpu, hardware_events[4][counter-1]);	
-	
-		/* Forward timer */
-		kt_now = hrtimer_cb_get_time(&hr_timer);
-		hrtimer_forward(&hr_timer, kt_now, ktime_period_ns);
-
-		return HRTIMER_RESTART;
 	}
-	/* No restart timer */
-	else
+	return 0;
+}
+
+/* Counts of this CPU's events, a failed read counts nothing */
+static void perf_read_counters(kleb_cpu_t *kc, u64 *val)
+{
+	for (int i = 0; i < num_events + NUM_FIXED_COUNTERS; i++)
 	{
-		if (!timer_restart)
-		{
-			printk("Timer Expired\n");
-		}
-		else if (counter > num_recordings)
-		{
-			printk("Counter > allowed spaces: %d > %d\n", counter, num_recordings);
-		}
-		return HRTIMER_NORESTART;
+		if (perf_event_read_local(kc->perf[i], &val[i], NULL, NULL))
+			val[i] = kc->perf_base[i];
 	}
 }
 
+/* Start counting for the target from the current counts */
+static void perf_rebase(kleb_cpu_t *kc)
+{
+	perf_read_counters(kc, kc->perf_base);
+}
 
-/* Initialize module from ioctl start */
-int start_counters()
+/* Fold the counts since the last fold, the perf counterpart of reading and clearing the MSRs */
+static void perf_fold_counters(kleb_cpu_t *kc, u64 *total, u64 *task, int keep)
 {
-	int i, j;
+	u64 now[MAX_EVENTS + NUM_FIXED_COUNTERS];
 
-	if (!recording)
+	perf_read_counters(kc, now);
+	for (int i = 0; i < num_events + NUM_FIXED_COUNTERS; i++)
 	{
-		target->target_pid[0].pid = kleb_ioctl_args.pid;
-		target->index_size += 1;
-		printk(KERN_INFO "target pid: %d\n", (int)target->target_pid[0].pid);
+		u64 val = now[i] - kc->perf_base[i];
+
+		kc->perf_base[i] = now[i];
+		if (keep)
+			total[i] += val;
+		if (keep && task)
+			task[i] += val;
+	}
+}
+
+/* Reset per-CPU totals before recording */
+static void pmu_reset_totals(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
+
+		memset(kc->buf->total, 0, sizeof(kc->buf->total));
+		memset(kc->buf->last, 0, sizeof(kc->buf->last));
+		kc->target_running = 0;
+		kc->ctx = -1;
+		kc->group = 0;
+		memset(kc->energy, 0, sizeof(kc->energy));
+		memset(kc->energy_last, 0, sizeof(kc->energy_last));
+		kc->lbr_seq = 0;
+		kc->lbr_published = 0;
+		kc->pebs_head = 0;
+		kc->pebs_tail = 0;
+		kc->pebs_lost = 0;
+	}
+}
+
+/* Initialize counters */
+static long pmu_start_counters(void)
+{
+	int i = 0;
+
+	/* Assign IA32_FIXED_CTR_CTRL MSR & MSR_PERF_GLOBAL_CTRL MSR */
+	addr_fixed = 0x38d;
+	addr_global = 0x38f;
+
+	/* Setup configurable counters */
+	/* Assign perfeventsel0-3 */
+	addr[0] = 0x186; // IA32_PERFEVTSELx MSRs
+	addr[1] = 0x187;
+	addr[2] = 0x188;
+	addr[3] = 0x189;
+
+	//Assign perfctr0-3
+	addr_val[0] = 0xc1; // IA32_PMC MSR // 0xc1 is perfctr0
+	addr_val[1] = 0xc2;
+	addr_val[2] = 0xc3;
+	addr_val[3] = 0xc4;
+	
+	/* Assign events */
+	for (i = 0; i < num_events; ++i)
+	{
+		test_counters[i] = kleb_ioctl_args.counter[i];	
+	}
+	
+	//printk_d(KERN_INFO "Events: %d %d %d %d\n", counter1, counter2, counter3, counter4);
+
+	/* Define IA32_PERFEVTSELx MSRs parameters */
+	user_os_rec &= 0x03; // Enforces requirement of 0 <= user_os_rec <= 3
+	enable_bits = 0x400000 + (user_os_rec << 16);
+	//enable_bits = 0x600000 + (user_os_rec << 16);
+	disable_bits = 0x100000 + (user_os_rec << 16);
+	counter_umask &= 0xFF; // Enforces requirement of 0 <= counter_umask <= 0xFF
+	umask = counter_umask << 8;
+
+	/* Setup fixed counters */
+	/* Assign fixedperfctr0-2 */
+	addr_fixed_val[0] = 0x309; //IA32_FIXED_CTR; // 0xc1 is fixedperfctr0
+	addr_fixed_val[1] = 0x30a;
+	addr_fixed_val[2] = 0x30b;
+
+	/* Fixed counters 0-2, plus fixed counter 3 and PERF_METRICS in topdown mode */
+	global_fixed_bits = topdown ? (0x0f | TOPDOWN_GLOBAL_METRICS) : 0x07;
+	/* Fixed counters take the same mode, bit 1 user and bit 0 OS in each 4-bit field */
+	fixed_ctrl = ((user_os_rec & 1) << 1) | ((user_os_rec & 2) >> 1);
+	fixed_ctrl *= topdown ? 0x1111 : 0x111;
+	pmc_mask = GENMASK_ULL((((cpuid_eax(0xa) >> 16) & 0xff) ?: 48) - 1, 0);
+	fixed_mask = GENMASK_ULL((((cpuid_edx(0xa) >> 5) & 0xff) ?: 48) - 1, 0);
+
+	/* Event group 0 is counter[] when no groups are set */
+	for (int g = 0; g < max(num_event_groups, 1); ++g)
+	{
+		for (i = 0; i < num_events; ++i)
+		{
+			u32 event = num_event_groups ? kleb_ioctl_args.event_groups[g][i] : test_counters[i];
+
+			evtsel_on[g][i] = event ? (event | umask | enable_bits) : 0;
+			evtsel_off[g][i] = event ? (event | umask | disable_bits) : 0;
+		}
+	}
+
+	if (pebs)
+	{
+		pebs_setup(kleb_ioctl_args.pebs_period);
+	}
+
+	pmu_reset_totals();
+
+	return 0;
+}
+
+/* System-wide sessions program every CPU from the ioctl, once at their start and end */
+static void pmu_stop_remote(int cpu)
+{
+	int g = per_cpu(kleb_cpu, cpu).event_group;
+
+	/* Disable counters on global counter control */
+	wrmsrl_safe_on_cpu(cpu, addr_global, 0x00);
+	/* Disable fixed counters */
+	wrmsrl_safe_on_cpu(cpu, addr_fixed, 0);
+	/* Disable configurable counters */
+	for (int i = 0; i < num_events; i++)
+	{
+		wrmsrl_on_cpu(cpu, addr[i], evtsel_off[g][i]);
+	}
+}
+
+static void pmu_restart_remote(int cpu)
+{
+	int g = per_cpu(kleb_cpu, cpu).event_group;
+
+	/* Enable 7 counters on global counter control */
+	wrmsr_on_cpu(cpu, addr_global, 0x0f, global_fixed_bits);
+	/* Clear old value & Enable counting */
+	for (int i = 0; i < num_events; i++)
+	{
+		wrmsrl_on_cpu(cpu, addr_val[i], 0x0);
+		wrmsrl_on_cpu(cpu, addr[i], evtsel_on[g][i]);
+	}
+	for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+	{
+		wrmsrl_on_cpu(cpu, addr_fixed_val[i], 0x0);
+	}
+	/* Slots and their breakdown restart together */
+	if (topdown)
+	{
+		wrmsrl_on_cpu(cpu, MSR_FIXED_CTR3, 0x0);
+		wrmsrl_on_cpu(cpu, MSR_TOPDOWN_METRICS, 0x0);
+	}
+	/* Enable fixed counters */
+	wrmsrl_on_cpu(cpu, addr_fixed, fixed_ctrl);
+}
+
+/* Local MSR write, the switch hook calls it with interrupts off */
+static __always_inline void pmu_wrmsr(u32 msr, u32 lo, u32 hi)
+{
+	__asm__("wrmsr"
+	:
+	: "c"(msr), "a"(lo), "d"(hi));
+}
+
+/* Disable counting on this CPU, n is a constant in each specialization so the loop unrolls */
+static __always_inline void pmu_stop_local(const int n)
+{
+	pmu_wrmsr(MSR_GLOBAL_CTRL, 0x00, 0x00);
+	pmu_wrmsr(MSR_FIXED_CTRL, 0x00, 0x00);
+	if (static_branch_unlikely(&lbr_enabled))
+		lbr_stop();
+	if (static_branch_unlikely(&pebs_enabled))
+		pebs_stop(this_cpu_ptr(&kleb_cpu));
+	for (int i = 0; i < n; i++)
+	{
+		pmu_wrmsr(MSR_EVTSEL0 + i, evtsel_off[0][i], 0x00);
+	}
+}
+
+/* Enable counting on this CPU */
+static __always_inline void pmu_restart_local(const int n)
+{
+	pmu_wrmsr(MSR_GLOBAL_CTRL, 0x0f, global_fixed_bits); //4 HPCs 3 Fixed HPC
+	for (int i = 0; i < n; i++)
+	{
+		pmu_wrmsr(MSR_PMC0 + i, 0x00, 0x00);
+		pmu_wrmsr(MSR_EVTSEL0 + i, evtsel_on[0][i], 0x00);
+	}
+	for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+	{
+		pmu_wrmsr(MSR_FIXED_CTR0 + i, 0x00, 0x00);
+	}
+	if (topdown)
+	{
+		wrmsrl(MSR_FIXED_CTR3, 0x0);
+		wrmsrl(MSR_TOPDOWN_METRICS, 0x0);
+	}
+	pmu_wrmsr(MSR_FIXED_CTRL, fixed_ctrl, 0x00);
+	/* Branches follow the target like the counters */
+	if (static_branch_unlikely(&lbr_enabled))
+		lbr_start();
+	if (static_branch_unlikely(&pebs_enabled))
+		pebs_start(this_cpu_ptr(&kleb_cpu));
+}
+
+/* Slots and the slots of each category since the last reset, fractions are in 1/TOPDOWN_SCALE */
+static void pmu_read_topdown(u64 *td)
+{
+	u64 slots, metrics;
+
+	rdmsrl(MSR_FIXED_CTR3, slots);
+	rdmsrl(MSR_TOPDOWN_METRICS, metrics);
+	td[0] = slots;
+	for (int i = 0; i < NUM_TOPDOWN_COUNTERS - 1; i++)
+	{
+		td[i+1] = slots * ((metrics >> (8 * i)) & 0xff);
+	}
+}
+
+/* Fold top-down into the totals, the metrics only hold since their last reset */
+static void pmu_fold_topdown(u64 *total, u64 *task)
+{
+	int base = num_events + NUM_FIXED_COUNTERS;
+	u64 td[NUM_TOPDOWN_COUNTERS];
+
+	pmu_read_topdown(td);
+	/* PERF_METRICS is cleared with the slots it was computed from */
+	wrmsrl(MSR_FIXED_CTR3, 0x0);
+	wrmsrl(MSR_TOPDOWN_METRICS, 0x0);
+	for (int i = 0; i < NUM_TOPDOWN_COUNTERS; i++)
+	{
+		if (total)
+			total[base+i] += td[i];
+		if (task)
+			task[base+i] += td[i];
+	}
+}
+
+/* Read & reset the local counters into this CPU's totals and the running task's context, caller disables interrupts */
+static __always_inline void pmu_fold_local(kleb_cpu_t *kc, const int n)
+{
+	int keep = !roi_mode || atomic_read(&region_depth);
+	u64 *task = (kc->ctx >= 0) ? task_ctx[kc->ctx].counter : NULL;
+	u64 *total = kc->buf->total[kc->group];
+	u64 val;
+
+	write_seqcount_begin(&kc->seq);
+	/* Read configuration counters */
+	for (int i = 0; i < n; i++)
+	{
+		rdmsrl(MSR_PMC0 + i, val);
+		wrmsrl(MSR_PMC0 + i, 0x0);
+		if (keep)
+			total[i] += val;
+		if (keep && task)
+			task[i] += val;
+	}
+	/* Read fixed counters */
+	for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+	{
+		rdmsrl(MSR_FIXED_CTR0 + i, val);
+		wrmsrl(MSR_FIXED_CTR0 + i, 0x0);
+		if (keep)
+			total[i+n] += val;
+		if (keep && task)
+			task[i+n] += val;
+	}
+	if (topdown)
+	{
+		pmu_fold_topdown(keep ? total : NULL, keep ? task : NULL);
+	}
+	write_seqcount_end(&kc->seq);
+	/* Records belong to the group counted until now */
+	if (static_branch_unlikely(&pebs_enabled))
+		pebs_drain(kc, keep);
+}
+
+/* Take the energy baseline of this CPU's package */
+static void rapl_start(kleb_cpu_t *kc)
+{
+	u64 val;
+
+	for (int i = 0; i < NUM_ENERGY_COUNTERS; i++)
+	{
+		if (rapl_mask & (1 << i))
+		{
+			rdmsrl(rapl_msr[i], val);
+			kc->rapl_raw[i] = val & 0xffffffff;
+		}
+	}
+}
+
+/* Add the energy since the last read, the 32-bit status wraps within minutes under load */
+static void rapl_fold(kleb_cpu_t *kc)
+{
+	u64 val;
+
+	write_seqcount_begin(&kc->seq);
+	for (int i = 0; i < NUM_ENERGY_COUNTERS; i++)
+	{
+		if (rapl_mask & (1 << i))
+		{
+			rdmsrl(rapl_msr[i], val);
+			val &= 0xffffffff;
+			kc->energy[i] += (val - kc->rapl_raw[i]) & 0xffffffff;
+			kc->rapl_raw[i] = val;
+		}
+	}
+	write_seqcount_end(&kc->seq);
+}
+
+/* One leader per package among the monitored CPUs */
+static void rapl_set_leaders(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		per_cpu(kleb_cpu, cpu).rapl_leader = 0;
+	}
+	/* The core mask holds the CPUs of the package */
+	for_each_cpu(cpu, &kleb_cpus)
+	{
+		if (cpumask_first_and(topology_core_cpumask(cpu), &kleb_cpus) == cpu)
+			per_cpu(kleb_cpu, cpu).rapl_leader = 1;
+	}
+}
+
+/* Monotonic view of the local counters, caller disables preemption */
+static __always_inline void pmu_snapshot_local(u64 *snap, const int n)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+	u64 *total = kc->buf->total[kc->group];
+	u64 val;
+
+	for (int i = 0; i < n; i++)
+	{
+		rdmsrl(MSR_PMC0 + i, val);
+		snap[i] = total[i] + val;
+	}
+	for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+	{
+		rdmsrl(MSR_FIXED_CTR0 + i, val);
+		snap[i+n] = total[i+n] + val;
+	}
+	if (topdown)
+	{
+		u64 td[NUM_TOPDOWN_COUNTERS];
+		int base = n + NUM_FIXED_COUNTERS;
+
+		pmu_read_topdown(td);
+		for (int i = 0; i < NUM_TOPDOWN_COUNTERS; i++)
+			snap[base+i] = total[base+i] + td[i];
+	}
+}
+
+/* Raw counters of this CPU into the base of the next delta */
+static __always_inline void rdpmc_rebase(kleb_cpu_t *kc, const int n)
+{
+	for (int i = 0; i < n; i++)
+		kc->pmc_base[i] = native_read_pmc(i);
+	for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+		kc->pmc_base[i+n] = native_read_pmc(RDPMC_FIXED | i);
+}
+
+/* Counts since the last fold, the counters keep running for the readers in user space */
+static __always_inline u64 rdpmc_delta(kleb_cpu_t *kc, int slot, unsigned int index, u64 mask)
+{
+	u64 val = native_read_pmc(index);
+	u64 delta = (val - kc->pmc_base[slot]) & mask;
+
+	kc->pmc_base[slot] = val;
+	return delta;
+}
+
+/* The target's counters only run, and rdpmc only works, while it is switched in */
+static __always_inline void pmu_stop_rdpmc(void)
+{
+	pmu_wrmsr(MSR_GLOBAL_CTRL, 0x00, 0x00);
+	cr4_clear_bits_irqsoff(X86_CR4_PCE);
+	if (static_branch_unlikely(&lbr_enabled))
+		lbr_stop();
+}
+
+static __always_inline void pmu_restart_rdpmc(const int n)
+{
+	rdpmc_rebase(this_cpu_ptr(&kleb_cpu), n);
+	pmu_wrmsr(MSR_GLOBAL_CTRL, 0x0f, global_fixed_bits);
+	cr4_set_bits_irqsoff(X86_CR4_PCE);
+	if (static_branch_unlikely(&lbr_enabled))
+		lbr_start();
+}
+
+static __always_inline void pmu_fold_rdpmc(kleb_cpu_t *kc, const int n)
+{
+	int keep = !roi_mode || atomic_read(&region_depth);
+	u64 *task = (kc->ctx >= 0) ? task_ctx[kc->ctx].counter : NULL;
+	u64 *total = kc->buf->total[kc->group];
+	u64 val;
+
+	write_seqcount_begin(&kc->seq);
+	for (int i = 0; i < n + NUM_FIXED_COUNTERS; i++)
+	{
+		if (i < n)
+			val = rdpmc_delta(kc, i, i, pmc_mask);
+		else
+			val = rdpmc_delta(kc, i, RDPMC_FIXED | (i - n), fixed_mask);
+		if (keep)
+			total[i] += val;
+		if (keep && task)
+			task[i] += val;
+	}
+	write_seqcount_end(&kc->seq);
+}
+
+static __always_inline void pmu_snapshot_rdpmc(u64 *snap, const int n)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+	u64 *total = kc->buf->total[kc->group];
+
+	for (int i = 0; i < n; i++)
+		snap[i] = total[i] + ((native_read_pmc(i) - kc->pmc_base[i]) & pmc_mask);
+	for (int i = 0; i < NUM_FIXED_COUNTERS; i++)
+		snap[i+n] = total[i+n] + ((native_read_pmc(RDPMC_FIXED | i) - kc->pmc_base[i+n]) & fixed_mask);
+}
+
+/* Program this CPU for a rdpmc session, system-wide sessions are already counting */
+static void rdpmc_attach(kleb_cpu_t *kc)
+{
+	if (sysmode)
+	{
+		cr4_set_bits_irqsoff(X86_CR4_PCE);
+	}
+	else
+	{
+		for (int i = 0; i < num_events; i++)
+		{
+			wrmsrl(MSR_EVTSEL0 + i, evtsel_on[0][i]);
+		}
+		wrmsrl(MSR_FIXED_CTRL, fixed_ctrl);
+	}
+	rdpmc_rebase(kc, num_events);
+}
+
+static void rdpmc_detach(void)
+{
+	int g = this_cpu_read(kleb_cpu.event_group);
+
+	for (int i = 0; i < num_events; i++)
+	{
+		wrmsrl(MSR_EVTSEL0 + i, evtsel_off[g][i]);
+	}
+	wrmsrl(MSR_FIXED_CTRL, 0x0);
+	cr4_clear_bits_irqsoff(X86_CR4_PCE);
+}
+
+/* One specialization per number of configurable events */
+#define PMU_LOCAL_OPS(n)							\
+static void pmu_stop_msr_##n(void) { pmu_stop_local(n); }			\
+static void pmu_restart_msr_##n(void) { pmu_restart_local(n); }		\
+static void pmu_fold_msr_##n(kleb_cpu_t *kc) { pmu_fold_local(kc, n); }	\
+static void pmu_snapshot_msr_##n(u64 *snap) { pmu_snapshot_local(snap, n); }	\
+static void pmu_stop_rdpmc_##n(void) { pmu_stop_rdpmc(); }			\
+static void pmu_restart_rdpmc_##n(void) { pmu_restart_rdpmc(n); }		\
+static void pmu_fold_rdpmc_##n(kleb_cpu_t *kc) { pmu_fold_rdpmc(kc, n); }	\
+static void pmu_snapshot_rdpmc_##n(u64 *snap) { pmu_snapshot_rdpmc(snap, n); }
+
+PMU_LOCAL_OPS(0)
+PMU_LOCAL_OPS(1)
+PMU_LOCAL_OPS(2)
+PMU_LOCAL_OPS(3)
+PMU_LOCAL_OPS(4)
+
+/* perf keeps counting, folds only take the target's share */
+static void pmu_stop_perf(void)
+{
+}
+
+static void pmu_restart_perf(void)
+{
+	perf_rebase(this_cpu_ptr(&kleb_cpu));
+}
+
+static void pmu_fold_perf(kleb_cpu_t *kc)
+{
+	int keep = !roi_mode || atomic_read(&region_depth);
+	u64 *task = (kc->ctx >= 0) ? task_ctx[kc->ctx].counter : NULL;
+
+	write_seqcount_begin(&kc->seq);
+	perf_fold_counters(kc, kc->buf->total[kc->group], task, keep);
+	write_seqcount_end(&kc->seq);
+}
+
+static void pmu_snapshot_perf(u64 *snap)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+	u64 *total = kc->buf->total[kc->group];
+
+	perf_read_counters(kc, snap);
+	for (int i = 0; i < num_events + NUM_FIXED_COUNTERS; i++)
+		snap[i] = total[i] + snap[i] - kc->perf_base[i];
+}
+
+typedef struct {
+	void (*stop)(void);
+	void (*restart)(void);
+	void (*fold)(kleb_cpu_t *kc);
+	void (*snapshot)(u64 *snap);
+} kleb_pmu_ops_t;
+
+#define PMU_MSR_OPS(n) { pmu_stop_msr_##n, pmu_restart_msr_##n, pmu_fold_msr_##n, pmu_snapshot_msr_##n }
+static const kleb_pmu_ops_t pmu_msr_ops[MAX_EVENTS + 1] = {
+	PMU_MSR_OPS(0), PMU_MSR_OPS(1), PMU_MSR_OPS(2), PMU_MSR_OPS(3), PMU_MSR_OPS(4)
+};
+#define PMU_RDPMC_OPS(n) { pmu_stop_rdpmc_##n, pmu_restart_rdpmc_##n, pmu_fold_rdpmc_##n, pmu_snapshot_rdpmc_##n }
+static const kleb_pmu_ops_t pmu_rdpmc_ops[MAX_EVENTS + 1] = {
+	PMU_RDPMC_OPS(0), PMU_RDPMC_OPS(1), PMU_RDPMC_OPS(2), PMU_RDPMC_OPS(3), PMU_RDPMC_OPS(4)
+};
+static const kleb_pmu_ops_t pmu_perf_ops = { pmu_stop_perf, pmu_restart_perf, pmu_fold_perf, pmu_snapshot_perf };
+
+/* Local counter paths, patched to the session's backend and event count by pmu_select_ops */
+DEFINE_STATIC_CALL(pmu_stop, pmu_stop_msr_4);
+DEFINE_STATIC_CALL(pmu_restart, pmu_restart_msr_4);
+DEFINE_STATIC_CALL(pmu_fold, pmu_fold_msr_4);
+DEFINE_STATIC_CALL(pmu_snapshot, pmu_snapshot_msr_4);
+
+static void pmu_select_ops(void)
+{
+	const kleb_pmu_ops_t *ops = perf_backend ? &pmu_perf_ops : &pmu_msr_ops[num_events];
+
+	if (rdpmc)
+		ops = &pmu_rdpmc_ops[num_events];
+
+	static_call_update(pmu_stop, ops->stop);
+	static_call_update(pmu_restart, ops->restart);
+	static_call_update(pmu_fold, ops->fold);
+	static_call_update(pmu_snapshot, ops->snapshot);
+}
+
+/* Counts of a group on a CPU since its last published row, home timer only */
+static void pmu_cpu_delta(kleb_cpu_t *kc, int group, u64 *delta)
+{
+	u64 snap[MAX_COUNTERS], energy[NUM_ENERGY_COUNTERS];
+	int base = num_counters - NUM_ENERGY_COUNTERS;
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&kc->seq);
+		memcpy(snap, kc->buf->total[group], sizeof(snap));
+		memcpy(energy, kc->energy, sizeof(energy));
+	} while (read_seqcount_retry(&kc->seq, seq));
+
+	for (int i = 0; i < num_counters; i++)
+	{
+		delta[i] = snap[i] - kc->buf->last[group][i];
+		kc->buf->last[group][i] = snap[i];
+	}
+
+	/* Energy belongs to the package, the first group's row carries it */
+	for (int i = 0; rapl && i < NUM_ENERGY_COUNTERS; i++)
+	{
+		delta[base+i] = 0;
+		if (group == 0)
+		{
+			delta[base+i] = energy[i] - kc->energy_last[i];
+			kc->energy_last[i] = energy[i];
+		}
+	}
+}
+
+/* Move the oldest valid position past unread records up to pos */
+static void ring_overwrite(unsigned long pos, unsigned long tail)
+{
+	unsigned long oldest = max(tail, ring.drop);
+	unsigned long off;
+	kleb_record_t *rec;
+
+	while (oldest < pos)
+	{
+		off = oldest % ring.size;
+		rec = (kleb_record_t *)&ring.data[off];
+		if (ring.size - off < RECORD_HDR_WORDS || rec->type == REC_PAD)
+		{
+			oldest += ring.size - off;
+			continue;
+		}
+		if (rec->type == REC_SAMPLE)
+			ring.overwritten++;
+		oldest += rec->size;
+	}
+
+	/* The reader checks drop after copying, publish it before reusing the space */
+	WRITE_ONCE(ring.ctrl->overwritten, ring.overwritten);
+	smp_wmb();
+	WRITE_ONCE(ring.drop, oldest);
+	WRITE_ONCE(ring.ctrl->drop, oldest);
+	smp_wmb();
+}
+
+/* Reserve a record in the ring, returns NULL when full */
+static u64 *ring_reserve(unsigned int words)
+{
+	unsigned long head = ring.head;
+	unsigned long tail = smp_load_acquire(&ring.tail);
+	unsigned long off = head % ring.size;
+	unsigned long pad = 0;
+
+	/* Records never wrap, pad to the end of the ring */
+	if (off + words > ring.size)
+		pad = ring.size - off;
+
+	if (overflow_policy == OVERFLOW_OVERWRITE)
+	{
+		if (head + pad + words - max(tail, ring.drop) > ring.size)
+			ring_overwrite(head + pad + words - ring.size, tail);
+	}
+	else if (head + pad + words - tail > ring.size)
+	{
+		return NULL;
+	}
+
+	if (pad >= RECORD_HDR_WORDS)
+	{
+		kleb_record_t *rec = (kleb_record_t *)&ring.data[off];
+		rec->type = REC_PAD;
+		rec->size = pad;
+	}
+	ring.next = head + pad + words;
+	return &ring.data[(head + pad) % ring.size];
+}
+
+/* Publish the reserved record to the reader */
+static void ring_commit(void)
+{
+	smp_store_release(&ring.head, ring.next);
+	smp_store_release(&ring.ctrl->head, ring.next);
+}
+
+/* Words waiting for the reader */
+static unsigned long ring_used(void)
+{
+	unsigned long tail = max(smp_load_acquire(&ring.tail), READ_ONCE(ring.drop));
+
+	return (tail < ring.head) ? ring.head - tail : 0;
+}
+
+/* Loss record ahead of the first sample after a gap */
+static int ring_write_lost(ktime_t kt_now, unsigned long count)
+{
+	u64 *slot = ring_reserve(RECORD_WORDS(1));
+	kleb_record_t *rec = (kleb_record_t *)slot;
+
+	if (!slot)
+		return 0;
+
+	rec->type = REC_LOST;
+	rec->group = GROUP_ALL;
+	rec->size = RECORD_WORDS(1);
+	rec->cpu = -1;
+	rec->time_ns = ktime_to_ns(ktime_sub(kt_now, start_time));
+	rec->period_ns = 0;
+	rec->region = region_label;
+	slot[RECORD_HDR_WORDS] = count;
+	ring_commit();
+	return 1;
+}
+
+/* Write one sample row */
+static void ring_write_sample(ktime_t kt_now, unsigned int period, int cpu, int group, u64 *counters)
+{
+	unsigned int words = RECORD_WORDS(num_counters);
+	u64 *slot = NULL;
+	kleb_record_t *rec;
+
+	/* A sample after a gap needs its loss record first */
+	if (ring.pending && ring_write_lost(kt_now, ring.pending))
+		ring.pending = 0;
+	if (!ring.pending)
+		slot = ring_reserve(words);
+	if (!slot)
+	{
+		ring.lost++;
+		ring.pending++;
+		return;
+	}
+
+	rec = (kleb_record_t *)slot;
+
+	rec->type = REC_SAMPLE;
+	rec->group = group;
+	rec->size = words;
+	rec->cpu = cpu;
+	rec->time_ns = ktime_to_ns(ktime_sub(kt_now, start_time));
+	rec->period_ns = period;
+	rec->region = region_label;
+	memcpy(slot + RECORD_HDR_WORDS, counters, (num_counters) * sizeof(u64));
+	ring_commit();
+}
+
+/* Latest branch snapshot of a CPU, once */
+static void ring_write_lbr(kleb_cpu_t *kc, int cpu)
+{
+	u64 branches[MAX_LBR][2];
+	unsigned int words = RECORD_HDR_WORDS + 2 * lbr_nr;
+	unsigned long snap_seq;
+	ktime_t time;
+	int group;
+	unsigned int seq;
+	u64 *slot = NULL;
+	kleb_record_t *rec;
+
+	do {
+		seq = read_seqcount_begin(&kc->seq);
+		snap_seq = kc->lbr_seq;
+		time = kc->lbr_time;
+		group = kc->lbr_group;
+		memcpy(branches, kc->buf->lbr, lbr_nr * sizeof(branches[0]));
+	} while (read_seqcount_retry(&kc->seq, seq));
+
+	if (snap_seq == kc->lbr_published)
+		return;
+	kc->lbr_published = snap_seq;
+
+	/* Samples lost before keep their place ahead of the next sample */
+	if (!ring.pending)
+		slot = ring_reserve(words);
+	if (!slot)
+	{
+		ring.lbr_lost++;
+		return;
+	}
+	rec = (kleb_record_t *)slot;
+	rec->type = REC_LBR;
+	rec->group = group;
+	rec->size = words;
+	rec->cpu = cpu;
+	rec->time_ns = ktime_to_ns(ktime_sub(time, start_time));
+	rec->period_ns = 0;
+	rec->region = region_label;
+	memcpy(slot + RECORD_HDR_WORDS, branches, lbr_nr * sizeof(branches[0]));
+	ring_commit();
+}
+
+/* Memory samples staged by a CPU, one record per run of the same target */
+static void ring_write_pebs(kleb_cpu_t *kc, int cpu, ktime_t kt_now)
+{
+	unsigned long head = smp_load_acquire(&kc->pebs_head);
+	unsigned long tail = kc->pebs_tail;
+
+	while (tail != head)
+	{
+		int group = kc->buf->pebs_group[tail % MAX_PEBS];
+		unsigned int num = 1;
+		unsigned int words;
+		u64 *slot = NULL;
+		kleb_record_t *rec;
+
+		while (tail + num != head && kc->buf->pebs_group[(tail + num) % MAX_PEBS] == group)
+			num++;
+		words = RECORD_HDR_WORDS + 3 * num;
+		if (!ring.pending)
+			slot = ring_reserve(words);
+		if (slot)
+		{
+			rec = (kleb_record_t *)slot;
+			rec->type = REC_PEBS;
+			rec->group = group;
+			rec->size = words;
+			rec->cpu = cpu;
+			rec->time_ns = ktime_to_ns(ktime_sub(kt_now, start_time));
+			rec->period_ns = 0;
+			rec->region = region_label;
+			for (unsigned int i = 0; i < num; i++)
+			{
+				memcpy(slot + RECORD_HDR_WORDS + 3 * i, kc->buf->pebs[(tail + i) % MAX_PEBS], sizeof(kc->buf->pebs[0]));
+			}
+			ring_commit();
+		}
+		else
+		{
+			ring.pebs_lost += num;
+		}
+		tail += num;
+	}
+	smp_store_release(&kc->pebs_tail, tail);
+}
+
+/* Adjust timer period from the instruction rate of change and buffer occupancy */
+static void pmu_adapt_period(u64 inst, unsigned int period)
+{
+	u64 next = ktime_to_ns(ktime_period_ns);
+	u64 rate_now = inst * last_period;
+	u64 rate_last = last_inst * period;
+	u64 rate_diff = rate_now > rate_last ? rate_now - rate_last : rate_last - rate_now;
+	unsigned long used = ring_used();
+
+	if (used * 4 >= ring.size * 3)
+	{
+		/* Reader is falling behind, back off before samples are lost */
+		next *= 2;
+	}
+	else if (inst * NSEC_PER_MSEC < (u64)ADAPT_IDLE_INST_PER_MS * period)
+	{
+		/* Target is idle */
+		next *= 2;
+	}
+	else if (last_period && rate_diff * 2 > rate_last && used * 2 < ring.size)
+	{
+		/* Phase change, rate moved by more than 50% */
+		next /= 2;
+	}
+	else
+	{
+		/* Steady phase */
+		next += next / 4;
+	}
+
+	if (next < min_delay_in_ns)
+		next = min_delay_in_ns;
+	if (next > max_delay_in_ns)
+		next = max_delay_in_ns;
+
+	last_inst = inst;
+	last_period = period;
+	ktime_period_ns = ns_to_ktime(next);
+}
+
+int kprobes_handle_finish_task_switch_pre(struct kprobe *p, struct pt_regs *regs)
+{
+	kleb_cpu_t *kc;
+	target_id *t;
+	int is_target = 0;
+	int ctx = -1;
+	int group = 0;
+	int counted = 1;
+	cycles_t start;
+
+	/* switch_mm sets CR4.PCE for the next mm, system-wide rdpmc stays open to every task */
+	if (static_branch_unlikely(&rdpmc_enabled) && recording && sysmode)
+	{
+		if (cpumask_test_cpu(smp_processor_id(), &kleb_cpus))
+			cr4_set_bits_irqsoff(X86_CR4_PCE);
+		return 0;
+	}
+	if(recording && !sysmode)
+	{
+		//printk(KERN_INFO "Monitor start on CPU: %d", current->thread_info.cpu);
+
+		/* Children and threads were added when they were created */
+		t = target_find(current->pid);
+		if (t && current->pid != 0)
+		{
+			ctx = READ_ONCE(t->ctx);
+			group = READ_ONCE(t->group);
+			is_target = 1;
+		}
+
+		/* Counting follows the target on this CPU, counts stay in the local totals */
+		kc = this_cpu_ptr(&kleb_cpu);
+		start = get_cycles();
+		if (is_target && !kc->target_running)
+		{
+			//Call start, cleared counters are the task's baseline
+			static_call(pmu_restart)();
+			kc->target_running = 1;
+			kc->ctx = ctx;
+			kc->group = group;
+		}
+		else if (is_target && (kc->ctx != ctx || kc->group != group))
+		{
+			/* Another target thread, close the previous thread's context */
+			static_call(pmu_fold)(kc);
+			kc->ctx = ctx;
+			kc->group = group;
+		}
+		else if (!is_target && kc->target_running)
+		{
+			//Call stop
+			static_call(pmu_fold)(kc);
+			static_call(pmu_stop)();
+			kc->target_running = 0;
+			kc->ctx = -1;
+		}
+		else
+		{
+			counted = 0;
+		}
+		/* Cost of the counter work, the part specialized per session */
+		if (counted)
+		{
+			kc->timer_stats.switches++;
+			kc->timer_stats.switch_cycles += get_cycles() - start;
+		}
+		if (is_target && ctx >= 0)
+		{
+			task_ctx[ctx].switches++;
+		}
+	}
+
+	return 0;
+}
+/* void kprobes_handle_finish_task_switch_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
+{
+	if(recording)
+	{
+			if (current->pid == target_pid)
+			{
+				printk(KERN_INFO "finish_task_switch_post: %s [%d] [%d] [%d]\n", current->comm, current->pid, current->thread_info.cpu, current->state);
+			}
+		
+	}
+}*/
+static int kprobes_handle_do_exit_pre(struct kprobe *p, struct pt_regs *regs)
+{
+	kleb_cpu_t *kc;
+	target_id *t;
+	unsigned long flags;
+
+	if(recording && !sysmode)
+	{
+		t = target_find(current->pid);
+		if(t && current->pid != 0){
+				
+			/* Extract last data */
+			local_irq_save(flags);
+			kc = this_cpu_ptr(&kleb_cpu);
+			if (kc->target_running)
+			{
+				static_call(pmu_fold)(kc);
+				//Call stop
+				static_call(pmu_stop)();
+				kc->target_running = 0;
+				kc->ctx = -1;
+			}
+			local_irq_restore(flags);
+
+			target_remove(t);
+			//printk(KERN_INFO "Task (do_exit): %d %d %d %d %d\n", current->pid, current->parent->pid,current->tgid, current->thread_info.cpu, atomic_read(&num_targets));
+		}
+	}
+	return 0;
+}
+/*void kprobes_handle_do_exit_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags)
+{
+	if(recording)
+	{
+		if(target_find(current->pid)){
+			printk(KERN_INFO "Task (do_exit_post): %d %d ID %d %d %d\n", current->exit_code, current->exit_state, current->pid, current->parent->pid,current->tgid);
+		}
+		
+	}
+}*/
+/* Processes and threads created by a tracked task are tracked before they first run */
+static int kprobes_handle_wake_up_new_task_pre(struct kprobe *p, struct pt_regs *regs)
+{
+	struct task_struct *task = (struct task_struct *)regs_get_kernel_argument(regs, 0);
+	target_id *parent;
+
+	if(tracking && (parent = target_find(current->pid)))
+	{
+		target_add(task, READ_ONCE(parent->group));
+		//printk(KERN_INFO "wake_up_new_task: %s [%d] [%d] [%d]\n", task->comm, task->pid, current->pid, task->tgid);
+	}
+	return 0;
+}
+static struct kprobe finish_task_switch_kp = {
+	.pre_handler = kprobes_handle_finish_task_switch_pre,
+	//.post_handler = kprobes_handle_finish_task_switch_post,
+	.symbol_name = DO_EXIT_NAME,
+};
+ static struct kprobe do_exit_kp = {
+	.pre_handler = kprobes_handle_do_exit_pre,
+	//.post_handler = kprobes_handle_do_exit_post,
+	.symbol_name = "do_exit",
+};
+static struct kprobe wake_up_new_task_kp = {
+	.pre_handler = kprobes_handle_wake_up_new_task_pre,
+	.symbol_name = "wake_up_new_task",
+};
+
+void unregister_all(void)
+{
+	unregister_kprobe(&finish_task_switch_kp);
+	unregister_kprobe(&do_exit_kp);
+	unregister_kprobe(&wake_up_new_task_kp);
+}
+
+int register_all(void)
+{
+	/* Register probes */
+	
+	int ret = register_kprobe(&finish_task_switch_kp);
+	if (ret < 0)
+	{
+		printk(KERN_INFO "Couldn't register 'finish_task_switch' kprobe %d\n", ret);
+		unregister_all();
+		return (-EFAULT);
+	}
+	ret = register_kprobe(&do_exit_kp);
+	if (ret < 0)
+	{
+		printk(KERN_INFO "Couldn't register 'do_exit' kprobe %d\n", ret);
+		unregister_all();
+		return (-EFAULT);
+	}
+	ret = register_kprobe(&wake_up_new_task_kp);
+	if (ret < 0)
+	{
+		printk(KERN_INFO "Couldn't register 'wake_up_new_task' kprobe %d\n", ret);
+		unregister_all();
+		return (-EFAULT);
+	}
+
+	return (0);
+}
+
+/* Function attribution through uprobes */
+typedef struct uprobe_frame {
+	unsigned int id;
+	int cpu;
+	unsigned long switches;
+	u64 snap[MAX_COUNTERS];
+}uprobe_frame;
+
+typedef struct uprobe_thread {
+	int pid;
+	int depth;
+	uprobe_frame stack[UPROBE_STACK_DEPTH];
+}uprobe_thread;
+
+typedef struct kleb_uprobe {
+	struct uprobe_consumer uc;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+	struct uprobe *uprobe;
+#endif
+	struct inode *inode;
+	loff_t offset;
+	unsigned int id;
+}kleb_uprobe;
+
+static kleb_uprobe uprobes[MAX_UPROBES];
+static int num_uprobes;
+static uprobe_thread *uprobe_threads;
+static kleb_func_stats_t *func_stats;
+static int num_uprobe_threads;
+static DEFINE_SPINLOCK(uprobe_lock);
+
+/* Only attribute calls made by tracked tasks */
+static int is_target_task(struct task_struct *task)
+{
+	if (sysmode)
+		return 1;
+
+	return target_find(task->pid) != NULL;
+}
+
+/* Find or add the thread slot, called with uprobe_lock held */
+static int uprobe_thread_slot(int pid)
+{
+	for (int i = 0; i < num_uprobe_threads; ++i)
+	{
+		if (uprobe_threads[i].pid == pid)
+			return i;
+	}
+	if (num_uprobe_threads >= MAX_UPROBE_THREADS)
+		return -1;
+
+	uprobe_threads[num_uprobe_threads].pid = pid;
+	uprobe_threads[num_uprobe_threads].depth = 0;
+	for (int j = 0; j < MAX_UPROBES; ++j)
+	{
+		func_stats[num_uprobe_threads * MAX_UPROBES + j].pid = pid;
+	}
+	return num_uprobe_threads++;
+}
+
+static int uprobe_entry(struct uprobe_consumer *self, struct pt_regs *regs)
+{
+	kleb_uprobe *probe = container_of(self, kleb_uprobe, uc);
+	uprobe_frame *frame;
+	unsigned long flags;
+	int slot;
+
+	if (!recording || !is_target_task(current))
+		return 0;
+
+	spin_lock_irqsave(&uprobe_lock, flags);
+	slot = uprobe_thread_slot(current->pid);
+	if (slot >= 0 && uprobe_threads[slot].depth < UPROBE_STACK_DEPTH)
+	{
+		frame = &uprobe_threads[slot].stack[uprobe_threads[slot].depth++];
+		frame->id = probe - uprobes;
+		frame->cpu = smp_processor_id();
+		frame->switches = current->nvcsw + current->nivcsw;
+		static_call(pmu_snapshot)(frame->snap);
+	}
+	spin_unlock_irqrestore(&uprobe_lock, flags);
+
+	return 0;
+}
+
+static int uprobe_return(struct uprobe_consumer *self, unsigned long func, struct pt_regs *regs)
+{
+	kleb_uprobe *probe = container_of(self, kleb_uprobe, uc);
+	kleb_func_stats_t *stats;
+	uprobe_frame *frame;
+	unsigned long flags;
+	u64 snap[MAX_COUNTERS];
+	int slot;
+
+	if (!recording || !is_target_task(current))
+		return 0;
+
+	spin_lock_irqsave(&uprobe_lock, flags);
+	static_call(pmu_snapshot)(snap);
+	slot = uprobe_thread_slot(current->pid);
+	if (slot >= 0 && uprobe_threads[slot].depth > 0)
+	{
+		frame = &uprobe_threads[slot].stack[--uprobe_threads[slot].depth];
+		if (frame->id == probe - uprobes)
+		{
+			stats = &func_stats[slot * MAX_UPROBES + frame->id];
+			stats->id = probe->id;
+			++stats->calls;
+
+			/* Counters of another CPU do not compare */
+			if (frame->cpu != smp_processor_id())
+			{
+				++stats->inexact;
+			}
+			else
+			{
+				if (frame->switches != current->nvcsw + current->nivcsw)
+					++stats->inexact;
+				for (int i = 0; i < num_counters; ++i)
+					stats->counter[i] += snap[i] - frame->snap[i];
+			}
+		}
+	}
+	spin_unlock_irqrestore(&uprobe_lock, flags);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+static int uprobe_entry_data(struct uprobe_consumer *self, struct pt_regs *regs, __u64 *data)
+{
+	return uprobe_entry(self, regs);
+}
+
+static int uprobe_return_data(struct uprobe_consumer *self, unsigned long func, struct pt_regs *regs, __u64 *data)
+{
+	return uprobe_return(self, func, regs);
+}
+#endif
+
+/* Register entry and return probes from ioctl uprobe */
+static int register_uprobe_func(kleb_uprobe_args_t *args)
+{
+	kleb_uprobe *probe;
+	struct path path;
+	int ret;
+
+	if (num_uprobes >= MAX_UPROBES)
+		return (-ENOSPC);
+
+	if (!uprobe_threads)
+	{
+		uprobe_threads = vzalloc(sizeof(uprobe_thread) * MAX_UPROBE_THREADS);
+		func_stats = vzalloc(sizeof(kleb_func_stats_t) * MAX_UPROBE_THREADS * MAX_UPROBES);
+		if (!uprobe_threads || !func_stats)
+		{
+			vfree(uprobe_threads);
+			vfree(func_stats);
+			uprobe_threads = NULL;
+			func_stats = NULL;
+			return (-ENOMEM);
+		}
+		num_uprobe_threads = 0;
+	}
+
+	args->path[sizeof(args->path) - 1] = '\0';
+	ret = kern_path(args->path, LOOKUP_FOLLOW, &path);
+	if (ret)
+	{
+		printk(KERN_INFO "Couldn't find uprobe binary %s\n", args->path);
+		return ret;
+	}
+
+	probe = &uprobes[num_uprobes];
+	memset(probe, 0, sizeof(*probe));
+	probe->inode = igrab(d_inode(path.dentry));
+	path_put(&path);
+	probe->offset = args->offset;
+	probe->id = args->id;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	probe->uc.handler = uprobe_entry_data;
+	probe->uc.ret_handler = uprobe_return_data;
+#else
+	probe->uc.handler = uprobe_entry;
+	probe->uc.ret_handler = uprobe_return;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+	probe->uprobe = uprobe_register(probe->inode, probe->offset, 0, &probe->uc);
+	ret = IS_ERR(probe->uprobe) ? PTR_ERR(probe->uprobe) : 0;
+#else
+	ret = uprobe_register(probe->inode, probe->offset, &probe->uc);
+#endif
+	if (ret)
+	{
+		printk(KERN_INFO "Couldn't register uprobe %s+0x%llx %d\n", args->path, args->offset, ret);
+		iput(probe->inode);
+		return ret;
+	}
+
+	printk(KERN_INFO "Uprobe %u on %s+0x%llx\n", probe->id, args->path, args->offset);
+	++num_uprobes;
+	return 0;
+}
+
+static void unregister_uprobe_funcs(void)
+{
+	for (int i = 0; i < num_uprobes; ++i)
+	{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+		uprobe_unregister_nosync(uprobes[i].uprobe, &uprobes[i].uc);
+#else
+		uprobe_unregister(uprobes[i].inode, uprobes[i].offset, &uprobes[i].uc);
+#endif
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+	if (num_uprobes)
+		uprobe_unregister_sync();
+#endif
+	for (int i = 0; i < num_uprobes; ++i)
+	{
+		iput(uprobes[i].inode);
+	}
+	num_uprobes = 0;
+}
+
+/* Send per-thread function totals to user */
+static int copy_uprobe_stats(kleb_uprobe_stats_args_t __user *user_args)
+{
+	kleb_uprobe_stats_args_t args;
+	unsigned int n = 0;
+
+	if (copy_from_user(&args, user_args, sizeof(args)) != 0)
+		return (-EFAULT);
+	if (!func_stats)
+		return 0;
+
+	for (int i = 0; i < num_uprobe_threads && n < args.num_entries; ++i)
+	{
+		for (int j = 0; j < MAX_UPROBES && n < args.num_entries; ++j)
+		{
+			if (func_stats[i * MAX_UPROBES + j].calls == 0)
+				continue;
+			if (copy_to_user(&args.entries[n], &func_stats[i * MAX_UPROBES + j], sizeof(kleb_func_stats_t)) != 0)
+				return (-EFAULT);
+			++n;
+		}
+	}
+
+	return n;
+}
+
+/* Send per-thread totals to user */
+static int copy_task_stats(kleb_task_stats_args_t __user *user_args)
+{
+	kleb_task_stats_args_t args;
+	unsigned int n;
+
+	if (copy_from_user(&args, user_args, sizeof(args)) != 0)
+		return (-EFAULT);
+	if (!task_ctx)
+		return 0;
+
+	n = min3((unsigned int)atomic_read(&num_task_ctx), (unsigned int)MAX_TASKS, args.num_entries);
+	if (copy_to_user(args.entries, task_ctx, n * sizeof(kleb_task_stats_t)) != 0)
+		return (-EFAULT);
+
+	return n;
+}
+
+static void cleanup_uprobe_stats(void)
+{
+	vfree(uprobe_threads);
+	vfree(func_stats);
+	uprobe_threads = NULL;
+	func_stats = NULL;
+	num_uprobe_threads = 0;
+}
+
+/* Publish the rows of one tick, home CPU only */
+static void kleb_publish(ktime_t kt_now)
+{
+	static u64 event_sum[MAX_EVENT_GROUPS][MAX_COUNTERS];	// Home timer only
+	u64 delta[MAX_COUNTERS], sum[MAX_COUNTERS], energy[NUM_ENERGY_COUNTERS];
+	unsigned int period = ktime_to_ns(ktime_sub(kt_now, last_tick));
+	unsigned int words = RECORD_WORDS(num_counters);
+	u64 inst = 0;
+	int cpu;
+
+	/* Pause until the reader drains, counts carry into the next row */
+	if (overflow_policy == OVERFLOW_PAUSE && recording && ring_used() + tick_words + words > ring.size)
+	{
+		ring.paused++;
+		wake_up_interruptible(&ring_wait);
+		return;
+	}
+	last_tick = kt_now;
+
+	/* Nothing was kept outside of any marked region */
+	if (roi_mode && atomic_read(&region_depth) == 0 && !region_pending)
+	{
+		return;
+	}
+	region_pending = 0;
+
+	/* One row per group, the timers are shared by all targets */
+	for (int g = 0; g < num_groups; g++)
+	{
+		memset(sum, 0, sizeof(sum));
+		if (num_event_groups)
+			memset(event_sum, 0, sizeof(event_sum));
+		for_each_cpu(cpu, &kleb_cpus)
+		{
+			kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
+
+			pmu_cpu_delta(kc, g, delta);
+			/* With event groups, rows are tagged with the event group instead of the target */
+			if (per_cpu_mode)
+			{
+				ring_write_sample(kt_now, period, cpu, num_event_groups ? kc->event_group : g, delta);
+			}
+			for (int i = 0; i < num_counters; i++)
+			{
+				sum[i] += delta[i];
+			}
+			for (int i = 0; num_event_groups && i < num_counters; i++)
+			{
+				event_sum[kc->event_group][i] += delta[i];
+			}
+		}
+		/* Every group row shows the energy of the tick */
+		if (rapl && g == 0)
+		{
+			memcpy(energy, &sum[num_counters - NUM_ENERGY_COUNTERS], sizeof(energy));
+		}
+		else if (rapl)
+		{
+			memcpy(&sum[num_counters - NUM_ENERGY_COUNTERS], energy, sizeof(energy));
+		}
+		if (!per_cpu_mode && num_event_groups)
+		{
+			/* One row per event group over its CPUs, each with the energy of the tick */
+			for (int e = 0; e < num_event_groups; e++)
+			{
+				if (rapl)
+					memcpy(&event_sum[e][num_counters - NUM_ENERGY_COUNTERS], energy, sizeof(energy));
+				ring_write_sample(kt_now, period, -1, e, event_sum[e]);
+			}
+		}
+		else if (!per_cpu_mode)
+		{
+			ring_write_sample(kt_now, period, -1, g, sum);
+		}
+		inst += sum[num_events];
+	}
+	if (static_branch_unlikely(&lbr_enabled))
+	{
+		for_each_cpu(cpu, &kleb_cpus)
+		{
+			ring_write_lbr(per_cpu_ptr(&kleb_cpu, cpu), cpu);
+		}
+	}
+	if (static_branch_unlikely(&pebs_enabled))
+	{
+		for_each_cpu(cpu, &kleb_cpus)
+		{
+			ring_write_pebs(per_cpu_ptr(&kleb_cpu, cpu), cpu, kt_now);
+		}
+	}
+	if (ring_used() >= ring.size / 2)
+	{
+		wake_up_interruptible(&ring_wait);
+	}
+	//printk(KERN_INFO "Extract value on CPU: %d, val: %llu", smp_processor_id(), sum[num_events]);
+
+	if (adaptive)
+	{
+		pmu_adapt_period(inst, period);
+	}
+}
+
+/* Latency and cost of one tick */
+static void timer_account(kleb_cpu_t *kc, ktime_t expires, ktime_t kt_now, u64 overruns)
+{
+	kleb_timer_stats_t *ts = &kc->timer_stats;
+	u64 lat = ktime_to_ns(ktime_sub(kt_now, expires));
+	u64 cost = ktime_to_ns(ktime_sub(ktime_get(), kt_now));
+
+	ts->ticks++;
+	if (overruns > 1)
+		ts->missed += overruns - 1;
+	if (lat < ts->lat_min_ns)
+		ts->lat_min_ns = lat;
+	if (lat > ts->lat_max_ns)
+		ts->lat_max_ns = lat;
+	ts->lat_sum_ns += lat;
+	if (cost > ts->cost_max_ns)
+		ts->cost_max_ns = cost;
+	ts->cost_sum_ns += cost;
+}
+
+/* Restart timer, one pinned timer per monitored CPU */
+enum hrtimer_restart hrtimer_callback(struct hrtimer *timer)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+	ktime_t kt_now, expires;
+	u64 overruns;
+
+	/* No restart timer */
+	if (!timer_restart)
+	{
+		printk("Timer Expired\n");
+		return HRTIMER_NORESTART;
+	}
+
+	/* Read counter */
+	if (sysmode || kc->target_running)
+	{
+		static_call(pmu_fold)(kc);
+	}
+	if (rapl && kc->rapl_leader)
+	{
+		rapl_fold(kc);
+	}
+
+	kt_now = hrtimer_cb_get_time(timer);
+	if (static_branch_unlikely(&lbr_enabled) && (sysmode || kc->target_running))
+	{
+		lbr_snapshot(kc, kt_now);
+	}
+	expires = hrtimer_get_expires(timer);
+	if (smp_processor_id() == home_cpu)
+	{
+		kleb_publish(kt_now);
+	}
+
+	/* Forward timer */
+	overruns = hrtimer_forward(timer, kt_now, ktime_period_ns);
+	timer_account(kc, expires, kt_now, overruns);
+
+	return HRTIMER_RESTART;
+}
+
+/* High-frequency timer, hard irq on an absolute grid with no adaptive step */
+enum hrtimer_restart hrtimer_callback_hifreq(struct hrtimer *timer)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+	ktime_t kt_now = hrtimer_cb_get_time(timer);
+	ktime_t expires = hrtimer_get_expires(timer);
+
+	if (!timer_restart)
+	{
+		return HRTIMER_NORESTART;
+	}
+	if (sysmode || kc->target_running)
+	{
+		static_call(pmu_fold)(kc);
+	}
+	if (rapl && kc->rapl_leader)
+	{
+		rapl_fold(kc);
+	}
+	if (static_branch_unlikely(&lbr_enabled) && (sysmode || kc->target_running))
+	{
+		lbr_snapshot(kc, kt_now);
+	}
+	if (smp_processor_id() == home_cpu)
+	{
+		kleb_publish(kt_now);
+	}
+	timer_account(kc, expires, kt_now, hrtimer_forward(timer, kt_now, ktime_period_ns));
+
+	return HRTIMER_RESTART;
+}
+
+static void start_cpu_timer(void *info)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+
+	memset(&kc->timer_stats, 0, sizeof(kc->timer_stats));
+	kc->timer_stats.lat_min_ns = U64_MAX;
+	if (perf_backend)
+	{
+		perf_rebase(kc);
+	}
+	if (rapl && kc->rapl_leader)
+	{
+		rapl_start(kc);
+	}
+	if (static_branch_unlikely(&lbr_enabled) && sysmode)
+	{
+		lbr_start();
+	}
+	if (static_branch_unlikely(&pebs_enabled) && sysmode)
+	{
+		pebs_start(kc);
+	}
+	if (static_branch_unlikely(&rdpmc_enabled))
+	{
+		rdpmc_attach(kc);
+	}
+
+	/* Every CPU ticks on the same grid from start_time */
+	if (hifreq)
+	{
+		hrtimer_init(&kc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED_HARD);
+		kc->timer.function = &hrtimer_callback_hifreq;
+		hrtimer_start(&kc->timer, ktime_add(start_time, ktime_period_ns), HRTIMER_MODE_ABS_PINNED_HARD);
+	}
+	else
+	{
+		hrtimer_init(&kc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		kc->timer.function = &hrtimer_callback;
+		hrtimer_start(&kc->timer, ktime_period_ns, HRTIMER_MODE_REL_PINNED);
+	}
+}
+
+/* Send timer accuracy to user */
+static int copy_timer_stats(kleb_timer_stats_t __user *user_stats)
+{
+	kleb_timer_stats_t stats;
+	int cpu;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.lat_min_ns = U64_MAX;
+	for_each_cpu(cpu, &kleb_cpus)
+	{
+		kleb_timer_stats_t *ts = &per_cpu(kleb_cpu, cpu).timer_stats;
+
+		stats.ticks += ts->ticks;
+		stats.missed += ts->missed;
+		stats.lat_min_ns = min(stats.lat_min_ns, ts->lat_min_ns);
+		stats.lat_max_ns = max(stats.lat_max_ns, ts->lat_max_ns);
+		stats.lat_sum_ns += ts->lat_sum_ns;
+		stats.cost_max_ns = max(stats.cost_max_ns, ts->cost_max_ns);
+		stats.cost_sum_ns += ts->cost_sum_ns;
+		stats.switches += ts->switches;
+		stats.switch_cycles += ts->switch_cycles;
+	}
+	if (stats.ticks == 0)
+		stats.lat_min_ns = 0;
+
+	if (copy_to_user(user_stats, &stats, sizeof(stats)) != 0)
+		return (-EFAULT);
+	return 0;
+}
+
+static void stop_cpu_counters(void *info)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+
+	/* Disable counters on global counter control, then keep their last counts */
+	if (!perf_backend)
+	{
+		wrmsrl(addr_global, 0x00);
+	}
+	if (sysmode || kc->target_running)
+	{
+		static_call(pmu_fold)(kc);
+	}
+	if (rapl && kc->rapl_leader)
+	{
+		rapl_fold(kc);
+	}
+	if (static_branch_unlikely(&lbr_enabled))
+	{
+		lbr_stop();
+	}
+	if (static_branch_unlikely(&pebs_enabled))
+	{
+		pebs_detach(kc);
+	}
+	if (static_branch_unlikely(&rdpmc_enabled))
+	{
+		rdpmc_detach();
+	}
+	kc->target_running = 0;
+	kc->ctx = -1;
+}
+
+
+/* Initialize module from ioctl start */
+int start_counters()
+{
+	int i;
+
+	if (!recording)
+	{
+		printk(KERN_INFO "target pid: %d, sample groups: %d\n", kleb_ioctl_args.pid, num_groups);
 
 		if(kleb_ioctl_args.pid == 1 || kleb_ioctl_args.pid == 0){
 				sysmode = 1;
@@ -635,56 +2288,298 @@ int start_counters()
 				sysmode = 0;
 		}
 
-		/* Set empty buffer */
-		for (i = 0; i < (num_events + 3); ++i)
-		{ 
-			for (j = 0; j < num_recordings; ++j)
-			{
-				hardware_events[i][j] = -10;
-			}
-		}
-
 		/* Initialize counters */
 		pmu_start_counters();
+		pmu_select_ops();
+		atomic_set(&num_task_ctx, 0);
+		atomic_set(&num_targets, 0);
+		memset(target, 0, TARGET_SLOTS * sizeof(target_id));
+		if(!sysmode){
+			/* Forks during the walk are caught by the fork hook */
+			tracking = 1;
+			smp_mb();
+			target_add_existing();
+		}
+
+		if(sysmode && !perf_backend){
+			for_each_cpu(i, &kleb_cpus){
+				pmu_restart_remote(i);
+			}	
+		}
+
+		/* Adaptive period stays within user bounds, the high-frequency path keeps a fixed grid */
+		adaptive = (!hifreq && min_delay_in_ns != 0 && max_delay_in_ns >= min_delay_in_ns);
+		if (adaptive)
+		{
+			if (delay_in_ns < min_delay_in_ns)
+				delay_in_ns = min_delay_in_ns;
+			if (delay_in_ns > max_delay_in_ns)
+				delay_in_ns = max_delay_in_ns;
+		}
+		last_inst = 0;
+		last_period = 0;
+
+		atomic_set(&region_depth, 0);
+		region_label = 0;
+		region_pending = 0;
+
+		ktime_period_ns = ktime_set(0, delay_in_ns);
+		start_time = ktime_get();
+		last_tick = start_time;
+		timer_restart = 1;
+		recording = 1;
+
+		rapl_set_leaders();
+		if (lbr_nr)
+		{
+			static_branch_enable(&lbr_enabled);
+		}
+		if (pebs)
+		{
+			/* Every debug store is in place before a context switch may start PEBS */
+			on_each_cpu_mask(&kleb_cpus, pebs_attach, NULL, 1);
+			static_branch_enable(&pebs_enabled);
+		}
+		if (rdpmc)
+		{
+			static_branch_enable(&rdpmc_enabled);
+		}
+		/* Counters are read on their own CPU, no cross-CPU MSR access per tick */
+		on_each_cpu_mask(&kleb_cpus, start_cpu_timer, NULL, 1);
+		//printk(KERN_INFO "Timer start on PID: %d CPU: %d GCPU: %d", current->pid, current->thread_info.cpu, get_cpu());
+	}
+	else
+	{
+		printk(KERN_INFO "Invalid action: Counters already collecting\n");
+	}
+
+	return 0;
+}
+
+/* Fold the counters of one monitored CPU at a region boundary, runs with interrupts off */
+static void region_fold(void *info)
+{
+	kleb_cpu_t *kc = this_cpu_ptr(&kleb_cpu);
+
+	if (sysmode || kc->target_running)
+	{
+		static_call(pmu_fold)(kc);
+	}
+}
+
+/* Only a target may mark regions of a task-mode session */
+static int region_check(void)
+{
+	if (!recording)
+		return (-EINVAL);
+	if (!sysmode && !target_find(current->pid))
+		return (-EPERM);
+	return 0;
+}
+
+/* Target marks the start of a region of interest */
+static int region_begin(unsigned int label)
+{
+	int ret = region_check();
+
+	if (ret < 0)
+	{
+		return ret;
+	}
+
+	/* Flush and drop what every CPU counted outside of any region */
+	on_each_cpu_mask(&kleb_cpus, region_fold, NULL, 1);
+	atomic_inc(&region_depth);
+	region_label = label;
+
+	return 0;
+}
+
+/* Target marks the end of a region of interest */
+static int region_end(unsigned int label)
+{
+	int ret = region_check();
+
+	if (ret < 0 || atomic_read(&region_depth) == 0)
+	{
+		return ret < 0 ? ret : (-EINVAL);
+	}
+
+	/* Keep what every CPU counted in the region, the next tick publishes it */
+	on_each_cpu_mask(&kleb_cpus, region_fold, NULL, 1);
+	if (atomic_dec_return(&region_depth) == 0)
+	{
+		region_pending = 1;
+	}
+
+	return 0;
+}
+
+/* Fixed counter 3 and PERF_METRICS, Ice Lake and later */
+static int topdown_supported(void)
+{
+	u64 cap;
+
+	if ((cpuid_edx(0xa) & 0x1f) < 4 || !boot_cpu_has(X86_FEATURE_PDCM))
+		return 0;
+	if (rdmsrl_safe(MSR_PERF_CAP, &cap))
+		return 0;
+	return (cap & PERF_CAP_TOPDOWN_METRICS) != 0;
+}
+
+/* Energy MSRs implemented by this CPU and their unit for user */
+static int rapl_probe(unsigned int *mask)
+{
+	u64 val;
+
+	*mask = 0;
+	if (rdmsrl_safe(MSR_RAPL_UNIT, &val))
+		return (-EOPNOTSUPP);
+	kleb_ioctl_args.rapl_unit = val;
+	for (int i = 0; i < NUM_ENERGY_COUNTERS; i++)
+	{
+		if (!rdmsrl_safe(rapl_msr[i], &val))
+			*mask |= 1 << i;
+	}
+	/* The package domain is always there when RAPL is */
+	return (*mask & 1) ? 0 : (-EOPNOTSUPP);
+}
+
+/* One group per target process, a single pid or the whole system is one group */
+static int set_targets(void)
+{
+	if (kleb_ioctl_args.num_targets == 0)
+	{
+		kleb_ioctl_args.targets[0] = kleb_ioctl_args.pid;
+		num_groups = 1;
+		return 0;
+	}
+	if (kleb_ioctl_args.num_targets > MAX_TARGETS)
+	{
+		return (-EINVAL);
+	}
+	for (int i = 0; i < kleb_ioctl_args.num_targets; ++i)
+	{
+		/* Only the pid field selects system-wide mode */
+		if (kleb_ioctl_args.targets[i] <= 1)
+			return (-EINVAL);
+	}
+	kleb_ioctl_args.pid = kleb_ioctl_args.targets[0];
+	num_groups = kleb_ioctl_args.num_targets;
+	return 0;
+}
 
-		if(sysmode){
-			for(int i = 0; i < NUM_CORES; ++i){
-				pmu_restart_counters(i);
-			}	
+/* A CPU map reaches MAX_CPUS only, the all-CPU default may go past it */
+static bool cpu_map_covers_selection(void)
+{
+	for (int cpu = 0; cpu < MAX_CPUS && cpu < nr_cpu_ids; ++cpu)
+	{
+		if (((kleb_ioctl_args.cpu_mask[cpu / 64] >> (cpu % 64)) & 1) && cpu_online(cpu))
+			return true;
+	}
+	return cpumask_last(cpu_online_mask) < MAX_CPUS;
+}
 
-			ktime_period_ns = ktime_set(0, delay_in_ns);
-			hrtimer_start(&hr_timer, ktime_period_ns, HRTIMER_MODE_REL);
-			//printk(KERN_INFO "Timer start on PID: %d CPU: %d GCPU: %d", current->pid, current->thread_info.cpu, get_cpu());
-			timer_restart = 1;
-		}
+/* Select CPUs for system-wide mode, empty mask is all online CPUs */
+static void set_cpu_selection(void)
+{
+	int cpu;
 
-		recording = 1;
-		counter = 0;
+	cpumask_clear(&kleb_cpus);
+	for (cpu = 0; cpu < MAX_CPUS && cpu < nr_cpu_ids; ++cpu)
+	{
+		if (((kleb_ioctl_args.cpu_mask[cpu / 64] >> (cpu % 64)) & 1) && cpu_online(cpu))
+			cpumask_set_cpu(cpu, &kleb_cpus);
 	}
-	else
+	/* A pid may run on any CPU */
+	if (cpumask_empty(&kleb_cpus) || !(kleb_ioctl_args.pid == 0 || kleb_ioctl_args.pid == 1))
+		cpumask_copy(&kleb_cpus, cpu_online_mask);
+
+	/* Event groups go round-robin over the monitored CPUs unless user mapped them */
+	for_each_possible_cpu(cpu)
 	{
-		printk(KERN_INFO "Invalid action: Counters already collecting\n");
+		per_cpu(kleb_cpu, cpu).event_group = 0;
 	}
+	if (num_event_groups)
+	{
+		int next = 0;
 
-	return 0;
+		for_each_cpu(cpu, &kleb_cpus)
+		{
+			per_cpu(kleb_cpu, cpu).event_group = kleb_ioctl_args.event_map ?
+				kleb_ioctl_args.cpu_event_group[cpu] : next++ % num_event_groups;
+		}
+	}
+
+	per_cpu_mode = kleb_ioctl_args.per_cpu && (kleb_ioctl_args.pid == 0 || kleb_ioctl_args.pid == 1);
+	rows_per_tick = per_cpu_mode ? cpumask_weight(&kleb_cpus) : max(num_groups, num_event_groups);
+	home_cpu = cpumask_first(&kleb_cpus);
 }
 
 /* Deinitialize module from ioctl stop */
 int stop_counters()
 {
+	int i;
+
+	recording = 0;
+	tracking = 0;
+
+	/* Stop timers, this context becomes the only producer */
+	timer_restart = 0;
+	for_each_cpu(i, &kleb_cpus)
+	{
+		hrtimer_cancel(&per_cpu(kleb_cpu, i).timer);
+	}
+
 	/* Stop counters */
-	hrtimer_cancel(&hr_timer);
+	on_each_cpu_mask(&kleb_cpus, stop_cpu_counters, NULL, 1);
+	if (sysmode && !perf_backend)
+	{
+		for_each_cpu(i, &kleb_cpus)
+		{
+			pmu_stop_remote(i);
+		}
+	}
+	kleb_publish(ktime_get());
+	static_branch_disable(&lbr_enabled);
+	static_branch_disable(&pebs_enabled);
+	static_branch_disable(&rdpmc_enabled);
+	if (perf_backend)
+	{
+		perf_counters_release();
+	}
+	unregister_uprobe_funcs();
 
-	for (int i = 0; i < NUM_CORES; ++i)
+	if (ring.lost)
 	{
-		pmu_stop_counters(i);
+		printk(KERN_INFO "Samples lost on a full buffer: %lu\n", ring.lost);
 	}
-	pmu_read_counters();
-	++counter;
-	recording = 0;
-	timer_restart = 0;
+	if (ring.overwritten)
+	{
+		printk(KERN_INFO "Samples overwritten before read: %lu\n", ring.overwritten);
+	}
+	if (ring.paused)
+	{
+		printk(KERN_INFO "Ticks paused on a full buffer: %lu\n", ring.paused);
+	}
+	if (ring.lbr_lost)
+	{
+		printk(KERN_INFO "Branch snapshots lost on a full buffer: %lu\n", ring.lbr_lost);
+	}
+	if (pebs)
+	{
+		unsigned long staged_lost = 0;
+
+		for_each_cpu(i, &kleb_cpus)
+		{
+			staged_lost += per_cpu(kleb_cpu, i).pebs_lost;
+		}
+		if (staged_lost || ring.pebs_lost)
+			printk(KERN_INFO "Memory samples lost: %lu between ticks, %lu on a full buffer\n", staged_lost, ring.pebs_lost);
+	}
+	wake_up_interruptible(&ring_wait);
 	
-	target->index_size = 0;
+	printk(KERN_INFO "Tasks tracked at stop: %d, contexts: %d\n", atomic_read(&num_targets), atomic_read(&num_task_ctx));
 	
 	return 0;
 }
@@ -698,57 +2593,99 @@ int open(struct inode *inode, struct file *fp)
 /* Read for extract data to user */
 ssize_t read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
-	int size_of_message = num_recordings * (num_events + 3) * sizeof(unsigned int);
-	int size_of_realmessage = counter * (num_events + 3) * sizeof(unsigned int);
-	int error_count = 0;
-	int x, y;
-
-	/* For periodic data extraction */
-	if(recording){
-		//FOR DEBUG
-		//printk("Counter INT: %d On CPU: %d\n", counter, get_cpu());
-		/* Read and save latest HPC */
-		if(counter != 0){		
-
-			/* Send data to user */
-			error_count = copy_to_user(buffer, hardware_events[0], size_of_message);
-			counter = 0;
-
-			/* Reset buffer value */
-			for (x = 0; x < (num_events + 3); ++x)
-			{ 
-				for (y = 0; y < num_recordings; ++y)
-				{
-					hardware_events[x][y] = -10;
-				}
-			}
+	unsigned long head, tail, off, words;
+	kleb_record_t *rec;
+	size_t copied = 0;
+
+	if (!ring.data)
+	{
+		return 0;
+	}
+
+	/* Copy whole records published by the producer */
+	head = smp_load_acquire(&ring.head);
+	tail = ring.tail;
+	while (tail < head)
+	{
+		/* Report records overwritten by the producer as one loss record */
+		if (tail < READ_ONCE(ring.drop))
+		{
+			u64 lost[RECORD_WORDS(1)];
+			kleb_record_t *lost_rec = (kleb_record_t *)lost;
+			unsigned long count;
+
+			tail = READ_ONCE(ring.drop);
+			smp_rmb();
+			count = READ_ONCE(ring.overwritten) - ring.reported;
+			head = max(head, smp_load_acquire(&ring.head));
+			if (count == 0 || copied + sizeof(lost) > len)
+				continue;
+
+			memset(lost, 0, sizeof(lost));
+			lost_rec->type = REC_LOST;
+			lost_rec->group = GROUP_ALL;
+			lost_rec->size = RECORD_WORDS(1);
+			lost_rec->cpu = -1;
+			lost_rec->time_ns = (tail < head) ? ((kleb_record_t *)&ring.data[tail % ring.size])->time_ns : 0;
+			lost[RECORD_HDR_WORDS] = count;
+			if (copy_to_user(buffer + copied, lost, sizeof(lost)) != 0)
+				return -EFAULT;
+			copied += sizeof(lost);
+			ring.reported += count;
+			continue;
+		}
+
+		off = tail % ring.size;
+		rec = (kleb_record_t *)&ring.data[off];
+
+		/* Skip padding at the end of the ring, unless it was overwritten meanwhile */
+		if (ring.size - off < RECORD_HDR_WORDS || rec->type == REC_PAD)
+		{
+			smp_rmb();
+			if (tail >= READ_ONCE(ring.drop))
+				tail += ring.size - off;
+			continue;
+		}
+		/* The producer may be rewriting an overwritten slot, never copy past the ring */
+		words = READ_ONCE(rec->size);
+		if (words < RECORD_HDR_WORDS || words > ring.size - off)
+		{
+			smp_rmb();
+			if (tail < READ_ONCE(ring.drop))
+				continue;
+			break;
+		}
+		if (copied + words * sizeof(u64) > len)
+		{
+			break;
+		}
+		if (copy_to_user(buffer + copied, rec, words * sizeof(u64)) != 0)
+		{
+			printk(KERN_INFO "Failed to send %lu characters to the user\n", words * sizeof(u64));
+			return -EFAULT;
+		}
+		/* Discard a record overwritten while it was copied */
+		smp_rmb();
+		if (tail < READ_ONCE(ring.drop))
+		{
+			continue;
 		}
+		copied += words * sizeof(u64);
+		tail += words;
 	}
+	smp_store_release(&ring.tail, tail);
+	WRITE_ONCE(ring.ctrl->tail, tail);
+
 	/* For exit data extraction */
-	else	
+	if (!recording && tail >= head)
 	{
-		error_count = copy_to_user(buffer, hardware_events[0], size_of_message);
 		if (cleanup_memory() < 0)
 		{
 			printk(KERN_INFO "Memory failed to cleanup cleanly");
 		}
 	}
 
-	/* Check data extraction size */
-	if (error_count == 0 && size_of_realmessage != 0)
-	{
-		//DEBUG
-		return (size_of_realmessage);
-	}
-	else if(error_count == 0 && size_of_realmessage == 0){
-		return (size_of_realmessage);
-	}
-	else
-	{
-		printk(KERN_INFO "Failed to send %d characters to the user\n", error_count);
-		return -EFAULT;
-	}
-	
+	return copied;
 }
 
 int release(struct inode *inode, struct file *fp)
@@ -757,23 +2694,40 @@ int release(struct inode *inode, struct file *fp)
 	return 0;
 }
 
-#ifdef UNLOCKED
-long ioctl_funcs(struct file *fp, unsigned int cmd, unsigned long arg)
-#else
-int ioctl_funcs(struct inode *inode, struct file *fp, unsigned int cmd, unsigned long arg)
-#endif
+/* A reader of the mapped ring hands records back */
+static int ring_consume(unsigned long tail)
 {
-	int ret = 0;
-	kleb_ioctl_args_t *kleb_ioctl_args_user = (kleb_ioctl_args_t *)(arg);
-	if (kleb_ioctl_args_user == NULL)
+	/* The reader may have skipped to drop before head was published */
+	if (!ring.data || tail < ring.tail || tail > max(smp_load_acquire(&ring.head), READ_ONCE(ring.drop)))
 	{
-		printk_d("lprof_ioctl: User did not pass in cmd\n");
 		return (-EINVAL);
 	}
-	else{
-		//DEBUG
-		//printk(KERN_INFO "************ Catch IOCTL ***********\n");
-		//printk(KERN_INFO "%u\n", cmd);
+	smp_store_release(&ring.tail, tail);
+	WRITE_ONCE(ring.ctrl->tail, tail);
+
+	/* For exit data extraction */
+	if (!recording && tail >= ring.head)
+	{
+		if (cleanup_memory() < 0)
+		{
+			printk(KERN_INFO "Memory failed to cleanup cleanly");
+		}
+	}
+	return 0;
+}
+
+/* Start and stop, serialized so a session only changes between them */
+static DEFINE_MUTEX(session_lock);
+
+static int session_ioctl(unsigned int cmd, kleb_ioctl_args_t *kleb_ioctl_args_user)
+{
+	int ret = 0;
+
+	/* One session at a time, its arguments stay untouched while it runs or has records to read */
+	if (cmd == IOCTL_START && (recording || ring.ctrl))
+	{
+		printk(KERN_INFO "A session is still running or has records to read\n");
+		return (-EBUSY);
 	}
 
 	/* Read the parameters from userspace */
@@ -790,21 +2744,141 @@ int ioctl_funcs(struct inode *inode, struct file *fp, unsigned int cmd, unsigned
 			break;
 		/* Start command */
 		case IOCTL_START:
+		{
+			/* Checked into locals, the globals only change once the start can go ahead */
+			unsigned int new_rapl_mask = 0, new_lbr_nr, new_lbr_depth = 0, new_pebs_format = 0;
+			int new_perf_backend = (kleb_ioctl_args.backend == BACKEND_PERF);
+			int new_topdown = kleb_ioctl_args.topdown;
+			int new_pebs = kleb_ioctl_args.pebs;
+			int system_wide = (kleb_ioctl_args.pid == 0 || kleb_ioctl_args.pid == 1);
+
 			printk(KERN_INFO "Starting counters\n");
+			if (new_topdown && !topdown_supported())
+			{
+				printk(KERN_INFO "Top-down metrics are not supported on this CPU\n");
+				return (-EOPNOTSUPP);
+			}
+			if (kleb_ioctl_args.rapl && rapl_probe(&new_rapl_mask) < 0)
+			{
+				printk(KERN_INFO "RAPL energy counters are not supported on this CPU\n");
+				return (-EOPNOTSUPP);
+			}
+			new_lbr_nr = min_t(unsigned int, kleb_ioctl_args.lbr, MAX_LBR);
+			if (new_lbr_nr)
+			{
+				new_lbr_depth = lbr_probe();
+				if (new_lbr_depth == 0)
+				{
+					printk(KERN_INFO "Last branch records are not supported on this CPU\n");
+					return (-EOPNOTSUPP);
+				}
+				new_lbr_nr = min(new_lbr_nr, new_lbr_depth);
+			}
+			if (new_pebs)
+			{
+				new_pebs_format = pebs_probe();
+				if (new_pebs_format == 0)
+				{
+					printk(KERN_INFO "PEBS memory sampling is not supported on this CPU\n");
+					return (-EOPNOTSUPP);
+				}
+				/* The last programmable counter is taken */
+				if (new_pebs > PEBS_LLC_MISS || kleb_ioctl_args.num_events > PEBS_COUNTER || kleb_ioctl_args.pebs_period == 0 || kleb_ioctl_args.pebs_period > INT_MAX)
+				{
+					return (-EINVAL);
+				}
+			}
+			/* Top-down, LBR and PEBS program MSRs perf would own */
+			if (new_perf_backend && (new_topdown || new_lbr_nr || new_pebs))
+			{
+				printk(KERN_INFO "The perf backend only counts events and fixed counters\n");
+				return (-EINVAL);
+			}
+			/* Event groups split the CPUs of a system-wide session, each CPU's events are programmed from the ioctl */
+			if (kleb_ioctl_args.num_event_groups && (kleb_ioctl_args.num_event_groups > MAX_EVENT_GROUPS || !system_wide ||
+				new_perf_backend || new_pebs))
+			{
+				printk(KERN_INFO "Event groups need system-wide mode and the MSR backend without PEBS\n");
+				return (-EINVAL);
+			}
+			for (int cpu = 0; kleb_ioctl_args.num_event_groups && kleb_ioctl_args.event_map && cpu < MAX_CPUS; ++cpu)
+			{
+				if (kleb_ioctl_args.cpu_event_group[cpu] >= kleb_ioctl_args.num_event_groups)
+					return (-EINVAL);
+			}
+			if (kleb_ioctl_args.num_event_groups && kleb_ioctl_args.event_map && !cpu_map_covers_selection())
+			{
+				printk(KERN_INFO "An event map only covers CPUs below %d, select them explicitly\n", MAX_CPUS);
+				return (-EINVAL);
+			}
+			/* User reads need counters that are never reset or reloaded */
+			if (kleb_ioctl_args.rdpmc && (new_perf_backend || new_topdown || new_pebs))
+			{
+				printk(KERN_INFO "rdpmc mode needs the MSR backend without top-down or PEBS\n");
+				return (-EINVAL);
+			}
+			if (kleb_ioctl_args.num_events > MAX_EVENTS || set_targets() < 0)
+			{
+				return (-EINVAL);
+			}
+
 			target_pid = kleb_ioctl_args.pid; 
 			delay_in_ns = kleb_ioctl_args.delay_in_ns;
 			num_events = kleb_ioctl_args.num_events;
+			topdown = new_topdown;
+			rapl = kleb_ioctl_args.rapl;
+			rapl_mask = new_rapl_mask;
+			lbr_nr = new_lbr_nr;
+			lbr_depth = new_lbr_depth;
+			if (lbr_nr)
+			{
+				kleb_ioctl_args.lbr = lbr_nr;
+				kleb_ioctl_args.lbr_format = lbr_format();
+			}
+			pebs = new_pebs;
+			pebs_format = new_pebs_format;
+			pebs_latency = kleb_ioctl_args.pebs_latency;
+			perf_backend = new_perf_backend;
+			num_event_groups = kleb_ioctl_args.num_event_groups;
+			rdpmc = kleb_ioctl_args.rdpmc;
+			num_counters = num_events + NUM_FIXED_COUNTERS + (topdown ? NUM_TOPDOWN_COUNTERS : 0) + (rapl ? NUM_ENERGY_COUNTERS : 0);
 			user_os_rec = kleb_ioctl_args.user_os_rec;
-
+			min_delay_in_ns = kleb_ioctl_args.min_delay_in_ns;
+			max_delay_in_ns = kleb_ioctl_args.max_delay_in_ns;
+			roi_mode = kleb_ioctl_args.roi;
+			hifreq = kleb_ioctl_args.hifreq;
+			overflow_policy = kleb_ioctl_args.overflow;
+			set_cpu_selection();
+
+			/* A failed start frees what it allocated, the next start begins clean */
 			if (initialize_memory() < 0)
 			{
 				printk(KERN_INFO "Memory failed to initialize");
+				cleanup_memory();
 				return (-ENODEV);
 			}
+			if (perf_backend)
+			{
+				ret = perf_counters_create();
+				if (ret < 0)
+				{
+					printk(KERN_INFO "perf counters failed to initialize: %d\n", ret);
+					cleanup_memory();
+					return (ret);
+				}
+			}
+
+			/* Tell user the buffer geometry */
+			kleb_ioctl_args.buffer_size = ring.size * sizeof(u64);
+			if (copy_to_user(kleb_ioctl_args_user, &kleb_ioctl_args, sizeof(kleb_ioctl_args_t)) != 0)
+			{
+				printk_d("lprof_ioctl: Could not copy args to userspace\n");
+			}
 			//DEBUG
 			//printk(KERN_INFO "%d %d %d %d %llu %d\n",kleb_ioctl_args.counter1, kleb_ioctl_args.counter2, kleb_ioctl_args.counter3,kleb_ioctl_args.counter4, kleb_ioctl_args.counter_umask, kleb_ioctl_args.user_os_rec);
 			start_counters();
 			break;
+		}
 		case IOCTL_DUMP:
 			printk(KERN_INFO "This will dump the counters\n");
 		break;
@@ -830,10 +2904,112 @@ int ioctl_funcs(struct inode *inode, struct file *fp, unsigned int cmd, unsigned
 	return ret;
 }
 
+#ifdef UNLOCKED
+long ioctl_funcs(struct file *fp, unsigned int cmd, unsigned long arg)
+#else
+int ioctl_funcs(struct inode *inode, struct file *fp, unsigned int cmd, unsigned long arg)
+#endif
+{
+	int ret = 0;
+	kleb_ioctl_args_t *kleb_ioctl_args_user = (kleb_ioctl_args_t *)(arg);
+
+	/* Region markers pass the label by value */
+	if (cmd == IOCTL_REGION_BEGIN)
+	{
+		return region_begin((unsigned int)arg);
+	}
+	if (cmd == IOCTL_REGION_END)
+	{
+		return region_end((unsigned int)arg);
+	}
+	if (cmd == IOCTL_UPROBE)
+	{
+		kleb_uprobe_args_t uprobe_args;
+		if (copy_from_user(&uprobe_args, (void __user *)arg, sizeof(uprobe_args)) != 0)
+		{
+			return (-EINVAL);
+		}
+		/* Probes are queued for the next START, a failed one abandons the whole set */
+		mutex_lock(&session_lock);
+		ret = recording ? (-EBUSY) : register_uprobe_func(&uprobe_args);
+		if (ret < 0 && !recording)
+		{
+			unregister_uprobe_funcs();
+		}
+		mutex_unlock(&session_lock);
+		return ret;
+	}
+	if (cmd == IOCTL_UPROBE_STATS)
+	{
+		return copy_uprobe_stats((kleb_uprobe_stats_args_t __user *)arg);
+	}
+	if (cmd == IOCTL_TASK_STATS)
+	{
+		return copy_task_stats((kleb_task_stats_args_t __user *)arg);
+	}
+	if (cmd == IOCTL_TIMER_STATS)
+	{
+		return copy_timer_stats((kleb_timer_stats_t __user *)arg);
+	}
+	if (cmd == IOCTL_RING_CONSUME)
+	{
+		return ring_consume(arg);
+	}
+
+	if (kleb_ioctl_args_user == NULL)
+	{
+		printk_d("lprof_ioctl: User did not pass in cmd\n");
+		return (-EINVAL);
+	}
+	else{
+		//DEBUG
+		//printk(KERN_INFO "************ Catch IOCTL ***********\n");
+		//printk(KERN_INFO "%u\n", cmd);
+	}
+
+	mutex_lock(&session_lock);
+	ret = session_ioctl(cmd, kleb_ioctl_args_user);
+	/* A START that did not begin recording leaves no queued uprobes behind for the next try */
+	if (cmd == IOCTL_START && ret < 0 && !recording)
+	{
+		unregister_uprobe_funcs();
+	}
+	mutex_unlock(&session_lock);
+	return ret;
+}
+
+/* Map the control page and the records read-only */
+int kleb_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	if (!ring.ctrl || (vma->vm_flags & VM_WRITE))
+	{
+		return (-EINVAL);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_vmalloc_range(vma, ring.ctrl, vma->vm_pgoff);
+}
+
+/* Readable once the ring is half full or recording stopped */
+__poll_t kleb_poll(struct file *filep, poll_table *wait)
+{
+	poll_wait(filep, &ring_wait, wait);
+	if (ring.data && (ring_used() >= ring.size / 2 || !recording))
+	{
+		return EPOLLIN | EPOLLRDNORM;
+	}
+	return 0;
+}
+
 #ifdef UNLOCKED
 struct file_operations fops = {
 	open : open,
 	read : read,
+	poll : kleb_poll,
+	mmap : kleb_mmap,
 	unlocked_ioctl : ioctl_funcs,
 	release : release
 };
@@ -841,47 +3017,161 @@ struct file_operations fops = {
 struct file_operations fops = {
 	open : open,
 	read : read,
+	poll : kleb_poll,
+	mmap : kleb_mmap,
 	ioctl : ioctl_funcs,
 	release : release
 };
 #endif
 
+/* Zeroed pages on a node, mapped contiguously and mappable by user readers */
+static void *ring_alloc(unsigned long bytes, int node)
+{
+	unsigned long num_pages = DIV_ROUND_UP(bytes, PAGE_SIZE);
+	void *addr;
+
+	ring.pages = kvcalloc(num_pages, sizeof(struct page *), GFP_KERNEL);
+	if (!ring.pages)
+	{
+		return NULL;
+	}
+	for (ring.num_pages = 0; ring.num_pages < num_pages; ring.num_pages++)
+	{
+		ring.pages[ring.num_pages] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+		if (!ring.pages[ring.num_pages])
+		{
+			return NULL;
+		}
+	}
+	addr = vmap(ring.pages, num_pages, VM_MAP | VM_USERMAP, PAGE_KERNEL);
+	return addr;
+}
+
+static void ring_free(void)
+{
+	if (ring.ctrl)
+	{
+		vunmap(ring.ctrl);
+	}
+	for (unsigned long i = 0; ring.pages && i < ring.num_pages; i++)
+	{
+		__free_page(ring.pages[i]);
+	}
+	kvfree(ring.pages);
+	ring.pages = NULL;
+	ring.num_pages = 0;
+	ring.ctrl = NULL;
+	ring.data = NULL;
+}
+
 int initialize_memory()
 {
-	int i, j;
+	unsigned long records = NUM_RECORDINGS;
+	int cpu;
 
 	printk("Memory initializing\n");
 
 	//num_recordings = 500;
-	/* Create Target id buffer */
-	target = (target_array*)kmalloc(sizeof(target_array), GFP_KERNEL);
-	target->size = 100;
-	target->target_pid = (target_id*)kmalloc(sizeof(target_id)*target->size, GFP_KERNEL);
+	/* Create Target id table */
+	target = vzalloc(TARGET_SLOTS * sizeof(target_id));
+	if (!target)
+	{
+		return (-ENOMEM);
+	}
+
+	/* Create sample ring, short periods keep a fixed amount of time */
+	if (hifreq && delay_in_ns && HIFREQ_BUFFER_NS / delay_in_ns > records)
+	{
+		records = HIFREQ_BUFFER_NS / delay_in_ns;
+	}
+	tick_words = rows_per_tick * RECORD_WORDS(num_counters);
+	if (lbr_nr)
+	{
+		tick_words += cpumask_weight(&kleb_cpus) * (RECORD_HDR_WORDS + 2 * lbr_nr);
+	}
+	if (pebs)
+	{
+		tick_words += cpumask_weight(&kleb_cpus) * (RECORD_HDR_WORDS + 3 * MAX_PEBS);
+	}
+	ring.size = records * tick_words;
+	if (ring.size > MAX_RING_WORDS && (records > NUM_RECORDINGS || lbr_nr || pebs))
+	{
+		ring.size = MAX_RING_WORDS;
+	}
+	/* Only the home timer writes the ring, keep it on its node */
+	kleb_ioctl_args.ring_node = cpu_to_node(home_cpu);
+	ring.ctrl = ring_alloc(PAGE_SIZE + ring.size * sizeof(u64), kleb_ioctl_args.ring_node);
+	if (!ring.ctrl)
+	{
+		ring_free();
+		return (-ENOMEM);
+	}
+	ring.ctrl->size = ring.size;
+	ring.data = (u64 *)((char *)ring.ctrl + PAGE_SIZE);
+	ring.head = 0;
+	ring.tail = 0;
+	ring.next = 0;
+	ring.drop = 0;
+	ring.overwritten = 0;
+	ring.reported = 0;
+	ring.pending = 0;
+	ring.lost = 0;
+	ring.paused = 0;
+	ring.lbr_lost = 0;
+	ring.pebs_lost = 0;
+
+	/* Totals and staging areas on the node of each CPU, the switch hook may run on any of them */
+	for_each_possible_cpu(cpu)
+	{
+		kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
+
+		kc->buf = kzalloc_node(sizeof(kleb_cpu_buf_t), GFP_KERNEL, cpu_to_node(cpu));
+		if (!kc->buf)
+		{
+			return (-ENOMEM);
+		}
+	}
 
-	/* Create data buffer */
-	hardware_events = kmalloc((num_events + 3) * sizeof(unsigned int *), GFP_KERNEL);
-	hardware_events[0] = kmalloc((num_events + 3) * num_recordings * sizeof(unsigned int), GFP_KERNEL);
-	for (i = 0; i < (num_events + 3); ++i)
-	{ // This reduces the number of kmalloc calls
-		hardware_events[i] = *hardware_events + num_recordings * i;
-		for (j = 0; j < num_recordings; ++j)
+	/* Debug store and PEBS buffer on the node of each CPU */
+	if (pebs)
+	{
+		for_each_cpu(cpu, &kleb_cpus)
 		{
-			hardware_events[i][j] = -10;
+			kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
+
+			kc->ds = kzalloc_node(sizeof(kleb_ds_t) + PEBS_BUFFER_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+			if (!kc->ds)
+			{
+				return (-ENOMEM);
+			}
 		}
 	}
+
+	/* Create per-task contexts */
+	task_ctx = vzalloc(MAX_TASKS * sizeof(kleb_task_stats_t));
+	if (!task_ctx)
+	{
+		return (-ENOMEM);
+	}
 	return 0;
 }
 
 int initialize_timer()
 {
+	int cpu;
 
 	printk("Timer initializing\n");
-	counter = 0;
 	timer_restart = 0;
 	printk("Number of Cores available %d\n", NUM_CORES);
 
-	hrtimer_init(&hr_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	hr_timer.function = &hrtimer_callback;
+	for_each_possible_cpu(cpu)
+	{
+		kleb_cpu_t *kc = per_cpu_ptr(&kleb_cpu, cpu);
+
+		hrtimer_init(&kc->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		kc->timer.function = &hrtimer_callback;
+		seqcount_init(&kc->seq);
+	}
 
 	return 0;
 }
@@ -952,24 +3242,37 @@ int init_module(void)
 
 int cleanup_memory()
 {
+	int cpu;
+
 	printk("Memory cleaning up\n");
 
-    kfree(target->target_pid);
-    kfree(target);
-	kfree(hardware_events[0]);
-	kfree(hardware_events);
+	vfree(target);
+	target = NULL;
+	ring_free();
+	vfree(task_ctx);
+	task_ctx = NULL;
+	for_each_possible_cpu(cpu)
+	{
+		kfree(per_cpu(kleb_cpu, cpu).ds);
+		per_cpu(kleb_cpu, cpu).ds = NULL;
+		kfree(per_cpu(kleb_cpu, cpu).buf);
+		per_cpu(kleb_cpu, cpu).buf = NULL;
+	}
+	cleanup_uprobe_stats();
 
 	return 0;
 }
 
 int cleanup_timer()
 {
-	int ret;
+	int cpu;
 	printk("Timer cleaning up\n");
 
-	ret = hrtimer_cancel(&hr_timer);
-	if (ret)
-		printk("The timer was still in use...\n");
+	for_each_possible_cpu(cpu)
+	{
+		if (hrtimer_cancel(&per_cpu(kleb_cpu, cpu).timer))
+			printk("The timer was still in use...\n");
+	}
 
 	return 0;
 }
@@ -1002,6 +3305,8 @@ void cleanup_module(void)
 	}
 
 	unregister_all();
+	unregister_uprobe_funcs();
+	cleanup_uprobe_stats();
 
 	printk("K-LEB module uninstalled\n");
 
@@ -29,6 +29,13 @@ along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
 #define IOCTL_DELETE_COUNTERS _IOW(IOC_MAGIC, 4, char *)
 #define IOCTL_DEBUG _IOW(IOC_MAGIC, 5, char *)
 #define IOCTL_STATS _IOW(IOC_MAGIC, 6, char *)
+#define IOCTL_REGION_BEGIN _IOW(IOC_MAGIC, 7, unsigned int)
+#define IOCTL_REGION_END _IOW(IOC_MAGIC, 8, unsigned int)
+#define IOCTL_UPROBE _IOW(IOC_MAGIC, 9, char *)
+#define IOCTL_UPROBE_STATS _IOR(IOC_MAGIC, 10, char *)
+#define IOCTL_TASK_STATS _IOR(IOC_MAGIC, 11, char *)
+#define IOCTL_TIMER_STATS _IOR(IOC_MAGIC, 12, char *)
+#define IOCTL_RING_CONSUME _IOW(IOC_MAGIC, 13, unsigned long)
 
 #define DEVICE_NAME "kleb"
 
@@ -69,6 +76,39 @@ along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
 #define STLB_HIT 0x1049
 #define UNKNOWN_EVENT 0xffff
 
+/* Function attribution through uprobes */
+#define MAX_UPROBES 16
+#define MAX_UPROBE_THREADS 256
+#define UPROBE_STACK_DEPTH 16
+
+/* Last branch records per snapshot */
+#define MAX_LBR 32
+
+/* Memory samples of one CPU held between two ticks */
+#define MAX_PEBS 64
+
+/* Per-task counter contexts */
+#define MAX_TASKS 8192
+
+/* Event groups spread over the CPUs of a system-wide session */
+#define MAX_EVENT_GROUPS 16
+
+/* Unrelated processes monitored in one session, each with its own stream of samples */
+#define MAX_TARGETS 16
+#define GROUP_ALL 0xff	// Record that applies to every target
+
+/* Sample layout: configurable events then fixed counters */
+#define NUM_FIXED_COUNTERS 3
+#define NUM_RECORDINGS 500	// Ring capacity in rows per CPU row of a tick
+#define MAX_EVENTS 4
+#define NUM_TOPDOWN_COUNTERS 5	// Slots, then slots retiring, bad speculation, frontend bound, backend bound
+#define TOPDOWN_SCALE 255	// Category counts are slots times their PERF_METRICS fraction in 1/255
+#define NUM_ENERGY_COUNTERS 3	// Package, core and DRAM energy in RAPL units, last in a sample
+#define MAX_COUNTERS (MAX_EVENTS + NUM_FIXED_COUNTERS + NUM_TOPDOWN_COUNTERS + NUM_ENERGY_COUNTERS)
+#define MAX_CPUS 256
+#define CPU_MASK_WORDS (MAX_CPUS / 64)
+#define HIFREQ_BUFFER_NS 100000000	// High-frequency mode buffers this much time
+
 /* K-LEB parameters */
 typedef struct {
 	int pid;
@@ -76,8 +116,123 @@ typedef struct {
 	unsigned int num_events;
 	unsigned int delay_in_ns;
 	unsigned int user_os_rec; // 1 is user only, 2 is os only, 3 is both	
+	unsigned int min_delay_in_ns; // Adaptive period bounds, 0 is fixed period
+	unsigned int max_delay_in_ns;
+	unsigned int roi; // 1 only records samples inside marked regions
+	unsigned int per_cpu; // 1 writes one row per CPU in system-wide mode
+	unsigned long long cpu_mask[CPU_MASK_WORDS]; // CPUs monitored in system-wide mode, empty is all
+	unsigned int buffer_size; // Set by the module: bytes in the sample ring
+	unsigned int hifreq; // 1 uses hard-irq pinned timers on an absolute period grid
+	unsigned int overflow; // Policy on a full buffer, OVERFLOW_*
+	unsigned int topdown; // 1 adds top-down level 1 from fixed counter 3 and PERF_METRICS
+	unsigned int rapl; // 1 adds package, core and DRAM energy of the monitored packages
+	unsigned int rapl_unit; // Set by the module: MSR_RAPL_POWER_UNIT
+	unsigned int lbr; // Branch records attached to every tick, 0 disables, up to MAX_LBR
+	unsigned int lbr_format; // Set by the module: LBR format of IA32_PERF_CAPABILITIES
+	unsigned int num_targets; // Processes in targets, 0 monitors pid alone
+	int targets[MAX_TARGETS]; // Sample group i follows targets[i] and its descendants
+	unsigned int pebs; // PEBS_* memory sampling on the last programmable counter, 0 disables
+	unsigned int pebs_period; // Events between two memory samples
+	unsigned int pebs_latency; // Cycles a load must exceed with PEBS_LOAD_LATENCY
+	unsigned int backend; // BACKEND_* that owns the counters
+	int ring_node; // Set by the module: NUMA node of the sample ring and of its producer
+	unsigned int rdpmc; // 1 lets targets read the counters with rdpmc, see kleb_rdpmc.h
+	unsigned int num_event_groups; // Event groups in system-wide mode, 0 programs counter[] on every CPU
+	unsigned int event_groups[MAX_EVENT_GROUPS][MAX_EVENTS]; // num_events codes per group, 0 leaves a counter off
+	unsigned int event_map; // 1 takes cpu_event_group, 0 deals the groups round-robin over the monitored CPUs
+	unsigned char cpu_event_group[MAX_CPUS]; // Event group of each CPU
 } kleb_ioctl_args_t;
 
+/* Counter backends */
+#define BACKEND_MSR 0	// Programs the PMU MSRs directly, fastest, takes over the PMU
+#define BACKEND_PERF 1	// Per-CPU kernel counters from perf, coexists with the NMI watchdog and perf users
+
+/* Memory sampling events */
+#define PEBS_LOAD_LATENCY 1	// Loads slower than pebs_latency cycles
+#define PEBS_LLC_MISS 2		// Loads missing the last level cache
+
+/* Overflow policies */
+#define OVERFLOW_DROP 0		// Drop the newest samples and count them
+#define OVERFLOW_OVERWRITE 1	// Overwrite the oldest unread samples, flight recorder
+#define OVERFLOW_PAUSE 2	// Stop publishing and wake the reader, counts carry into the next sample
+
+/* Record types in the sample stream */
+#define REC_PAD 0
+#define REC_SAMPLE 1
+#define REC_LOST 2	// Followed by the number of samples lost, precedes the first sample after the gap
+#define REC_LBR 3	// Branch pairs of one CPU at its last tick, from then to, most recent first
+#define REC_PEBS 4	// Memory samples of one CPU since its last tick, instruction, data address then latency
+
+/* Record header, followed by the counters of a sample */
+typedef struct {
+	unsigned char type;
+	unsigned char group;		// Target of the sample, index in kleb_ioctl_args_t.targets, or its event group with event groups
+	unsigned short size;		// Record size in 8-byte words
+	int cpu;			// CPU of a per-CPU row, -1 for all CPUs
+	unsigned long long time_ns;	// Tick time since start
+	unsigned int period_ns;		// Actual sample period
+	unsigned int region;		// Label of the last region marked by the target
+} kleb_record_t;
+
+/* First page of the mmap'ed ring, the records follow on the next page */
+typedef struct {
+	unsigned long long head;	// End of published records, in words since start
+	unsigned long long tail;	// Records handed back by the reader
+	unsigned long long drop;	// Oldest record not overwritten
+	unsigned long long overwritten;	// Samples overwritten before they were read
+	unsigned long long size;	// Ring size in words
+} kleb_ring_ctrl_t;
+
+#define RECORD_HDR_WORDS (sizeof(kleb_record_t) / sizeof(unsigned long long))
+#define RECORD_WORDS(num_counters) (RECORD_HDR_WORDS + (num_counters))
+
+/* Uprobe on <path>:<symbol>, offset is the symbol's file offset */
+typedef struct {
+	char path[256];
+	unsigned long long offset;
+	unsigned int id;
+} kleb_uprobe_args_t;
+
+/* Per-thread totals of one probed function */
+typedef struct {
+	int pid;
+	unsigned int id;
+	unsigned long long calls;
+	unsigned long long inexact; // Calls that migrated between entry and return
+	unsigned long long counter[MAX_COUNTERS];
+} kleb_func_stats_t;
+
+typedef struct {
+	unsigned int num_entries;
+	kleb_func_stats_t *entries;
+} kleb_uprobe_stats_args_t;
+
+/* Per-thread totals, accumulated between switch-in and switch-out */
+typedef struct {
+	int pid;
+	int tgid;
+	unsigned long long switches; // Times the thread was switched in
+	unsigned long long counter[MAX_COUNTERS];
+} kleb_task_stats_t;
+
+typedef struct {
+	unsigned int num_entries;
+	kleb_task_stats_t *entries;
+} kleb_task_stats_args_t;
+
+/* Timer accuracy over all monitored CPUs */
+typedef struct {
+	unsigned long long ticks;
+	unsigned long long missed;	// Periods skipped because a tick ran late
+	unsigned long long lat_min_ns;	// Expiry to callback latency
+	unsigned long long lat_max_ns;
+	unsigned long long lat_sum_ns;
+	unsigned long long cost_max_ns;	// Time spent in the callback
+	unsigned long long cost_sum_ns;
+	unsigned long long switches;	// Context switches that started, stopped or folded counters
+	unsigned long long switch_cycles;	// TSC cycles spent on the counters in those switches
+} kleb_timer_stats_t;
+
 int initialize_memory( void );
 int initialize_timer( void );
 int initialize_ioctl( void );
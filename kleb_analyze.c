@@ -0,0 +1,1214 @@
+/* Copyright (c) 2017, 2024 James Bruska, Caleb DeLaBruere, Chutitep Woralert
+
+This file is part of K-LEB.
+
+K-LEB is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+K-LEB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* kleb-analyze: summarize K-LEB logs offline.
+ *
+ * Logs are mmap'ed and parsed in parallel chunks into one column of
+ * doubles per event, then every column is summarized by its own task
+ * with plain loops over contiguous arrays. Files are CSV written by
+ * ioctl_start or binary logs written by ioctl_start -B. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libkleb.h"
+
+#define MAX_FILES 256
+#define MAX_COLUMNS 32
+#define MAX_CHUNKS 64
+#define MIN_CHUNK_BYTES (1 << 20)
+
+/* Summary of one column */
+typedef struct {
+	size_t n;
+	double sum, mean, stddev, min, max;
+	double p50, p90, p99;
+} col_stats_t;
+
+/* Run of windows with a steady IPC */
+typedef struct {
+	size_t first, last;	// Rows
+	double inst, cycles;
+} phase_t;
+
+typedef struct {
+	const char *path;
+	const char *map;
+	size_t len;
+	int binary;
+
+	/* Columns in log order, an IPC column is derived when possible */
+	int num_columns;
+	char names[MAX_COLUMNS][32];
+	double *col[MAX_COLUMNS];
+	size_t rows;
+	col_stats_t stats[MAX_COLUMNS];
+
+	/* Byte ranges parsed by separate tasks */
+	int num_chunks;
+	size_t chunk_start[MAX_CHUNKS + 1];
+	size_t chunk_rows[MAX_CHUNKS];
+	size_t chunk_row0[MAX_CHUNKS];
+
+	phase_t *phases;
+	size_t num_phases;
+	int error;
+} log_file_t;
+
+/* Task lists run by the thread pool */
+typedef struct {
+	int file;
+	int part;	// Chunk or column
+} task_t;
+
+static log_file_t files[MAX_FILES];
+static int num_files;
+static int num_threads;
+static size_t window_rows = 100;	// Rows per window for phases and -w
+static double phase_threshold = 0.2;	// Relative IPC change that starts a new phase
+static int write_windows;
+
+/* Repeated runs, -R */
+#define ALIGN_TIME 1	// Bins of TIME_NS
+#define ALIGN_INST 2	// Bins of retired instructions
+static int runs;	// Logs of the first configuration, the rest are the second one
+static double alpha = 0.05;	// Significance level, intervals are at 1 - alpha
+static int align;
+static double align_width;
+
+static task_t *tasks;
+static int num_tasks;
+static int next_task;
+static void (*task_fn)(task_t *task);
+
+/* Summarized, the others are labels */
+static int summarized(const char *name)
+{
+	return strcmp(name, "REGION") != 0 && strcmp(name, "CPU") != 0 && strcmp(name, "TIME_NS") != 0 &&
+		strcmp(name, "TARGET") != 0;
+}
+
+/* Joules, printed with decimals */
+static int joules(const char *name)
+{
+	size_t n = strlen(name);
+
+	return n > 2 && strcmp(name + n - 2, "_J") == 0;
+}
+
+/* Ratios are averaged, never summed */
+static int ratio(const char *name)
+{
+	return strcmp(name, "IPC") == 0 || strcmp(name, "RETIRING") == 0 || strcmp(name, "BAD_SPEC") == 0 ||
+		strcmp(name, "FRONTEND_BOUND") == 0 || strcmp(name, "BACKEND_BOUND") == 0;
+}
+
+static int find_column(log_file_t *f, const char *name)
+{
+	for (int c = 0; c < f->num_columns; ++c)
+	{
+		if (strcmp(f->names[c], name) == 0)
+			return c;
+	}
+	return -1;
+}
+
+static void *worker(void *arg)
+{
+	int i;
+
+	(void)arg;
+	while ((i = __atomic_fetch_add(&next_task, 1, __ATOMIC_RELAXED)) < num_tasks)
+	{
+		task_fn(&tasks[i]);
+	}
+	return NULL;
+}
+
+/* Run fn over the task list on every thread */
+static void run_tasks(void (*fn)(task_t *task))
+{
+	pthread_t threads[num_threads];
+	int n = (num_tasks < num_threads) ? num_tasks : num_threads;
+
+	task_fn = fn;
+	next_task = 0;
+	for (int i = 1; i < n; ++i)
+	{
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+	worker(NULL);
+	for (int i = 1; i < n; ++i)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	num_tasks = 0;
+}
+
+static void add_task(int file, int part)
+{
+	tasks[num_tasks].file = file;
+	tasks[num_tasks].part = part;
+	++num_tasks;
+}
+
+/* CSV */
+
+/* Next line in [p, end), returns its end and sets next past the newline */
+static const char *line_end(const char *p, const char *end, const char **next)
+{
+	const char *nl = memchr(p, '\n', end - p);
+
+	if (nl == NULL)
+	{
+		*next = end;
+		return end;
+	}
+	*next = nl + 1;
+	return nl;
+}
+
+static int blank_line(const char *p, const char *eol)
+{
+	return p == eol || (eol - p == 1 && *p == '\r');
+}
+
+/* Decimal field up to the next comma */
+static const char *parse_field(const char *p, const char *eol, double *out)
+{
+	unsigned long long v = 0;
+	double d, scale = 0.1;
+	int neg = 0;
+
+	if (p < eol && *p == '-')
+	{
+		neg = 1;
+		++p;
+	}
+	while (p < eol && (unsigned)(*p - '0') < 10)
+	{
+		v = v * 10 + (*p++ - '0');
+	}
+	d = (double)v;
+	if (p < eol && *p == '.')
+	{
+		for (++p; p < eol && (unsigned)(*p - '0') < 10; ++p, scale *= 0.1)
+			d += (*p - '0') * scale;
+	}
+	*out = neg ? -d : d;
+
+	while (p < eol && *p != ',')
+		++p;
+	return (p < eol) ? p + 1 : p;
+}
+
+static int csv_header(log_file_t *f)
+{
+	const char *next;
+	const char *eol = line_end(f->map, f->map + f->len, &next);
+	const char *p = f->map;
+
+	while (p < eol && *p != '\r')
+	{
+		const char *comma = memchr(p, ',', eol - p);
+		const char *stop = comma ? comma : eol;
+		size_t n = stop - p;
+
+		if (n && stop[-1] == '\r')
+			--n;
+		if (n == 0)
+			break;
+		if (f->num_columns >= MAX_COLUMNS - 1)
+			return -1;
+		if (n >= sizeof(f->names[0]))
+			n = sizeof(f->names[0]) - 1;
+		memcpy(f->names[f->num_columns], p, n);
+		f->names[f->num_columns][n] = '\0';
+		++f->num_columns;
+		p = comma ? comma + 1 : eol;
+	}
+
+	/* Split the rows at line boundaries, several chunks per thread for balance */
+	size_t data = next - f->map;
+	size_t bytes = f->len - data;
+	int chunks = num_threads * 4;
+
+	if (chunks > MAX_CHUNKS)
+		chunks = MAX_CHUNKS;
+	if ((size_t)chunks > bytes / MIN_CHUNK_BYTES)
+		chunks = bytes / MIN_CHUNK_BYTES;
+	if (chunks < 1)
+		chunks = 1;
+	f->num_chunks = chunks;
+	f->chunk_start[0] = data;
+	for (int k = 1; k < chunks; ++k)
+	{
+		size_t pos = data + bytes / chunks * k;
+		const char *nl;
+
+		if (pos < f->chunk_start[k - 1])
+			pos = f->chunk_start[k - 1];
+		nl = memchr(f->map + pos, '\n', f->len - pos);
+		f->chunk_start[k] = nl ? (size_t)(nl + 1 - f->map) : f->len;
+	}
+	f->chunk_start[chunks] = f->len;
+	return f->num_columns ? 0 : -1;
+}
+
+static void csv_count(task_t *task)
+{
+	log_file_t *f = &files[task->file];
+	const char *p = f->map + f->chunk_start[task->part];
+	const char *end = f->map + f->chunk_start[task->part + 1];
+	const char *next, *eol;
+	size_t rows = 0;
+
+	for (; p < end; p = next)
+	{
+		eol = line_end(p, end, &next);
+		rows += !blank_line(p, eol);
+	}
+	f->chunk_rows[task->part] = rows;
+}
+
+static void csv_parse(task_t *task)
+{
+	log_file_t *f = &files[task->file];
+	const char *p = f->map + f->chunk_start[task->part];
+	const char *end = f->map + f->chunk_start[task->part + 1];
+	const char *next, *eol;
+	size_t row = f->chunk_row0[task->part];
+
+	for (; p < end; p = next)
+	{
+		eol = line_end(p, end, &next);
+		if (blank_line(p, eol))
+			continue;
+		for (int c = 0; c < f->num_columns; ++c)
+		{
+			p = parse_field(p, eol, &f->col[c][row]);
+		}
+		++row;
+	}
+}
+
+/* Binary logs, a header then the records of the ring */
+
+static int binary_header(log_file_t *f)
+{
+	const kleb_log_header_t *hdr = (const kleb_log_header_t *)f->map;
+	static const char *fixed[] = { "INST_RETIRED", "CPU_CLK_CYCLE", "CPU_REF_CYCLE" };
+	static const char *topdown[] = { "SLOTS", "RETIRING", "BAD_SPEC", "FRONTEND_BOUND", "BACKEND_BOUND" };
+	static const char *energy[] = { "PKG_J", "CORE_J", "DRAM_J" };
+	static const char *labels[] = { "PERIOD_NS", "REGION", "CPU", "TIME_NS", "LOST" };
+
+	if (hdr->num_events > MAX_EVENTS)
+		return -1;
+	for (unsigned int i = 0; i < hdr->num_events; ++i)
+	{
+		snprintf(f->names[f->num_columns++], sizeof(f->names[0]), "%x", hdr->counter[i]);
+	}
+	for (unsigned int i = 0; i < NUM_FIXED_COUNTERS; ++i)
+	{
+		strcpy(f->names[f->num_columns++], fixed[i]);
+	}
+	for (unsigned int i = 0; (hdr->flags & KLEB_LOG_TOPDOWN) && i < NUM_TOPDOWN_COUNTERS; ++i)
+	{
+		strcpy(f->names[f->num_columns++], topdown[i]);
+	}
+	for (unsigned int i = 0; (hdr->flags & KLEB_LOG_ENERGY) && i < NUM_ENERGY_COUNTERS; ++i)
+	{
+		strcpy(f->names[f->num_columns++], energy[i]);
+	}
+	for (unsigned int i = 0; i < sizeof(labels) / sizeof(labels[0]); ++i)
+	{
+		strcpy(f->names[f->num_columns++], labels[i]);
+	}
+	f->num_chunks = 1;
+	f->chunk_start[0] = sizeof(*hdr);
+	f->chunk_start[1] = f->len;
+	return 0;
+}
+
+/* Walk the records, fill the columns when they are allocated */
+static size_t binary_walk(log_file_t *f, int fill)
+{
+	const unsigned long long *w = (const unsigned long long *)(f->map + sizeof(kleb_log_header_t));
+	size_t words = (f->len - sizeof(kleb_log_header_t)) / sizeof(*w);
+	const kleb_log_header_t *hdr = (const kleb_log_header_t *)f->map;
+	int slots = hdr->num_events + NUM_FIXED_COUNTERS;
+	int energy = slots + ((hdr->flags & KLEB_LOG_TOPDOWN) ? NUM_TOPDOWN_COUNTERS : 0);
+	int num_counters = energy + ((hdr->flags & KLEB_LOG_ENERGY) ? NUM_ENERGY_COUNTERS : 0);
+	double unit = 1.0 / (double)(1ULL << ((hdr->rapl_unit >> 8) & 0x1f));
+	unsigned long long lost = 0;
+	size_t row = 0;
+
+	for (size_t i = 0; i + RECORD_HDR_WORDS <= words; )
+	{
+		const kleb_record_t *rec = (const kleb_record_t *)&w[i];
+
+		if (rec->size < RECORD_HDR_WORDS || i + rec->size > words)
+		{
+			f->error = 1;
+			break;
+		}
+		if (rec->type == REC_LOST)
+		{
+			lost += w[i + RECORD_HDR_WORDS];
+		}
+		else if (rec->type == REC_SAMPLE && rec->size == RECORD_WORDS(num_counters))
+		{
+			if (fill)
+			{
+				const unsigned long long *counters = &w[i + RECORD_HDR_WORDS];
+				for (int c = 0; c < num_counters; ++c)
+					f->col[c][row] = counters[c];
+				/* Top-down categories as fractions of the slots, as in the CSV */
+				for (int c = energy; c < num_counters; ++c)
+					f->col[c][row] = counters[c] * unit;
+				for (int c = slots + 1; c < energy; ++c)
+					f->col[c][row] = counters[slots] ? counters[c] / ((double)counters[slots] * TOPDOWN_SCALE) : 0;
+				f->col[num_counters][row] = rec->period_ns;
+				f->col[num_counters + 1][row] = rec->region;
+				f->col[num_counters + 2][row] = rec->cpu;
+				f->col[num_counters + 3][row] = rec->time_ns;
+				f->col[num_counters + 4][row] = lost;
+			}
+			lost = 0;
+			++row;
+		}
+		i += rec->size;
+	}
+	return row;
+}
+
+static void binary_count(task_t *task)
+{
+	files[task->file].chunk_rows[0] = binary_walk(&files[task->file], 0);
+}
+
+static void binary_parse(task_t *task)
+{
+	binary_walk(&files[task->file], 1);
+}
+
+static void count_rows(task_t *task)
+{
+	if (files[task->file].binary)
+		binary_count(task);
+	else
+		csv_count(task);
+}
+
+static void parse_rows(task_t *task)
+{
+	if (files[task->file].binary)
+		binary_parse(task);
+	else
+		csv_parse(task);
+}
+
+/* Statistics */
+
+static void swap(double *a, double *b)
+{
+	double t = *a;
+	*a = *b;
+	*b = t;
+}
+
+/* Move the k-th smallest of v[lo, hi) to v[k], smaller ones before it */
+static double select_kth(double *v, size_t lo, size_t hi, size_t k)
+{
+	while (hi - lo > 1)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		size_t i = lo, j = hi - 1;
+		double pivot;
+
+		/* Median of three */
+		if (v[mid] < v[lo])
+			swap(&v[mid], &v[lo]);
+		if (v[j] < v[lo])
+			swap(&v[j], &v[lo]);
+		if (v[j] < v[mid])
+			swap(&v[j], &v[mid]);
+		pivot = v[mid];
+
+		while (i <= j)
+		{
+			while (v[i] < pivot)
+				++i;
+			while (v[j] > pivot)
+				--j;
+			if (i <= j)
+			{
+				swap(&v[i], &v[j]);
+				++i;
+				if (j == 0)
+					break;
+				--j;
+			}
+		}
+		if (k <= j)
+			hi = j + 1;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+	return v[k];
+}
+
+static void column_stats(task_t *task)
+{
+	log_file_t *f = &files[task->file];
+	col_stats_t *s = &f->stats[task->part];
+	const double *v = f->col[task->part];
+	size_t n = f->rows;
+	double sum = 0, min = INFINITY, max = -INFINITY, dev = 0;
+
+	/* The derived IPC column skips halted rows */
+	if (strcmp(f->names[task->part], "IPC") == 0)
+	{
+		double *dst = f->col[task->part];
+		size_t m = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (!isnan(v[i]))
+				dst[m++] = v[i];
+		}
+		n = m;
+	}
+	s->n = n;
+	if (n == 0)
+		return;
+
+	/* Sum and extremes, then the deviation from the mean */
+	for (size_t i = 0; i < n; ++i)
+		sum += v[i];
+	for (size_t i = 0; i < n; ++i)
+		min = (v[i] < min) ? v[i] : min;
+	for (size_t i = 0; i < n; ++i)
+		max = (v[i] > max) ? v[i] : max;
+	s->sum = sum;
+	s->mean = sum / n;
+	for (size_t i = 0; i < n; ++i)
+		dev += (v[i] - s->mean) * (v[i] - s->mean);
+	s->stddev = sqrt(dev / n);
+	s->min = min;
+	s->max = max;
+
+	/* Percentiles on a copy, each selection narrows the next */
+	double *copy = malloc(n * sizeof(double));
+	if (copy == NULL)
+	{
+		f->error = 1;
+		return;
+	}
+	memcpy(copy, v, n * sizeof(double));
+	size_t k50 = (n - 1) * 50 / 100, k90 = (n - 1) * 90 / 100, k99 = (n - 1) * 99 / 100;
+	s->p50 = select_kth(copy, 0, n, k50);
+	s->p90 = select_kth(copy, k50, n, k90);
+	s->p99 = select_kth(copy, k90, n, k99);
+	free(copy);
+}
+
+/* Windows of window_rows rows grouped into phases of steady IPC */
+static void file_phases(task_t *task)
+{
+	log_file_t *f = &files[task->file];
+	int inst = find_column(f, "INST_RETIRED");
+	int cycles = find_column(f, "CPU_CLK_CYCLE");
+	size_t num_windows = (f->rows + window_rows - 1) / window_rows;
+	phase_t *cur = NULL;
+
+	if (inst < 0 || cycles < 0 || num_windows == 0)
+		return;
+	f->phases = malloc(num_windows * sizeof(phase_t));
+	if (f->phases == NULL)
+	{
+		f->error = 1;
+		return;
+	}
+
+	for (size_t w = 0; w < num_windows; ++w)
+	{
+		size_t first = w * window_rows;
+		size_t last = (first + window_rows < f->rows) ? first + window_rows : f->rows;
+		double wi = 0, wc = 0;
+
+		for (size_t i = first; i < last; ++i)
+		{
+			wi += f->col[inst][i];
+			wc += f->col[cycles][i];
+		}
+
+		/* A window far from the phase average starts a new phase, halted windows join the current one */
+		if (cur != NULL && (wc == 0 || cur->cycles == 0 ||
+			fabs(wi / wc - cur->inst / cur->cycles) <= phase_threshold * (cur->inst / cur->cycles)))
+		{
+			cur->last = last;
+			cur->inst += wi;
+			cur->cycles += wc;
+			continue;
+		}
+		cur = &f->phases[f->num_phases++];
+		cur->first = first;
+		cur->last = last;
+		cur->inst = wi;
+		cur->cycles = wc;
+	}
+}
+
+/* Derived columns, computed once the counters are parsed */
+static void derive_columns(task_t *task)
+{
+	log_file_t *f = &files[task->file];
+	int inst = find_column(f, "INST_RETIRED");
+	int cycles = find_column(f, "CPU_CLK_CYCLE");
+	int ipc = find_column(f, "IPC");
+
+	if (ipc < 0)
+		return;
+	for (size_t i = 0; i < f->rows; ++i)
+	{
+		double c = f->col[cycles][i];
+		f->col[ipc][i] = (c > 0) ? f->col[inst][i] / c : NAN;
+	}
+}
+
+/* Report */
+
+static double time_at(log_file_t *f, size_t row)
+{
+	int t = find_column(f, "TIME_NS");
+
+	return (t >= 0 && row < f->rows) ? f->col[t][row] : 0;
+}
+
+/* Output.csv -> Output<suffix> */
+static void derived_path(const char *log, const char *suffix, char *path, size_t len)
+{
+	char *ext;
+
+	snprintf(path, len, "%s", log);
+	ext = strrchr(path, '.');
+	if (ext != NULL && (strcmp(ext, ".csv") == 0 || strcmp(ext, ".kleb") == 0))
+		*ext = '\0';
+	strncat(path, suffix, len - strlen(path) - 1);
+}
+
+static void write_window_log(log_file_t *f)
+{
+	char path[512];
+	int time = find_column(f, "TIME_NS");
+
+	derived_path(f->path, "_windows.csv", path, sizeof(path));
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Error opening file %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "START_NS,END_NS,ROWS,");
+	for (int c = 0; c < f->num_columns; ++c)
+	{
+		if (summarized(f->names[c]) && !ratio(f->names[c]))
+			fprintf(fp, "%s,", f->names[c]);
+	}
+	fprintf(fp, "\n");
+
+	for (size_t first = 0; first < f->rows; first += window_rows)
+	{
+		size_t last = (first + window_rows < f->rows) ? first + window_rows : f->rows;
+
+		fprintf(fp, "%.0f,%.0f,%zu,", time >= 0 ? f->col[time][first] : 0, time >= 0 ? f->col[time][last - 1] : 0, last - first);
+		for (int c = 0; c < f->num_columns; ++c)
+		{
+			double sum = 0;
+
+			if (!summarized(f->names[c]) || ratio(f->names[c]))
+				continue;
+			for (size_t i = first; i < last; ++i)
+				sum += f->col[c][i];
+			fprintf(fp, joules(f->names[c]) ? "%.6f," : "%.0f,", sum);
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+	printf("Window Log Path: %s\n", path);
+}
+
+static void report(log_file_t *f)
+{
+	printf("== %s: %zu rows%s\n", f->path, f->rows, f->error ? " (truncated or unreadable records)" : "");
+	printf("%-16s %14s %14s %14s %14s %14s %14s %14s %18s\n", "COLUMN", "MEAN", "STDDEV", "MIN", "P50", "P90", "P99", "MAX", "SUM");
+	for (int c = 0; c < f->num_columns; ++c)
+	{
+		col_stats_t *s = &f->stats[c];
+
+		if (!summarized(f->names[c]) || s->n == 0)
+			continue;
+		if (joules(f->names[c]))
+			printf("%-16s %14.6f %14.6f %14.6f %14.6f %14.6f %14.6f %14.6f %18.3f\n", f->names[c],
+				s->mean, s->stddev, s->min, s->p50, s->p90, s->p99, s->max, s->sum);
+		else if (ratio(f->names[c]))
+			printf("%-16s %14.3f %14.3f %14.3f %14.3f %14.3f %14.3f %14.3f %18s\n", f->names[c],
+				s->mean, s->stddev, s->min, s->p50, s->p90, s->p99, s->max, "-");
+		else
+			printf("%-16s %14.1f %14.1f %14.0f %14.0f %14.0f %14.0f %14.0f %18.0f\n", f->names[c],
+				s->mean, s->stddev, s->min, s->p50, s->p90, s->p99, s->max, s->sum);
+	}
+
+	if (f->num_phases)
+	{
+		printf("Phases (%zu rows per window, IPC change over %.0f%%): %zu\n", window_rows, phase_threshold * 100, f->num_phases);
+		printf("%6s %14s %14s %10s %10s\n", "PHASE", "START_NS", "END_NS", "ROWS", "IPC");
+		for (size_t i = 0; i < f->num_phases; ++i)
+		{
+			phase_t *p = &f->phases[i];
+			printf("%6zu %14.0f %14.0f %10zu %10.3f\n", i, time_at(f, p->first), time_at(f, p->last - 1),
+				p->last - p->first, p->cycles ? p->inst / p->cycles : 0.0);
+		}
+	}
+	if (write_windows)
+	{
+		write_window_log(f);
+	}
+	printf("\n");
+}
+
+/* Statistics over runs */
+
+/* Continued fraction of the incomplete beta function, modified Lentz */
+static double beta_cf(double a, double b, double x)
+{
+	const double tiny = 1e-300;
+	double c = 1, d = 1 - (a + b) * x / (a + 1), h;
+
+	d = 1 / (fabs(d) < tiny ? tiny : d);
+	h = d;
+	for (int m = 1; m <= 300; ++m)
+	{
+		double aa = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+
+		d = 1 + aa * d;
+		c = 1 + aa / c;
+		d = 1 / (fabs(d) < tiny ? tiny : d);
+		c = fabs(c) < tiny ? tiny : c;
+		h *= d * c;
+
+		aa = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+		d = 1 + aa * d;
+		c = 1 + aa / c;
+		d = 1 / (fabs(d) < tiny ? tiny : d);
+		c = fabs(c) < tiny ? tiny : c;
+		h *= d * c;
+		if (fabs(d * c - 1) < 1e-12)
+			break;
+	}
+	return h;
+}
+
+/* Regularized incomplete beta I_x(a, b) */
+static double inc_beta(double a, double b, double x)
+{
+	double front;
+
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+	front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+	if (x < (a + 1) / (a + b + 2))
+		return front * beta_cf(a, b, x) / a;
+	return 1 - front * beta_cf(b, a, 1 - x) / b;
+}
+
+/* Two-sided p-value of Student's t */
+static double t_pvalue(double t, double df)
+{
+	return inc_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+/* Half-width of the 1 - alpha interval in standard errors */
+static double t_critical(double df)
+{
+	double lo = 0, hi = 1e4;
+
+	for (int i = 0; i < 200; ++i)
+	{
+		double mid = (lo + hi) / 2;
+
+		if (t_pvalue(mid, df) > alpha)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo + hi) / 2;
+}
+
+/* One number per run: totals of counts, IPC of the totals, mean of other ratios */
+static double run_value(log_file_t *f, const char *name)
+{
+	int c = find_column(f, name);
+
+	if (strcmp(name, "DURATION_NS") == 0)
+		return f->rows ? time_at(f, f->rows - 1) : NAN;
+	if (strcmp(name, "IPC") == 0)
+	{
+		int inst = find_column(f, "INST_RETIRED");
+		int cycles = find_column(f, "CPU_CLK_CYCLE");
+
+		return (inst >= 0 && cycles >= 0 && f->stats[cycles].sum > 0) ? f->stats[inst].sum / f->stats[cycles].sum : NAN;
+	}
+	if (c < 0 || f->stats[c].n == 0)
+		return NAN;
+	return ratio(name) ? f->stats[c].mean : f->stats[c].sum;
+}
+
+typedef struct {
+	size_t n;
+	double mean, stddev, ci;	// ci is the half-width of the interval
+} run_stats_t;
+
+static run_stats_t group_stats(int first, int num, const char *name)
+{
+	run_stats_t s = { 0 };
+	double sum = 0, dev = 0;
+
+	for (int i = first; i < first + num; ++i)
+	{
+		double v = run_value(&files[i], name);
+		if (!isnan(v))
+		{
+			sum += v;
+			++s.n;
+		}
+	}
+	if (s.n == 0)
+		return s;
+	s.mean = sum / s.n;
+	for (int i = first; i < first + num; ++i)
+	{
+		double v = run_value(&files[i], name);
+		if (!isnan(v))
+			dev += (v - s.mean) * (v - s.mean);
+	}
+	if (s.n > 1)
+	{
+		s.stddev = sqrt(dev / (s.n - 1));
+		s.ci = t_critical(s.n - 1) * s.stddev / sqrt(s.n);
+	}
+	return s;
+}
+
+/* Welch's t-test, unequal variances */
+static double welch_pvalue(run_stats_t a, run_stats_t b)
+{
+	double va = a.stddev * a.stddev / a.n, vb = b.stddev * b.stddev / b.n;
+	double df;
+
+	if (a.n < 2 || b.n < 2)
+		return NAN;
+	if (va + vb == 0)
+		return a.mean == b.mean ? 1 : 0;
+	df = (va + vb) * (va + vb) / (va * va / (a.n - 1) + vb * vb / (b.n - 1));
+	return t_pvalue((b.mean - a.mean) / sqrt(va + vb), df);
+}
+
+static void print_value(const char *name, double v)
+{
+	if (joules(name) || ratio(name))
+		printf(" %14.6f", v);
+	else
+		printf(" %14.0f", v);
+}
+
+/* Metrics of the first log, matched by name in the others */
+static void report_runs(int first_b, int num_b)
+{
+	log_file_t *f = &files[0];
+	int num_a = num_files - num_b;
+	char names[MAX_COLUMNS + 1][32];
+	int num_names = 0;
+
+	for (int c = 0; c < f->num_columns; ++c)
+	{
+		if (summarized(f->names[c]))
+			strcpy(names[num_names++], f->names[c]);
+	}
+	if (find_column(f, "TIME_NS") >= 0)
+		strcpy(names[num_names++], "DURATION_NS");
+
+	if (num_b == 0)
+	{
+		printf("== %d runs, %.0f%% confidence intervals\n", num_a, (1 - alpha) * 100);
+		printf("%-16s %14s %14s %14s %8s\n", "COLUMN", "MEAN", "STDDEV", "CI", "CV%");
+		for (int m = 0; m < num_names; ++m)
+		{
+			run_stats_t s = group_stats(0, num_a, names[m]);
+
+			if (s.n == 0)
+				continue;
+			printf("%-16s", names[m]);
+			print_value(names[m], s.mean);
+			print_value(names[m], s.stddev);
+			print_value(names[m], s.ci);
+			printf(" %8.2f\n", s.mean != 0 ? s.stddev / fabs(s.mean) * 100 : 0.0);
+		}
+		return;
+	}
+
+	printf("== A: %d runs from %s, B: %d runs from %s\n", num_a, files[0].path, num_b, files[first_b].path);
+	printf("%.0f%% confidence intervals, * marks a difference at p < %g (Welch's t-test)\n", (1 - alpha) * 100, alpha);
+	printf("%-16s %14s %14s %14s %14s %9s %10s\n", "COLUMN", "A_MEAN", "A_CI", "B_MEAN", "B_CI", "CHANGE%", "P");
+	for (int m = 0; m < num_names; ++m)
+	{
+		run_stats_t a = group_stats(0, num_a, names[m]);
+		run_stats_t b = group_stats(first_b, num_b, names[m]);
+		double p = welch_pvalue(a, b);
+
+		if (a.n == 0 || b.n == 0)
+			continue;
+		printf("%-16s", names[m]);
+		print_value(names[m], a.mean);
+		print_value(names[m], a.ci);
+		print_value(names[m], b.mean);
+		print_value(names[m], b.ci);
+		printf(" %9.2f %10.4g%s\n", a.mean != 0 ? (b.mean - a.mean) / fabs(a.mean) * 100 : 0.0, p,
+			(!isnan(p) && p < alpha) ? " *" : "");
+	}
+}
+
+/* Runs binned on a common axis of time or instructions, mean and interval of every bin */
+static void write_aligned_log(int first, int num)
+{
+	log_file_t *f0 = &files[first];
+	int cols[MAX_COLUMNS];
+	int num_cols = 0;
+	size_t num_bins = 0;
+	char path[512];
+
+	for (int c = 0; c < f0->num_columns; ++c)
+	{
+		if (summarized(f0->names[c]) && !ratio(f0->names[c]))
+			cols[num_cols++] = c;
+	}
+
+	/* Bin of every row of every run, the last bin sets the length */
+	size_t **bins = calloc(num, sizeof(size_t *));
+	if (bins == NULL)
+		return;
+	for (int r = 0; r < num; ++r)
+	{
+		log_file_t *f = &files[first + r];
+		int key = find_column(f, align == ALIGN_TIME ? "TIME_NS" : "INST_RETIRED");
+		double pos = 0;
+
+		bins[r] = malloc((f->rows ? f->rows : 1) * sizeof(size_t));
+		if (key < 0 || bins[r] == NULL)
+		{
+			fprintf(stderr, "Cannot align %s on %s\n", f->path, align == ALIGN_TIME ? "TIME_NS" : "INST_RETIRED");
+			goto out;
+		}
+		for (size_t i = 0; i < f->rows; ++i)
+		{
+			/* A row belongs to the bin its instructions start in */
+			if (align == ALIGN_TIME)
+				pos = f->col[key][i];
+			bins[r][i] = pos / align_width;
+			if (align == ALIGN_INST)
+				pos += f->col[key][i];
+			if (bins[r][i] + 1 > num_bins)
+				num_bins = bins[r][i] + 1;
+		}
+	}
+
+	double *sum = calloc(num_bins * num_cols, sizeof(double));
+	double *sq = calloc(num_bins * num_cols, sizeof(double));
+	double *run = calloc(num_bins * num_cols, sizeof(double));
+	size_t *reached = calloc(num_bins, sizeof(size_t));
+	if (sum == NULL || sq == NULL || run == NULL || reached == NULL)
+		goto out_free;
+
+	for (int r = 0; r < num; ++r)
+	{
+		log_file_t *f = &files[first + r];
+		size_t last = 0;
+
+		memset(run, 0, num_bins * num_cols * sizeof(double));
+		for (int k = 0; k < num_cols; ++k)
+		{
+			int c = find_column(f, f0->names[cols[k]]);
+
+			if (c < 0)
+				continue;
+			for (size_t i = 0; i < f->rows; ++i)
+				run[bins[r][i] * num_cols + k] += f->col[c][i];
+		}
+		if (f->rows)
+			last = bins[r][f->rows - 1];
+		/* Bins past the end of a shorter run are missing, not zero */
+		for (size_t b = 0; b <= last && f->rows; ++b)
+		{
+			++reached[b];
+			for (int k = 0; k < num_cols; ++k)
+			{
+				sum[b * num_cols + k] += run[b * num_cols + k];
+				sq[b * num_cols + k] += run[b * num_cols + k] * run[b * num_cols + k];
+			}
+		}
+	}
+
+	derived_path(f0->path, "_aligned.csv", path, sizeof(path));
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Error opening file %s: %s\n", path, strerror(errno));
+		goto out_free;
+	}
+	fprintf(fp, "%s,RUNS,", align == ALIGN_TIME ? "START_NS" : "START_INST");
+	for (int k = 0; k < num_cols; ++k)
+		fprintf(fp, "%s_MEAN,%s_CI,", f0->names[cols[k]], f0->names[cols[k]]);
+	fprintf(fp, "\n");
+	for (size_t b = 0; b < num_bins; ++b)
+	{
+		size_t n = reached[b];
+		double t = n > 1 ? t_critical(n - 1) : 0;
+
+		fprintf(fp, "%.0f,%zu,", b * align_width, n);
+		for (int k = 0; k < num_cols; ++k)
+		{
+			double mean = n ? sum[b * num_cols + k] / n : 0;
+			double var = n > 1 ? (sq[b * num_cols + k] - n * mean * mean) / (n - 1) : 0;
+
+			fprintf(fp, joules(f0->names[cols[k]]) ? "%.6f,%.6f," : "%.1f,%.1f,", mean,
+				n > 1 ? t * sqrt(var > 0 ? var : 0) / sqrt(n) : 0.0);
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+	printf("Aligned Log Path: %s\n", path);
+
+out_free:
+	free(sum);
+	free(sq);
+	free(run);
+	free(reached);
+out:
+	for (int r = 0; r < num; ++r)
+		free(bins[r]);
+	free(bins);
+}
+
+static int open_log(log_file_t *f, const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	f->path = path;
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	f->len = st.st_size;
+	f->map = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (f->map == MAP_FAILED)
+	{
+		f->map = NULL;
+		return -1;
+	}
+	madvise((void *)f->map, f->len, MADV_SEQUENTIAL);
+
+	f->binary = (f->len >= sizeof(kleb_log_header_t) && ((const kleb_log_header_t *)f->map)->magic == KLEB_LOG_MAGIC);
+	if ((f->binary ? binary_header(f) : csv_header(f)) < 0)
+		return -1;
+
+	/* Instructions per cycle of every row */
+	if (find_column(f, "INST_RETIRED") >= 0 && find_column(f, "CPU_CLK_CYCLE") >= 0)
+		strcpy(f->names[f->num_columns++], "IPC");
+	return 0;
+}
+
+void usage(void)
+{
+	printf("Usage: kleb-analyze [-j threads] [-w rows] [-W] [-T threshold] [-R runs [-a time:<ns>|inst:<n>] [-p alpha]] <log> [<log>...]\n");
+	printf("  -j  Worker threads, default all CPUs\n");
+	printf("  -w  Rows per window for phase detection, default 100\n");
+	printf("  -W  Write per-window sums to <log>_windows.csv\n");
+	printf("  -T  Relative IPC change that starts a new phase, default 0.2\n");
+	printf("  -R  The logs are repeated runs, the first <runs> of one configuration and the rest of another to compare\n");
+	printf("  -a  Align runs on bins of time or retired instructions into <first log>_aligned.csv\n");
+	printf("  -p  Significance level of the comparison, intervals are at 1 - alpha, default 0.05\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec t0, t1;
+	size_t total_rows = 0;
+	int runs_b = 0;
+	int opt;
+
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:w:WT:R:a:p:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'j':
+				num_threads = atoi(optarg);
+				break;
+			case 'w':
+				window_rows = strtoul(optarg, NULL, 10);
+				break;
+			case 'W':
+				write_windows = 1;
+				break;
+			case 'T':
+				phase_threshold = strtod(optarg, NULL);
+				break;
+			case 'R':
+				runs = atoi(optarg);
+				break;
+			case 'a':
+				if (strncmp(optarg, "time:", 5) == 0)
+					align = ALIGN_TIME;
+				else if (strncmp(optarg, "inst:", 5) == 0)
+					align = ALIGN_INST;
+				align_width = strtod(optarg + 5, NULL);
+				break;
+			case 'p':
+				alpha = strtod(optarg, NULL);
+				break;
+			default:
+				usage();
+				exit(0);
+		}
+	}
+	if (optind >= argc || num_threads < 1 || window_rows == 0 || runs < 0 || alpha <= 0 || alpha >= 1 ||
+		(align && (!runs || align_width <= 0)))
+	{
+		usage();
+		exit(0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (int i = optind; i < argc && num_files < MAX_FILES; ++i)
+	{
+		if (open_log(&files[num_files], argv[i]) < 0)
+		{
+			fprintf(stderr, "Cannot read K-LEB log %s\n", argv[i]);
+			if (files[num_files].map)
+				munmap((void *)files[num_files].map, files[num_files].len);
+			memset(&files[num_files], 0, sizeof(files[0]));
+			continue;
+		}
+		if (runs && i - optind >= runs)
+			++runs_b;
+		++num_files;
+	}
+	tasks = malloc(sizeof(task_t) * num_files * (MAX_CHUNKS + MAX_COLUMNS));
+	if (tasks == NULL)
+	{
+		perror("Error: ");
+		exit(-1);
+	}
+
+	/* Count rows of every chunk */
+	for (int i = 0; i < num_files; ++i)
+	{
+		for (int k = 0; k < files[i].num_chunks; ++k)
+			add_task(i, k);
+	}
+	run_tasks(count_rows);
+
+	/* Place every chunk in the columns of its file */
+	for (int i = 0; i < num_files; ++i)
+	{
+		log_file_t *f = &files[i];
+
+		for (int k = 0; k < f->num_chunks; ++k)
+		{
+			f->chunk_row0[k] = f->rows;
+			f->rows += f->chunk_rows[k];
+		}
+		for (int c = 0; c < f->num_columns; ++c)
+		{
+			f->col[c] = malloc((f->rows ? f->rows : 1) * sizeof(double));
+			if (f->col[c] == NULL)
+			{
+				fprintf(stderr, "Not enough memory for %s\n", f->path);
+				exit(-1);
+			}
+		}
+		for (int k = 0; k < f->num_chunks; ++k)
+			add_task(i, k);
+	}
+	run_tasks(parse_rows);
+
+	for (int i = 0; i < num_files; ++i)
+		add_task(i, 0);
+	run_tasks(derive_columns);
+
+	/* One task per column, phases per file */
+	for (int i = 0; i < num_files; ++i)
+	{
+		for (int c = 0; c < files[i].num_columns; ++c)
+		{
+			if (summarized(files[i].names[c]))
+				add_task(i, c);
+		}
+	}
+	run_tasks(column_stats);
+	for (int i = 0; i < num_files; ++i)
+		add_task(i, 0);
+	run_tasks(file_phases);
+
+	for (int i = 0; i < num_files; ++i)
+	{
+		if (!runs)
+			report(&files[i]);
+		total_rows += files[i].rows;
+	}
+	if (runs && num_files)
+	{
+		report_runs(num_files - runs_b, runs_b);
+		if (align)
+		{
+			write_aligned_log(0, num_files - runs_b);
+			if (runs_b)
+				write_aligned_log(num_files - runs_b, runs_b);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stderr, "%d files, %zu rows in %.3f s on %d threads\n", num_files, total_rows,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, num_threads);
+	return 0;
+}
@@ -0,0 +1,737 @@
+/* Copyright (c) 2017, 2024 James Bruska, Caleb DeLaBruere, Chutitep Woralert
+
+This file is part of K-LEB.
+
+K-LEB is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+K-LEB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* kleb-daemon: always-on K-LEB collector.
+   Records system-wide or the processes of a cgroup until stopped, rotates
+   its logs by time or size, keeps their total size under a cap, reloads its
+   configuration on SIGHUP, releases the device on SIGUSR1 so the module can
+   be reloaded, reconnects to the new module and backs off to stay within a
+   CPU budget. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include "libkleb.h"
+
+#define MAX_LOGS 4096
+#define BUDGET_WINDOW_S 10	// CPU use is measured over this many seconds
+#define RECONNECT_S 1		// Retry period while the module or the cgroup is missing
+
+/* Reloaded from the configuration file on SIGHUP */
+typedef struct {
+	char events[256];	// Event list as for ioctl_start -e
+	double period_ms;
+	char cpus[256];		// CPU list, empty is all
+	char cgroup[256];	// cgroup directory, empty is system-wide
+	int per_cpu;
+	int binary;
+	char dir[200];		// Log directory
+	unsigned long rotate_s;	// Rotate after this many seconds, 0 never
+	unsigned long long rotate_bytes;	// Rotate past this size, 0 never
+	unsigned long long cap_bytes;	// Total size of the logs kept, 0 unbounded
+	double budget;		// Collector CPU time in percent of one CPU, 0 unbounded
+} daemon_config_t;
+
+static daemon_config_t config;
+static char config_path[256];
+static int detached;
+static volatile sig_atomic_t stopping, reloading, releasing;
+static int released;	// Device closed for a module reload
+
+/* Current session and log */
+static kleb_session_t *session;
+static dev_t session_dev;	// Device node the session was opened on
+static ino_t session_ino;
+static int targets[MAX_TARGETS];
+static int num_targets;
+static FILE *logfp;
+static char log_path[512];
+static time_t log_opened;
+static unsigned long long log_bytes;
+static unsigned long long old_bytes;	// Size of the other logs kept, as of the last enforce_cap
+static int num_counters;
+
+/* CPU budget */
+static double period_ms;	// Period in use, lengthened beyond the configured one when over budget
+static unsigned long long drain_ns;
+static struct timespec budget_wall, budget_cpu;
+
+static void disconnect_module(int graceful);
+static void enforce_cap(unsigned long long incoming);
+
+static void note(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (detached)
+	{
+		vsyslog(LOG_INFO, fmt, ap);
+	}
+	else
+	{
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+	}
+	va_end(ap);
+}
+
+static void on_signal(int sig)
+{
+	if (sig == SIGHUP)
+		reloading = 1;
+	else if (sig == SIGUSR1)
+		releasing = 1;
+	else
+		stopping = 1;
+}
+
+static double elapsed_s(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* key = value lines, # starts a comment */
+static int load_config(const char *path, daemon_config_t *c)
+{
+	char line[512];
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL)
+	{
+		note("Cannot read %s: %s", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char key[64], value[256] = "";
+
+		line[strcspn(line, "#\n")] = '\0';
+		if (sscanf(line, " %63[^= ] = %255[^\n]", key, value) < 1)
+			continue;
+		value[strcspn(value, " \t")] = '\0';
+		if (strcmp(key, "events") == 0)
+			snprintf(c->events, sizeof(c->events), "%s", value);
+		else if (strcmp(key, "period_ms") == 0)
+			c->period_ms = strtod(value, NULL);
+		else if (strcmp(key, "cpus") == 0)
+			snprintf(c->cpus, sizeof(c->cpus), "%s", value);
+		else if (strcmp(key, "cgroup") == 0)
+			snprintf(c->cgroup, sizeof(c->cgroup), "%s", value);
+		else if (strcmp(key, "per_cpu") == 0)
+			c->per_cpu = atoi(value);
+		else if (strcmp(key, "binary") == 0)
+			c->binary = atoi(value);
+		else if (strcmp(key, "dir") == 0)
+			snprintf(c->dir, sizeof(c->dir), "%s", value);
+		else if (strcmp(key, "rotate_s") == 0)
+			c->rotate_s = strtoul(value, NULL, 10);
+		else if (strcmp(key, "rotate_mb") == 0)
+			c->rotate_bytes = strtoull(value, NULL, 10) << 20;
+		else if (strcmp(key, "cap_mb") == 0)
+			c->cap_bytes = strtoull(value, NULL, 10) << 20;
+		else if (strcmp(key, "budget") == 0)
+			c->budget = strtod(value, NULL);
+		else
+			note("Unknown setting %s in %s", key, path);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int check_config(const daemon_config_t *c)
+{
+	if (c->period_ms <= 0)
+	{
+		note("The period must be positive");
+		return -1;
+	}
+	if (c->cap_bytes && c->rotate_bytes > c->cap_bytes)
+	{
+		note("The rotation size of %llu MB is over the cap of %llu MB", c->rotate_bytes >> 20, c->cap_bytes >> 20);
+		return -1;
+	}
+	return 0;
+}
+
+/* Top processes of the cgroup, their descendants are followed by the module */
+static int cgroup_targets(int *pids)
+{
+	char path[300];
+	int all[4096];
+	int num_all = 0, num = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/cgroup.procs", config.cgroup);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while (num_all < 4096 && fscanf(fp, "%d", &all[num_all]) == 1)
+		num_all++;
+	fclose(fp);
+
+	for (int i = 0; i < num_all; ++i)
+	{
+		char stat[300];
+		int ppid = 0, in_cgroup = 0;
+
+		snprintf(path, sizeof(path), "/proc/%d/stat", all[i]);
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		/* The command may hold spaces and parentheses, ppid follows the last ')' */
+		if (fgets(stat, sizeof(stat), fp) != NULL && strrchr(stat, ')') != NULL)
+			sscanf(strrchr(stat, ')') + 1, " %*c %d", &ppid);
+		fclose(fp);
+		for (int j = 0; j < num_all && !in_cgroup; ++j)
+			in_cgroup = (all[j] == ppid);
+		if (in_cgroup)
+			continue;
+		if (num == MAX_TARGETS)
+		{
+			note("cgroup %s has more than %d top processes, the others are not monitored", config.cgroup, MAX_TARGETS);
+			break;
+		}
+		pids[num++] = all[i];
+	}
+	return num;
+}
+
+static int targets_alive(void)
+{
+	for (int i = 0; i < num_targets; ++i)
+	{
+		if (kill(targets[i], 0) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* kleb-<date>-<time>.csv in the log directory */
+static int open_log(void)
+{
+	char stamp[32];
+	time_t now = time(NULL);
+	kleb_ioctl_args_t *args = kleb_session_args(session);
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+	for (int n = 0; n < 100; ++n)
+	{
+		if (n == 0)
+			snprintf(log_path, sizeof(log_path), "%s/kleb-%s%s", config.dir, stamp, config.binary ? ".kleb" : ".csv");
+		else
+			snprintf(log_path, sizeof(log_path), "%s/kleb-%s-%d%s", config.dir, stamp, n, config.binary ? ".kleb" : ".csv");
+		if (access(log_path, F_OK) != 0)
+			break;
+	}
+	logfp = fopen(log_path, "w");
+	if (logfp == NULL)
+	{
+		note("Cannot open %s: %s", log_path, strerror(errno));
+		return -1;
+	}
+	log_opened = now;
+	log_bytes = 0;
+
+	if (config.binary)
+	{
+		kleb_log_header_t hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = KLEB_LOG_MAGIC;
+		hdr.version = 1;
+		hdr.num_events = args->num_events;
+		memcpy(hdr.counter, args->counter, sizeof(hdr.counter));
+		fwrite(&hdr, sizeof(hdr), 1, logfp);
+		log_bytes += sizeof(hdr);
+	}
+	else
+	{
+		for (unsigned int j = 0; j < args->num_events; ++j)
+			log_bytes += fprintf(logfp, "%x,", args->counter[j]);
+		log_bytes += fprintf(logfp, "INST_RETIRED,CPU_CLK_CYCLE,CPU_REF_CYCLE,PERIOD_NS,REGION,CPU,TIME_NS,LOST,TARGET,\n");
+	}
+	/* Older logs may fill the cap already */
+	enforce_cap(0);
+	return 0;
+}
+
+static int log_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Remove the oldest logs until they fit the cap next to the current log and
+   incoming bytes about to be written to it, the current log is kept */
+static void enforce_cap(unsigned long long incoming)
+{
+	char *names[MAX_LOGS];
+	unsigned long long sizes[MAX_LOGS], total = 0;
+	int num = 0;
+	DIR *dir;
+	struct dirent *de;
+
+	if (config.cap_bytes == 0 || (dir = opendir(config.dir)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL && num < MAX_LOGS)
+	{
+		char path[512];
+		struct stat st;
+		size_t len = strlen(de->d_name);
+
+		if (strncmp(de->d_name, "kleb-", 5) != 0 ||
+			!((len > 4 && strcmp(de->d_name + len - 4, ".csv") == 0) || (len > 5 && strcmp(de->d_name + len - 5, ".kleb") == 0)))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", config.dir, de->d_name);
+		/* The current log counts as written, stat misses what is still buffered */
+		if ((logfp != NULL && strcmp(path, log_path) == 0) || stat(path, &st) != 0)
+			continue;
+		names[num] = strdup(path);
+		if (names[num] == NULL)
+			break;
+		num++;
+	}
+	closedir(dir);
+	/* Names sort by time */
+	qsort(names, num, sizeof(names[0]), log_cmp);
+	for (int i = 0; i < num; ++i)
+	{
+		struct stat st;
+
+		sizes[i] = (stat(names[i], &st) == 0) ? st.st_size : 0;
+		total += sizes[i];
+	}
+	if (logfp != NULL)
+		incoming += log_bytes;
+	for (int i = 0; i < num && total + incoming > config.cap_bytes; ++i)
+	{
+		if (unlink(names[i]) == 0)
+		{
+			total -= sizes[i];
+			note("Removed %s to stay under %llu MB", names[i], config.cap_bytes >> 20);
+		}
+	}
+	for (int i = 0; i < num; ++i)
+		free(names[i]);
+	old_bytes = total;
+}
+
+static void new_log(void)
+{
+	if (logfp != NULL)
+	{
+		fclose(logfp);
+		logfp = NULL;
+	}
+	enforce_cap(0);
+	if (session != NULL)
+		open_log();
+}
+
+static void rotate(void)
+{
+	int pids[MAX_TARGETS];
+
+	/* Processes that joined the cgroup since start need a new session */
+	if (config.cgroup[0])
+	{
+		int num = cgroup_targets(pids);
+
+		if (num != num_targets || memcmp(pids, targets, num * sizeof(int)) != 0)
+		{
+			disconnect_module(1);
+			enforce_cap(0);
+			return;
+		}
+	}
+	new_log();
+}
+
+/* Room for bytes about to be written to the current log, dropping old logs or
+   starting a new one before the cap is exceeded */
+static int log_room(unsigned long long bytes)
+{
+	if (config.cap_bytes == 0 || old_bytes + log_bytes + bytes <= config.cap_bytes)
+		return 1;
+	enforce_cap(bytes);
+	if (old_bytes + log_bytes + bytes <= config.cap_bytes)
+		return 1;
+	/* The current log alone fills the cap */
+	new_log();
+	if (logfp == NULL)
+		return 0;
+	enforce_cap(bytes);
+	return old_bytes + log_bytes + bytes <= config.cap_bytes;
+}
+
+static int log_sample(const kleb_sample_t *sample, void *ctx)
+{
+	const kleb_record_t *rec = sample->rec;
+
+	(void)ctx;
+	if (logfp == NULL || rec->type != REC_SAMPLE)
+		return 0;
+	if (config.binary)
+	{
+		if (!log_room((sample->lost ? RECORD_WORDS(1) : 0) * sizeof(unsigned long long) + rec->size * sizeof(unsigned long long)))
+			return 0;
+		if (sample->lost)
+		{
+			unsigned long long lost[RECORD_WORDS(1)];
+			kleb_record_t *lost_rec = (kleb_record_t *)lost;
+
+			*lost_rec = *rec;
+			lost_rec->type = REC_LOST;
+			lost_rec->size = RECORD_WORDS(1);
+			lost[RECORD_HDR_WORDS] = sample->lost;
+			fwrite(lost, sizeof(lost), 1, logfp);
+			log_bytes += sizeof(lost);
+		}
+		fwrite(rec, sizeof(unsigned long long), rec->size, logfp);
+		log_bytes += rec->size * sizeof(unsigned long long);
+		return 0;
+	}
+	/* The row is formatted first so its size is known against the cap */
+	char row[4096];
+	int len = 0;
+
+	for (int j = 0; j < num_counters && len < (int)sizeof(row); ++j)
+		len += snprintf(row + len, sizeof(row) - len, "%llu,", sample->counters[j]);
+	if (len < (int)sizeof(row))
+		len += snprintf(row + len, sizeof(row) - len, "%u,%u,%d,%llu,%llu,%d,\n", rec->period_ns, rec->region, rec->cpu, rec->time_ns, sample->lost,
+			(num_targets && rec->group < num_targets) ? targets[rec->group] : -1);
+	if (len >= (int)sizeof(row) || !log_room(len))
+		return 0;
+	fwrite(row, 1, len, logfp);
+	log_bytes += len;
+	return 0;
+}
+
+/* Drain at a fraction of the ring, as ioctl_start does */
+static void reset_drain(void)
+{
+	drain_ns = (unsigned long long)(period_ms * 1e6) * 60;
+}
+
+/* Open the device and start recording with the current configuration */
+static int connect_module(void)
+{
+	struct stat st;
+	int ret;
+
+	if (config.cgroup[0])
+	{
+		num_targets = cgroup_targets(targets);
+		if (num_targets <= 0)
+			return -1;
+	}
+	else
+	{
+		num_targets = 0;
+	}
+	session = kleb_session_open();
+	if (session == NULL)
+		return -1;
+	if (stat(DEVICE_PATH, &st) == 0)
+	{
+		session_dev = st.st_rdev;
+		session_ino = st.st_ino;
+	}
+
+	kleb_ioctl_args_t *args = kleb_session_args(session);
+	char events[256];
+
+	snprintf(events, sizeof(events), "%s", config.events);
+	for (char *event = strtok(events, ","); event != NULL; event = strtok(NULL, ","))
+	{
+		if (kleb_add_event(session, event) < 0)
+			note("Ignoring event %s", event);
+	}
+	kleb_set_period_ns(session, period_ms * 1000000);
+	if (config.cpus[0] && kleb_set_cpu_list(session, config.cpus) < 0)
+		note("Ignoring CPU list %s", config.cpus);
+	args->per_cpu = config.per_cpu && !num_targets;
+	for (int i = 0; i < num_targets; ++i)
+		kleb_add_target(session, targets[i]);
+
+	ret = kleb_start(session, 1);
+	if (ret < 0)
+	{
+		note("Cannot start K-LEB: %s", strerror(-ret));
+		kleb_session_close(session);
+		session = NULL;
+		return -1;
+	}
+	num_counters = kleb_num_counters(session);
+	if (num_targets)
+		note("Monitoring %d processes of %s every %.3f ms", num_targets, config.cgroup, period_ms);
+	else
+		note("Monitoring the system every %.3f ms", period_ms);
+	return open_log();
+}
+
+/* Stop and take the last samples, or drop the session of a module that went away */
+static void disconnect_module(int graceful)
+{
+	if (session == NULL)
+		return;
+	if (graceful)
+	{
+		kleb_stop(session);
+		kleb_drain(session, log_sample, NULL);
+	}
+	kleb_session_close(session);
+	session = NULL;
+	if (logfp != NULL)
+	{
+		fclose(logfp);
+		logfp = NULL;
+	}
+}
+
+/* The device node is gone or belongs to a newly loaded module */
+static int module_changed(void)
+{
+	struct stat st;
+
+	if (stat(DEVICE_PATH, &st) != 0)
+		return 1;
+	return st.st_rdev != session_dev || st.st_ino != session_ino;
+}
+
+/* Back off the drain interval, then the period, while the collector runs over budget */
+static void check_budget(void)
+{
+	struct timespec wall, cpu;
+	double usage;
+	unsigned long long max_drain = (unsigned long long)(period_ms * 1e6) * NUM_RECORDINGS / 4;
+
+	if (config.budget <= 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	if (elapsed_s(&budget_wall, &wall) < BUDGET_WINDOW_S)
+		return;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	usage = 100 * elapsed_s(&budget_cpu, &cpu) / elapsed_s(&budget_wall, &wall);
+	budget_wall = wall;
+	budget_cpu = cpu;
+
+	if (usage > config.budget)
+	{
+		if (drain_ns < max_drain)
+		{
+			drain_ns = (drain_ns * 2 < max_drain) ? drain_ns * 2 : max_drain;
+		}
+		else
+		{
+			/* Draining less often is not enough, sample less often */
+			period_ms *= 2;
+			note("CPU use %.2f%% over budget %.2f%%, period now %.3f ms", usage, config.budget, period_ms);
+			disconnect_module(1);
+			reset_drain();
+		}
+	}
+	else if (usage < config.budget / 4 && period_ms > config.period_ms)
+	{
+		period_ms = (period_ms / 2 > config.period_ms) ? period_ms / 2 : config.period_ms;
+		note("CPU use %.2f%% well under budget, period back to %.3f ms", usage, period_ms);
+		disconnect_module(1);
+		reset_drain();
+	}
+}
+
+static void usage(void)
+{
+	printf("Usage: kleb-daemon [-f config] [-d dir] [-e events] [-t ms] [-C cpus] [-g cgroup] [--per-cpu] [-B]\n");
+	printf("                   [-r seconds] [-s MB] [-c MB] [-b percent] [-D]\n");
+	printf("  -f  Configuration file, read again on SIGHUP\n");
+	printf("  -d  Log directory, default .\n");
+	printf("  -g  Monitor the processes of a cgroup directory instead of the system\n");
+	printf("  -r  Rotate the log every number of seconds\n");
+	printf("  -s  Rotate the log past a size in MB\n");
+	printf("  -c  Keep the logs under a total size in MB\n");
+	printf("  -b  CPU budget in percent of one CPU\n");
+	printf("  -D  Detach and report to syslog\n");
+	printf("SIGHUP reloads the configuration, SIGUSR1 closes the device until the module is reloaded\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	daemon_config_t base;
+
+	memset(&config, 0, sizeof(config));
+	snprintf(config.events, sizeof(config.events), "00c4,00c5");
+	config.period_ms = 10;
+	snprintf(config.dir, sizeof(config.dir), ".");
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *opt = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(opt, "--per-cpu") == 0)
+			config.per_cpu = 1;
+		else if (strcmp(opt, "-B") == 0)
+			config.binary = 1;
+		else if (strcmp(opt, "-D") == 0)
+			detached = 1;
+		else if (opt[0] == '-' && opt[1] && strchr("fdetCgrscb", opt[1]) && val != NULL)
+		{
+			switch (opt[1])
+			{
+				case 'f': snprintf(config_path, sizeof(config_path), "%s", val); break;
+				case 'd': snprintf(config.dir, sizeof(config.dir), "%s", val); break;
+				case 'e': snprintf(config.events, sizeof(config.events), "%s", val); break;
+				case 't': config.period_ms = strtod(val, NULL); break;
+				case 'C': snprintf(config.cpus, sizeof(config.cpus), "%s", val); break;
+				case 'g': snprintf(config.cgroup, sizeof(config.cgroup), "%s", val); break;
+				case 'r': config.rotate_s = strtoul(val, NULL, 10); break;
+				case 's': config.rotate_bytes = strtoull(val, NULL, 10) << 20; break;
+				case 'c': config.cap_bytes = strtoull(val, NULL, 10) << 20; break;
+				case 'b': config.budget = strtod(val, NULL); break;
+			}
+			++i;
+		}
+		else
+		{
+			usage();
+			exit(0);
+		}
+	}
+	/* The file overrides the command line, again on every SIGHUP */
+	base = config;
+	if (config_path[0] && load_config(config_path, &config) < 0)
+		exit(1);
+	if (check_config(&config) < 0)
+		exit(1);
+
+	if (detached)
+	{
+		if (daemon(1, 0) < 0)
+		{
+			perror("daemon");
+			exit(1);
+		}
+		openlog("kleb-daemon", LOG_PID, LOG_DAEMON);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	period_ms = config.period_ms;
+	reset_drain();
+	clock_gettime(CLOCK_MONOTONIC, &budget_wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &budget_cpu);
+
+	while (!stopping)
+	{
+		struct timespec wait;
+
+		if (reloading)
+		{
+			/* New events and limits take effect with a new session and a new log */
+			daemon_config_t next = base;
+
+			reloading = 0;
+			if ((!config_path[0] || load_config(config_path, &next) == 0) && check_config(&next) == 0)
+			{
+				note("Reloading configuration");
+				disconnect_module(1);
+				enforce_cap(0);
+				config = next;
+				period_ms = config.period_ms;
+				reset_drain();
+			}
+		}
+		if (releasing)
+		{
+			/* The open device pins the module, let go of it until a new one is loaded */
+			releasing = 0;
+			released = !released;
+			if (released)
+			{
+				note("Releasing the device until the module is reloaded");
+				disconnect_module(1);
+				enforce_cap(0);
+			}
+			else
+			{
+				note("Resuming");
+			}
+		}
+		if (released)
+		{
+			if (access(DEVICE_PATH, F_OK) != 0 || !module_changed())
+			{
+				sleep(RECONNECT_S);
+				continue;
+			}
+			note("K-LEB module reloaded, reconnecting");
+			released = 0;
+		}
+		if (session == NULL)
+		{
+			if (connect_module() < 0)
+			{
+				disconnect_module(session != NULL);
+				sleep(RECONNECT_S);
+				continue;
+			}
+		}
+
+		wait.tv_sec = drain_ns / 1000000000;
+		wait.tv_nsec = drain_ns % 1000000000;
+		kleb_wait(session, &wait);
+		if (kleb_drain(session, log_sample, NULL) < 0 || module_changed())
+		{
+			note("K-LEB module went away, reconnecting");
+			disconnect_module(0);
+			continue;
+		}
+		if (logfp != NULL)
+			fflush(logfp);
+
+		if ((config.rotate_s && time(NULL) - log_opened >= (time_t)config.rotate_s) ||
+			(config.rotate_bytes && log_bytes >= config.rotate_bytes))
+		{
+			rotate();
+		}
+		/* Targets gone, pick up the processes now in the cgroup */
+		if (num_targets && !targets_alive())
+		{
+			disconnect_module(1);
+			enforce_cap(0);
+			continue;
+		}
+		check_budget();
+	}
+	disconnect_module(1);
+	enforce_cap(0);
+	note("Stopped");
+	return 0;
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2017, 2024 James Bruska, Caleb DeLaBruere, Chutitep Woralert
+
+This file is part of K-LEB.
+
+K-LEB is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+K-LEB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* Region of interest markers for programs monitored with ioctl_start -r
+ *
+ *	kleb_region_begin(1);
+ *	handle_request();
+ *	kleb_region_end(1);
+ *
+ * Samples taken while no region is open are discarded by the module. */
+
+#ifndef KLEB_MARKER_H
+#define KLEB_MARKER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "kleb.h"
+
+static int kleb_marker_fd = -1;
+
+/* Open the device once, markers are no-ops if K-LEB is not loaded */
+static inline int kleb_marker_open(void)
+{
+	if (kleb_marker_fd < 0)
+	{
+		kleb_marker_fd = open(DEVICE_PATH, O_RDWR);
+	}
+	return kleb_marker_fd;
+}
+
+static inline int kleb_region_begin(unsigned int label)
+{
+	if (kleb_marker_open() < 0)
+	{
+		return -1;
+	}
+	return ioctl(kleb_marker_fd, IOCTL_REGION_BEGIN, label);
+}
+
+static inline int kleb_region_end(unsigned int label)
+{
+	if (kleb_marker_fd < 0)
+	{
+		return -1;
+	}
+	return ioctl(kleb_marker_fd, IOCTL_REGION_END, label);
+}
+
+static inline void kleb_marker_close(void)
+{
+	if (kleb_marker_fd >= 0)
+	{
+		close(kleb_marker_fd);
+		kleb_marker_fd = -1;
+	}
+}
+
+#endif // KLEB_MARKER_H
@@ -0,0 +1,82 @@
+/* Copyright (c) 2017, 2024 James Bruska, Caleb DeLaBruere, Chutitep Woralert
+
+This file is part of K-LEB.
+
+K-LEB is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+K-LEB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* kleb_rdpmc: read the counters of a K-LEB rdpmc session (ioctl_start --rdpmc)
+   from the monitored program, without a system call.
+   Counters are in the order of the log: configured events then instructions,
+   cycles and reference cycles. A read outside of a session raises SIGSEGV.
+   Counters are per CPU, pin the thread when a region may migrate. */
+#ifndef KLEB_RDPMC_H
+#define KLEB_RDPMC_H
+
+#include <cpuid.h>
+
+#define KLEB_RDPMC_FIXED (1U << 30)	// Index of fixed counter 0
+#define KLEB_RDPMC_MAX 7		// 4 events and 3 fixed counters
+
+typedef struct {
+	unsigned int num;
+	unsigned int index[KLEB_RDPMC_MAX];
+	unsigned long long mask[KLEB_RDPMC_MAX];	// Counter width
+	unsigned long long start[KLEB_RDPMC_MAX];
+} kleb_rdpmc_t;
+
+static inline unsigned long long kleb_rdpmc(unsigned int index)
+{
+	unsigned int lo, hi;
+
+	__asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index));
+	return ((unsigned long long)hi << 32) | lo;
+}
+
+/* Counters of a session with num_events configured events */
+static inline void kleb_rdpmc_init(kleb_rdpmc_t *r, unsigned int num_events)
+{
+	unsigned int eax = 0, ebx, ecx, edx = 0;
+	unsigned int pmc_width, fixed_width;
+
+	__get_cpuid(0xa, &eax, &ebx, &ecx, &edx);
+	pmc_width = ((eax >> 16) & 0xff) ? ((eax >> 16) & 0xff) : 48;
+	fixed_width = ((edx >> 5) & 0xff) ? ((edx >> 5) & 0xff) : 48;
+
+	if (num_events > KLEB_RDPMC_MAX - 3)
+		num_events = KLEB_RDPMC_MAX - 3;
+	r->num = num_events + 3;
+	for (unsigned int i = 0; i < r->num; i++)
+	{
+		int fixed = i >= num_events;
+
+		r->index[i] = fixed ? (KLEB_RDPMC_FIXED | (i - num_events)) : i;
+		r->mask[i] = (1ULL << (fixed ? fixed_width : pmc_width)) - 1;
+	}
+}
+
+/* Start of a region */
+static inline void kleb_rdpmc_begin(kleb_rdpmc_t *r)
+{
+	for (unsigned int i = 0; i < r->num; i++)
+		r->start[i] = kleb_rdpmc(r->index[i]);
+}
+
+/* Counts since kleb_rdpmc_begin into counts[r->num] */
+static inline void kleb_rdpmc_end(const kleb_rdpmc_t *r, unsigned long long *counts)
+{
+	for (unsigned int i = 0; i < r->num; i++)
+		counts[i] = (kleb_rdpmc(r->index[i]) - r->start[i]) & r->mask[i];
+}
+
+#endif
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Run a program several times under K-LEB and summarize the runs with kleb-analyze -R.
+# Usage: sudo ./kleb_runs.sh -n <runs> -d <log dir> [-c <baseline log dir>] [-a time:<ns>|inst:<n>] [-p alpha] -- <ioctl_start options> <program> [args]
+here=$(dirname "$0")
+runs=5
+dir=./runs
+baseline=""
+analyze=()
+
+while getopts "n:d:c:a:p:" opt; do
+	case $opt in
+	n) runs=$OPTARG ;;
+	d) dir=$OPTARG ;;
+	c) baseline=$OPTARG ;;
+	a) analyze+=(-a "$OPTARG") ;;
+	p) analyze+=(-p "$OPTARG") ;;
+	*) sed -n 3p "$0"; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+	sed -n 3p "$0"
+	exit 1
+fi
+
+# Every run must write one log, run_<n>.csv, not one per process or event group
+for ((i = 1; i <= $#; i++)); do
+	arg=${!i}
+	case $arg in
+	-p|-G)
+		echo "kleb_runs.sh cannot collect the per-process or per-group logs of $arg"
+		exit 1 ;;
+	-t|-u|-C|-O|-L|-M|-A|-o|-m|-e|-g) i=$((i + 1)) ;;
+	-*) ;;
+	*) break ;;
+	esac
+done
+mkdir -p "$dir"
+
+# Same options every run, only the log changes
+for run in $(seq "$runs"); do
+	echo "== Run $run of $runs"
+	"$here/ioctl_start" -o "$dir/run_$run.csv" "$@" > "$dir/run_$run.out"
+	grep "# of Sample\|Samples lost" "$dir/run_$run.out"
+done
+
+# Baseline runs first, kleb-analyze compares the two groups
+logs=()
+if [ -n "$baseline" ]; then
+	for ((run = 1; ; run++)); do
+		[ -f "$baseline/run_$run.csv" ] || break
+		logs+=("$baseline/run_$run.csv")
+	done
+	if [ ${#logs[@]} -eq 0 ]; then
+		echo "No runs in $baseline"
+		exit 1
+	fi
+fi
+first=${#logs[@]}
+if [ "$first" -eq 0 ]; then
+	first=$runs
+fi
+for run in $(seq "$runs"); do
+	logs+=("$dir/run_$run.csv")
+done
+"$here/kleb-analyze" -R "$first" "${analyze[@]}" "${logs[@]}"
@@ -0,0 +1,624 @@
+/* Copyright (c) 2017, 2024 James Bruska, Caleb DeLaBruere, Chutitep Woralert
+
+This file is part of K-LEB.
+
+K-LEB is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+K-LEB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+#define _GNU_SOURCE	// ppoll, sched_setaffinity
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <elf.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include "libkleb.h"
+
+#define KLEB_MAX_RECORD_WORDS 512	// Copy of a record in overwrite mode
+
+struct kleb_session {
+	int fd;
+	int started;
+	kleb_ioctl_args_t args;
+
+	/* Functions attributed through uprobes */
+	kleb_uprobe_args_t uprobes[MAX_UPROBES];
+	char names[MAX_UPROBES][128];
+	int num_uprobes;
+
+	/* Mapped ring */
+	void *map;
+	size_t map_len;
+	const kleb_ring_ctrl_t *ctrl;
+	const unsigned long long *data;
+	unsigned long long size;	// Words
+	unsigned long long pos;		// Next record to hand out
+	unsigned long long released;	// Position handed back to the module
+	unsigned long long lost;	// Samples lost since the last sample
+	unsigned long long reported;	// Overwritten samples already counted
+	unsigned long long scratch[KLEB_MAX_RECORD_WORDS];
+};
+
+/* Convert event name to event code */
+unsigned int kleb_event_code(const char* event_name)
+{
+	/* Branch Events **/
+	if      (strcmp(event_name,"BR_RET") == 0) return BR_RET;
+	else if (strcmp(event_name,"BR_MISP_RET") == 0) return BR_MISP_RET;
+	else if (strcmp(event_name,"BR_EXEC") == 0) return BR_EXEC;
+	else if (strcmp(event_name,"MISP_BR_ANY") == 0) return MISP_BR_ANY;
+	else if (strcmp(event_name,"MISP_BR_UN") == 0) return MISP_BR_UN;
+	else if (strcmp(event_name,"MISP_BR_C") == 0) return MISP_BR_C;
+	/** Cache Events **/
+	else if (strcmp(event_name,"LOAD") == 0) return LOAD;
+	else if (strcmp(event_name,"STORE") == 0) return STORE;
+	else if (strcmp(event_name,"L1_ICACHE_STALL") == 0) return L1_ICACHE_STALL;
+	else if (strcmp(event_name,"L1_ICACHE_REF") == 0) return L1_ICACHE_REF;
+	else if (strcmp(event_name,"L1_ICACHE_MISS") == 0) return L1_ICACHE_MISS;
+	else if (strcmp(event_name,"L1_ICACHE_HIT") == 0) return L1_ICACHE_HIT;
+	else if (strcmp(event_name,"L1_DCACHE_REF") == 0) return L1_DCACHE_REF;
+	else if (strcmp(event_name,"L1_DCACHE_MISS") == 0) return L1_DCACHE_MISS;
+	else if (strcmp(event_name,"L1_DCACHE_HIT") == 0) return L1_DCACHE_HIT;
+	else if (strcmp(event_name,"L2_DATA_REF") == 0) return L2_DATA_REF;
+	else if (strcmp(event_name,"L2_DATA_HIT") == 0) return L2_DATA_HIT;
+	else if (strcmp(event_name,"LLC") == 0) return LLC;
+	else if (strcmp(event_name,"MISS_LLC") == 0) return MISS_LLC;
+	else if (strcmp(event_name,"MEM_LOAD_RETIRED_LLC_MISS") == 0) return MEM_LOAD_RETIRED_LLC_MISS;
+	/** Instruction Events **/
+	else if (strcmp(event_name,"INST_FP") == 0) return INST_FP;
+	else if (strcmp(event_name,"ARITH_MULT") == 0) return ARITH_MULT;
+	else if (strcmp(event_name,"ARITH_DIV") == 0) return ARITH_DIV;
+	/** Proc calls Events **/
+	else if (strcmp(event_name,"CALL") == 0) return CALL;
+	else if (strcmp(event_name,"CALL_D_EXEC") == 0) return CALL_D_EXEC;
+	else if (strcmp(event_name,"CALL_ID_EXEC") == 0) return CALL_ID_EXEC;
+	else if (strcmp(event_name,"MISP_CALL") == 0) return MISP_CALL;
+	/** TLB Events **/
+	else if (strcmp(event_name,"MISS_ITLB") == 0) return MISS_ITLB;
+	else if (strcmp(event_name,"MISS_DTLB") == 0) return MISS_DTLB;
+	else if (strcmp(event_name,"STLB_HIT") == 0) return STLB_HIT;
+	/* UNKNOWN Event */
+	else return UNKNOWN_EVENT;
+}
+
+/* Whether num entries of size bytes at off lie within a file of file_size bytes */
+static int elf_within(unsigned long long off, unsigned long long num, unsigned long long size, unsigned long long file_size)
+{
+	return off <= file_size && (size == 0 || num <= (file_size - off) / size);
+}
+
+/* Convert a function symbol of an ELF binary to the file offset used by uprobes */
+unsigned long long kleb_symbol_offset(const char* path, const char* symbol)
+{
+	struct stat st;
+	unsigned long long vaddr = 0, offset = 0;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return 0;
+	}
+	if(fstat(fd, &st) < 0 || (unsigned long long)st.st_size < sizeof(Elf64_Ehdr)){
+		close(fd);
+		return 0;
+	}
+	unsigned long long size = st.st_size;
+	unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		return 0;
+	}
+
+	/* Every offset and count comes from the file, check them before use */
+	Elf64_Ehdr *ehdr = (Elf64_Ehdr *)map;
+	if(memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+		!elf_within(ehdr->e_shoff, ehdr->e_shnum, sizeof(Elf64_Shdr), size) ||
+		!elf_within(ehdr->e_phoff, ehdr->e_phnum, sizeof(Elf64_Phdr), size)){
+		munmap(map, size);
+		return 0;
+	}
+
+	/* Search static then dynamic symbol tables */
+	Elf64_Shdr *shdr = (Elf64_Shdr *)(map + ehdr->e_shoff);
+	for(int i = 0; i < ehdr->e_shnum && !vaddr; ++i){
+		if(shdr[i].sh_type != SHT_SYMTAB && shdr[i].sh_type != SHT_DYNSYM){
+			continue;
+		}
+		unsigned long long num_syms = shdr[i].sh_size / sizeof(Elf64_Sym);
+		if(shdr[i].sh_link >= ehdr->e_shnum || !elf_within(shdr[i].sh_offset, num_syms, sizeof(Elf64_Sym), size)){
+			continue;
+		}
+		Elf64_Shdr *strsec = &shdr[shdr[i].sh_link];
+		if(!elf_within(strsec->sh_offset, strsec->sh_size, 1, size)){
+			continue;
+		}
+		Elf64_Sym *sym = (Elf64_Sym *)(map + shdr[i].sh_offset);
+		const char *strtab = (const char *)(map + strsec->sh_offset);
+		for(unsigned long long j = 0; j < num_syms; ++j){
+			/* Names must end within their string table */
+			if(ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value == 0 || sym[j].st_name >= strsec->sh_size ||
+				memchr(strtab + sym[j].st_name, '\0', strsec->sh_size - sym[j].st_name) == NULL){
+				continue;
+			}
+			if(strcmp(strtab + sym[j].st_name, symbol) == 0){
+				vaddr = sym[j].st_value;
+				break;
+			}
+		}
+	}
+
+	/* Translate the virtual address through the loadable segments */
+	Elf64_Phdr *phdr = (Elf64_Phdr *)(map + ehdr->e_phoff);
+	for(int i = 0; i < ehdr->e_phnum && vaddr; ++i){
+		if(phdr[i].p_type == PT_LOAD && vaddr >= phdr[i].p_vaddr && vaddr < phdr[i].p_vaddr + phdr[i].p_filesz){
+			offset = vaddr - phdr[i].p_vaddr + phdr[i].p_offset;
+			break;
+		}
+	}
+
+	munmap(map, size);
+	return offset;
+}
+
+kleb_session_t *kleb_session_open(void)
+{
+	kleb_session_t *s = calloc(1, sizeof(*s));
+	if(s == NULL){
+		return NULL;
+	}
+	s->fd = open(DEVICE_PATH, O_RDWR | O_CLOEXEC);
+	if(s->fd < 0){
+		free(s);
+		return NULL;
+	}
+
+	/* Default Timer & Monitoring Mode */
+	s->args.delay_in_ns = 10000000;
+	s->args.user_os_rec = 1; //User:1 OS:2 Both:3
+	return s;
+}
+
+void kleb_session_close(kleb_session_t *s)
+{
+	if(s == NULL){
+		return;
+	}
+	if(s->started){
+		kleb_stop(s);
+	}
+	if(s->map != NULL){
+		kleb_release(s);
+		munmap(s->map, s->map_len);
+	}
+	close(s->fd);
+	free(s);
+}
+
+kleb_ioctl_args_t *kleb_session_args(kleb_session_t *s)
+{
+	return &s->args;
+}
+
+/* Event by name or by hex code */
+int kleb_add_event(kleb_session_t *s, const char *event)
+{
+	unsigned int code;
+
+	if(s->args.num_events >= MAX_EVENTS){
+		return -ENOSPC;
+	}
+	if(isalpha((unsigned char)event[0])){
+		code = kleb_event_code(event);
+	}
+	else{
+		code = strtol(event, NULL, 16);
+	}
+	if(code == UNKNOWN_EVENT || code == 0){
+		return -EINVAL;
+	}
+	s->args.counter[s->args.num_events++] = code;
+	return 0;
+}
+
+int kleb_set_period_ns(kleb_session_t *s, unsigned int period_ns)
+{
+	if(period_ns == 0){
+		return -EINVAL;
+	}
+	s->args.delay_in_ns = period_ns;
+	return 0;
+}
+
+/* CPU list such as 0-15,32 into a mask of MAX_CPUS bits */
+static int parse_cpu_list(const char *list, unsigned long long *mask)
+{
+	const char *p = list;
+
+	memset(mask, 0, CPU_MASK_WORDS * sizeof(*mask));
+	while(*p && *p != '\n'){
+		char *end;
+		int first = strtol(p, &end, 10);
+		int last = first;
+		if(end == p){
+			return -EINVAL;
+		}
+		if(*end == '-'){
+			p = end+1;
+			last = strtol(p, &end, 10);
+		}
+		if(first < 0 || last < first || last >= MAX_CPUS){
+			return -EINVAL;
+		}
+		for(int cpu = first; cpu <= last; ++cpu){
+			mask[cpu / 64] |= 1ULL << (cpu % 64);
+		}
+		p = (*end == ',') ? end+1 : end;
+		if(*end != ',' && *end != '\0' && *end != '\n'){
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/* CPU list for system-wide mode */
+int kleb_set_cpu_list(kleb_session_t *s, const char *list)
+{
+	return parse_cpu_list(list, s->args.cpu_mask);
+}
+
+/* Events such as LOAD,STORE counted by one share of the CPUs in system-wide mode, returns the group */
+int kleb_add_event_group(kleb_session_t *s, const char *events)
+{
+	unsigned int g = s->args.num_event_groups;
+	unsigned int n = 0;
+	char list[256];
+
+	if(g >= MAX_EVENT_GROUPS){
+		return -ENOSPC;
+	}
+	snprintf(list, sizeof(list), "%s", events);
+	for(char *save, *event = strtok_r(list, ",", &save); event != NULL; event = strtok_r(NULL, ",", &save)){
+		unsigned int code = isalpha((unsigned char)event[0]) ? kleb_event_code(event) : (unsigned int)strtol(event, NULL, 16);
+		if(n >= MAX_EVENTS){
+			return -ENOSPC;
+		}
+		if(code == UNKNOWN_EVENT || code == 0){
+			return -EINVAL;
+		}
+		s->args.event_groups[g][n++] = code;
+	}
+	if(n == 0){
+		return -EINVAL;
+	}
+
+	/* Every group has the layout of the largest, counter[] is the first group */
+	if(n > s->args.num_events){
+		s->args.num_events = n;
+	}
+	if(g == 0){
+		memcpy(s->args.counter, s->args.event_groups[0], sizeof(s->args.event_groups[0]));
+	}
+	s->args.num_event_groups = g + 1;
+	return g;
+}
+
+/* CPU list of every event group in order, separated by '/', e.g. 0-15/16-31.
+   Monitored CPUs in none of the lists run group 0. */
+int kleb_set_event_map(kleb_session_t *s, const char *map)
+{
+	unsigned long long mask[CPU_MASK_WORDS];
+	char lists[1024];
+	unsigned int g = 0;
+
+	snprintf(lists, sizeof(lists), "%s", map);
+	memset(s->args.cpu_event_group, 0, sizeof(s->args.cpu_event_group));
+	for(char *save, *list = strtok_r(lists, "/", &save); list != NULL; list = strtok_r(NULL, "/", &save), ++g){
+		if(g >= MAX_EVENT_GROUPS || parse_cpu_list(list, mask) < 0){
+			return -EINVAL;
+		}
+		for(int cpu = 0; cpu < MAX_CPUS; ++cpu){
+			if((mask[cpu / 64] >> (cpu % 64)) & 1){
+				s->args.cpu_event_group[cpu] = g;
+			}
+		}
+	}
+	s->args.event_map = 1;
+	return 0;
+}
+
+/* Function given as <binary>:<symbol>, returns its id */
+int kleb_add_function(kleb_session_t *s, const char *spec)
+{
+	char path[256];
+	const char *sep = strrchr(spec, ':');
+	int id = s->num_uprobes;
+
+	if(sep == NULL || sep - spec >= (long)sizeof(path)){
+		return -EINVAL;
+	}
+	if(id >= MAX_UPROBES){
+		return -ENOSPC;
+	}
+	memcpy(path, spec, sep - spec);
+	path[sep - spec] = '\0';
+	if(realpath(path, s->uprobes[id].path) == NULL){
+		return -ENOENT;
+	}
+	strncpy(s->names[id], sep+1, sizeof(s->names[0])-1);
+	s->uprobes[id].offset = kleb_symbol_offset(s->uprobes[id].path, s->names[id]);
+	s->uprobes[id].id = id;
+	if(s->uprobes[id].offset == 0){
+		return -ENOENT;
+	}
+	++s->num_uprobes;
+	return id;
+}
+
+const char *kleb_function_name(kleb_session_t *s, unsigned int id)
+{
+	return (id < (unsigned int)s->num_uprobes) ? s->names[id] : NULL;
+}
+
+/* Samples of pid and its descendants carry the returned group */
+int kleb_add_target(kleb_session_t *s, int pid)
+{
+	if(pid <= 1){
+		return -EINVAL;
+	}
+	if(s->args.num_targets >= MAX_TARGETS){
+		return -ENOSPC;
+	}
+	s->args.targets[s->args.num_targets] = pid;
+	return s->args.num_targets++;
+}
+
+int kleb_num_counters(kleb_session_t *s)
+{
+	return s->args.num_events + NUM_FIXED_COUNTERS + (s->args.topdown ? NUM_TOPDOWN_COUNTERS : 0) +
+		(s->args.rapl ? NUM_ENERGY_COUNTERS : 0);
+}
+
+int kleb_start(kleb_session_t *s, int pid)
+{
+	if(s->started){
+		return -EBUSY;
+	}
+	s->args.pid = (s->args.num_targets > 0) ? s->args.targets[0] : pid;
+	/* The module drops the queued uprobes when a registration or the START fails, so a retry starts clean */
+	for(int i = 0; i < s->num_uprobes; ++i){
+		if(ioctl(s->fd, IOCTL_UPROBE, &s->uprobes[i]) < 0){
+			return -errno;
+		}
+	}
+	if(ioctl(s->fd, IOCTL_START, &s->args) < 0){
+		return -errno;
+	}
+	s->started = 1;
+
+	/* Control page then the records */
+	s->map_len = sysconf(_SC_PAGESIZE) + s->args.buffer_size;
+	s->map = mmap(NULL, s->map_len, PROT_READ, MAP_SHARED, s->fd, 0);
+	if(s->map == MAP_FAILED){
+		s->map = NULL;
+		kleb_stop(s);
+		return -errno;
+	}
+	s->ctrl = s->map;
+	s->data = (const unsigned long long *)((const char *)s->map + sysconf(_SC_PAGESIZE));
+	s->size = s->ctrl->size;
+	s->pos = s->released = 0;
+	s->lost = s->reported = 0;
+	return 0;
+}
+
+/* Records stay mapped until the session is closed */
+int kleb_stop(kleb_session_t *s)
+{
+	if(!s->started){
+		return -EINVAL;
+	}
+	s->started = 0;
+	if(ioctl(s->fd, IOCTL_STOP, &s->args) < 0){
+		return -errno;
+	}
+	return 0;
+}
+
+/* Sleep until the ring is half full, recording stopped or timeout */
+int kleb_wait(kleb_session_t *s, const struct timespec *timeout)
+{
+	struct pollfd pfd = { s->fd, POLLIN, 0 };
+	int ret = ppoll(&pfd, 1, timeout, NULL);
+	return (ret < 0) ? -errno : ret;
+}
+
+/* Next sample in the ring, 1 when one is returned and 0 when the ring is empty */
+int kleb_next(kleb_session_t *s, kleb_sample_t *sample)
+{
+	unsigned long long head, off;
+	const kleb_record_t *rec;
+
+	if(s->ctrl == NULL){
+		return 0;
+	}
+	head = __atomic_load_n(&s->ctrl->head, __ATOMIC_ACQUIRE);
+	while(s->pos < head){
+		/* Records overwritten by the module are reported as lost */
+		if(s->pos < __atomic_load_n(&s->ctrl->drop, __ATOMIC_ACQUIRE)){
+			s->pos = __atomic_load_n(&s->ctrl->drop, __ATOMIC_ACQUIRE);
+			unsigned long long overwritten = __atomic_load_n(&s->ctrl->overwritten, __ATOMIC_ACQUIRE);
+			s->lost += overwritten - s->reported;
+			s->reported = overwritten;
+			continue;
+		}
+
+		off = s->pos % s->size;
+		rec = (const kleb_record_t *)&s->data[off];
+		if(s->size - off < RECORD_HDR_WORDS){
+			s->pos += s->size - off;
+			continue;
+		}
+
+		/* The module may reuse the space while overwriting, check a copy that stays within the ring */
+		unsigned long long words = s->size - off;
+		if(s->args.overflow == OVERFLOW_OVERWRITE){
+			words = __atomic_load_n(&rec->size, __ATOMIC_RELAXED);
+			if(words > KLEB_MAX_RECORD_WORDS){
+				words = KLEB_MAX_RECORD_WORDS;
+			}
+			if(words > s->size - off){
+				words = s->size - off;
+			}
+			if(words < RECORD_HDR_WORDS){
+				words = RECORD_HDR_WORDS;
+			}
+			memcpy(s->scratch, rec, words * sizeof(unsigned long long));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(s->pos < __atomic_load_n(&s->ctrl->drop, __ATOMIC_ACQUIRE)){
+				continue;
+			}
+			rec = (const kleb_record_t *)s->scratch;
+		}
+
+		if(rec->type == REC_PAD){
+			s->pos += s->size - off;
+			continue;
+		}
+		if(rec->size < RECORD_HDR_WORDS || rec->size > words){
+			/* Corrupt stream, the record would not fit where it was read */
+			return -EIO;
+		}
+		s->pos += rec->size;
+		if(rec->type == REC_LOST){
+			s->lost += ((const unsigned long long *)rec)[RECORD_HDR_WORDS];
+			continue;
+		}
+		if(rec->type == REC_LBR || rec->type == REC_PEBS){
+			/* Losses stay with the next sample */
+			sample->rec = rec;
+			sample->counters = (const unsigned long long *)rec + RECORD_HDR_WORDS;
+			sample->lost = 0;
+			return 1;
+		}
+		if(rec->type != REC_SAMPLE){
+			continue;
+		}
+		sample->rec = rec;
+		sample->counters = (const unsigned long long *)rec + RECORD_HDR_WORDS;
+		sample->lost = s->lost;
+		s->lost = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Hand iterated records back to the module */
+int kleb_release(kleb_session_t *s)
+{
+	if(s->pos == s->released){
+		return 0;
+	}
+	if(ioctl(s->fd, IOCTL_RING_CONSUME, (unsigned long)s->pos) < 0){
+		return -errno;
+	}
+	s->released = s->pos;
+	return 0;
+}
+
+/* Stream every available sample to fn, returns the number of samples */
+int kleb_drain(kleb_session_t *s, kleb_sample_fn fn, void *ctx)
+{
+	kleb_sample_t sample;
+	int count = 0;
+	int ret;
+
+	while((ret = kleb_next(s, &sample)) > 0){
+		if(sample.rec->type == REC_SAMPLE){
+			++count;
+		}
+		if(fn(&sample, ctx)){
+			break;
+		}
+	}
+	if(ret < 0){
+		return ret;
+	}
+	ret = kleb_release(s);
+	return (ret < 0) ? ret : count;
+}
+
+int kleb_func_stats(kleb_session_t *s, kleb_func_stats_t *entries, unsigned int num_entries)
+{
+	kleb_uprobe_stats_args_t stats_args = { num_entries, entries };
+	int ret = ioctl(s->fd, IOCTL_UPROBE_STATS, &stats_args);
+	return (ret < 0) ? -errno : ret;
+}
+
+int kleb_task_stats(kleb_session_t *s, kleb_task_stats_t *entries, unsigned int num_entries)
+{
+	kleb_task_stats_args_t stats_args = { num_entries, entries };
+	int ret = ioctl(s->fd, IOCTL_TASK_STATS, &stats_args);
+	return (ret < 0) ? -errno : ret;
+}
+
+/* Joules per energy unit, from MSR_RAPL_POWER_UNIT once started */
+double kleb_energy_unit(kleb_session_t *s)
+{
+	return 1.0 / (double)(1ULL << ((s->args.rapl_unit >> 8) & 0x1f));
+}
+
+int kleb_ring_node(kleb_session_t *s)
+{
+	return s->args.ring_node;
+}
+
+/* Pin the calling thread to the CPUs of the ring's node, so draining reads local memory */
+int kleb_bind_ring_node(kleb_session_t *s)
+{
+	char path[64], list[1024];
+	unsigned long long mask[CPU_MASK_WORDS];
+	cpu_set_t set;
+
+	if(!s->started){
+		return -EINVAL;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", s->args.ring_node);
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL){
+		return -errno;
+	}
+	if(fgets(list, sizeof(list), fp) == NULL){
+		fclose(fp);
+		return -EIO;
+	}
+	fclose(fp);
+	if(parse_cpu_list(list, mask) < 0){
+		return -EINVAL;
+	}
+	CPU_ZERO(&set);
+	for(int cpu = 0; cpu < MAX_CPUS; ++cpu){
+		if((mask[cpu / 64] >> (cpu % 64)) & 1){
+			CPU_SET(cpu, &set);
+		}
+	}
+	return (sched_setaffinity(0, sizeof(set), &set) < 0) ? -errno : 0;
+}
+
+int kleb_timer_stats(kleb_session_t *s, kleb_timer_stats_t *stats)
+{
+	return (ioctl(s->fd, IOCTL_TIMER_STATS, stats) < 0) ? -errno : 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2017, 2024 James Bruska, Caleb DeLaBruere, Chutitep Woralert
+
+This file is part of K-LEB.
+
+K-LEB is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+K-LEB is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with K-LEB.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* libkleb: start and stop K-LEB in-process and iterate its samples.
+   Functions return 0 or a negative errno and never exit. */
+#ifndef LIBKLEB_H
+#define LIBKLEB_H
+
+#include <time.h>
+#include "kleb.h"
+
+typedef struct kleb_session kleb_session_t;
+
+/* Sample handed out by the iterator, valid until kleb_release().
+   With LBR a REC_LBR record follows the samples of a tick for each CPU,
+   its counters are from and to addresses of the branches. With PEBS,
+   REC_PEBS records hold instruction, data address and latency triples. */
+typedef struct {
+	const kleb_record_t *rec;
+	const unsigned long long *counters;	// Configured events then the fixed counters
+	unsigned long long lost;		// Samples lost just before this one
+} kleb_sample_t;
+
+/* Binary log written by ioctl_start -B, followed by the records as found in the ring */
+#define KLEB_LOG_MAGIC 0x42454c4b	// "KLEB"
+typedef struct {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int num_events;
+	unsigned int counter[MAX_EVENTS];
+	unsigned int flags;	// KLEB_LOG_*
+	unsigned int rapl_unit;	// MSR_RAPL_POWER_UNIT with KLEB_LOG_ENERGY
+	unsigned int reserved;
+} kleb_log_header_t;
+#define KLEB_LOG_TOPDOWN 1	// Samples carry the top-down counters
+#define KLEB_LOG_ENERGY 2	// Samples end with the energy counters
+
+/* Streaming callback, a non-zero return stops the drain */
+typedef int (*kleb_sample_fn)(const kleb_sample_t *sample, void *ctx);
+
+/* Session */
+kleb_session_t *kleb_session_open(void);
+void kleb_session_close(kleb_session_t *s);
+kleb_ioctl_args_t *kleb_session_args(kleb_session_t *s);
+
+/* Configuration, before kleb_start() */
+int kleb_add_event(kleb_session_t *s, const char *event);
+int kleb_set_period_ns(kleb_session_t *s, unsigned int period_ns);
+int kleb_set_cpu_list(kleb_session_t *s, const char *list);
+int kleb_add_event_group(kleb_session_t *s, const char *events);
+int kleb_set_event_map(kleb_session_t *s, const char *map);
+int kleb_add_function(kleb_session_t *s, const char *spec);
+const char *kleb_function_name(kleb_session_t *s, unsigned int id);
+int kleb_num_counters(kleb_session_t *s);
+
+/* Processes with their own sample group, returns the group */
+int kleb_add_target(kleb_session_t *s, int pid);
+
+/* Recording, pid 1 monitors the whole system, pid is ignored once targets are added */
+int kleb_start(kleb_session_t *s, int pid);
+int kleb_stop(kleb_session_t *s);
+
+/* Zero-copy iteration over the mapped ring */
+int kleb_wait(kleb_session_t *s, const struct timespec *timeout);
+int kleb_next(kleb_session_t *s, kleb_sample_t *sample);
+int kleb_release(kleb_session_t *s);
+int kleb_drain(kleb_session_t *s, kleb_sample_fn fn, void *ctx);
+
+/* Totals, after kleb_stop() */
+int kleb_func_stats(kleb_session_t *s, kleb_func_stats_t *entries, unsigned int num_entries);
+int kleb_task_stats(kleb_session_t *s, kleb_task_stats_t *entries, unsigned int num_entries);
+int kleb_timer_stats(kleb_session_t *s, kleb_timer_stats_t *stats);
+double kleb_energy_unit(kleb_session_t *s);
+
+/* NUMA placement of the ring, after kleb_start() */
+int kleb_ring_node(kleb_session_t *s);
+int kleb_bind_ring_node(kleb_session_t *s);
+
+/* Helpers */
+unsigned int kleb_event_code(const char *event_name);
+unsigned long long kleb_symbol_offset(const char *path, const char *symbol);
+
+#endif // LIBKLEB_H